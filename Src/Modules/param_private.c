@@ -720,6 +720,7 @@ cleanup_(Module m)
     *(Builtin)hn = save_local;
 
     removehashnode(reswdtab, "private");
+    clearparsecache();
     
     realparamtab->getnode = getparamnode;
     realparamtab->getnode2 = save_getnode2;
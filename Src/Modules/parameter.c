@@ -931,6 +931,122 @@ dispatcharsgetfn(UNUSED(Param pm))
     return getpatchars(1);
 }
 
+/*
+ * Functions for the patcache and parsecache special parameters,
+ * which give the statistics for a cache.
+ */
+
+static char *cachestatkeys[] = {
+    "entries", "hits", "misses", "evictions", NULL
+};
+
+static char *
+cachestatval(int i, int count, zlong hits, zlong misses, zlong evictions)
+{
+    char buf[DIGBUFSIZE];
+
+    switch (i) {
+    case 0:
+	sprintf(buf, "%d", count);
+	break;
+    case 1:
+	convbase(buf, hits, 10);
+	break;
+    case 2:
+	convbase(buf, misses, 10);
+	break;
+    default:
+	convbase(buf, evictions, 10);
+	break;
+    }
+    return dupstring(buf);
+}
+
+static char *
+patcacheval(int i)
+{
+    return cachestatval(i, patcachecount, patcachehits, patcachemisses,
+			patcacheevictions);
+}
+
+static char *
+parsecacheval(int i)
+{
+    return cachestatval(i, parsecachecount, parsecachehits,
+			parsecachemisses, parsecacheevictions);
+}
+
+static HashNode
+getcachestat(const char *name, char *(*valfn)(int))
+{
+    Param pm;
+    int i;
+
+    pm = (Param) hcalloc(sizeof(struct param));
+    pm->node.nam = dupstring(name);
+    pm->node.flags = PM_SCALAR | PM_READONLY;
+    pm->gsu.s = &nullsetscalar_gsu;
+
+    for (i = 0; cachestatkeys[i]; i++)
+	if (!strcmp(name, cachestatkeys[i]))
+	    break;
+    if (cachestatkeys[i])
+	pm->u.str = valfn(i);
+    else {
+	pm->u.str = dupstring("");
+	pm->node.flags |= (PM_UNSET|PM_SPECIAL);
+    }
+    return &pm->node;
+}
+
+static void
+scancachestat(ScanFunc func, int flags, char *(*valfn)(int))
+{
+    struct param pm;
+    int i;
+
+    memset((void *)&pm, 0, sizeof(struct param));
+    pm.node.flags = PM_SCALAR | PM_READONLY;
+    pm.gsu.s = &nullsetscalar_gsu;
+
+    for (i = 0; cachestatkeys[i]; i++) {
+	pm.node.nam = cachestatkeys[i];
+	if (func != scancountparams &&
+	    ((flags & (SCANPM_WANTVALS|SCANPM_MATCHVAL)) ||
+	     !(flags & SCANPM_WANTKEYS)))
+	    pm.u.str = valfn(i);
+	func(&pm.node, flags);
+    }
+}
+
+/**/
+static HashNode
+getpmpatcache(UNUSED(HashTable ht), const char *name)
+{
+    return getcachestat(name, patcacheval);
+}
+
+/**/
+static void
+scanpmpatcache(UNUSED(HashTable ht), ScanFunc func, int flags)
+{
+    scancachestat(func, flags, patcacheval);
+}
+
+/**/
+static HashNode
+getpmparsecache(UNUSED(HashTable ht), const char *name)
+{
+    return getcachestat(name, parsecacheval);
+}
+
+/**/
+static void
+scanpmparsecache(UNUSED(HashTable ht), ScanFunc func, int flags)
+{
+    scancachestat(func, flags, parsecacheval);
+}
+
 /* Functions for the options special parameter. */
 
 /**/
@@ -2304,6 +2420,10 @@ static struct paramdef partab[] = {
 	    &pmoptions_gsu, getpmoption, scanpmoptions),
     SPECIALPMDEF("parameters", PM_READONLY_SPECIAL,
 	    NULL, getpmparameter, scanpmparameters),
+    SPECIALPMDEF("parsecache", PM_READONLY_SPECIAL,
+	    NULL, getpmparsecache, scanpmparsecache),
+    SPECIALPMDEF("patcache", PM_READONLY_SPECIAL,
+	    NULL, getpmpatcache, scanpmpatcache),
     SPECIALPMDEF("patchars", PM_ARRAY|PM_READONLY_SPECIAL,
 	    &patchars_gsu, NULL, NULL),
     SPECIALPMDEF("reswords", PM_ARRAY|PM_READONLY_SPECIAL,
@@ -492,7 +492,7 @@ historysearchbackward(char **args)
 	return 1;
 
     metafy_line();
-    while ((he = movehistent(he, -1, hist_skip_flags))) {
+    while ((he = movehistentmatch(he, -1, hist_skip_flags, str))) {
 	if (isset(HISTFINDNODUPS) && he->node.flags & HIST_DUP)
 	    continue;
 	zt = GETZLETEXT(he);
@@ -549,7 +549,7 @@ historysearchforward(char **args)
 	return 1;
 
     metafy_line();
-    while ((he = movehistent(he, 1, hist_skip_flags))) {
+    while ((he = movehistentmatch(he, 1, hist_skip_flags, str))) {
 	if (isset(HISTFINDNODUPS) && he->node.flags & HIST_DUP)
 	    continue;
 	zt = GETZLETEXT(he);
@@ -1410,7 +1410,9 @@ doisearch(char **args, int dir, int pattern)
 		 * the history to try again.
 		 */
 		if (!(zlereadflags & ZLRF_HISTORY)
-		 || !(he = movehistent(he, dir, hist_skip_flags))) {
+		 || !(he = pattern ? movehistent(he, dir, hist_skip_flags) :
+		      movehistentmatch(he, dir, hist_skip_flags,
+				       sbuf + (sbuf[0] == '^')))) {
 		    if (sbptr == (int)isrch_spots[top_spot-1].len
 		     && (isrch_spots[top_spot-1].flags >> ISS_NOMATCH_SHIFT))
 			top_spot--;
@@ -2002,7 +2004,8 @@ virepeatsearch(UNUSED(char **args))
     if (!(he = quietgethist(histline)))
 	return 1;
     metafy_line();
-    while ((he = movehistent(he, visrchsense, hist_skip_flags))) {
+    while ((he = movehistentmatch(he, visrchsense, hist_skip_flags,
+				  visrchstr + (*visrchstr == '^')))) {
 	if (isset(HISTFINDNODUPS) && he->node.flags & HIST_DUP)
 	    continue;
 	zt = GETZLETEXT(he);
@@ -109,30 +109,6 @@ ZR_strlen(const REFRESH_ELEMENT *wstr)
     return len;
 }
 
-/*
- * Simplified strcmp: we don't need the sign, just whether
- * the strings and their attributes are equal.
- *
- * In the multibyte case, the two elements must be in the order
- * element from old video array, element from new video array.
- */
-static int
-ZR_strncmp(const REFRESH_ELEMENT *oldwstr, const REFRESH_ELEMENT *newwstr,
-	   int len)
-{
-    while (len--) {
-	if ((!(oldwstr->atr & TXT_MULTIWORD_MASK) && !oldwstr->chr) ||
-	    (!(newwstr->atr & TXT_MULTIWORD_MASK) && !newwstr->chr))
-	    return !ZR_equal(*oldwstr, *newwstr);
-	if (!ZR_equal(*oldwstr, *newwstr))
-	    return 1;
-	oldwstr++;
-	newwstr++;
-    }
-
-    return 0;
-}
-
 #include "zle_refresh.pro"
 
 /*
@@ -969,6 +945,114 @@ bufswap(void)
 #endif
 }
 
+/*
+ * Test whether line oln of the old video buffer shows the same as
+ * line nln of the new one.  Trailing blanks are ignored, as
+ * refreshline() leaves those in the old buffer when it clears a line.
+ * Returns the number of non-blank cells if the lines match, else -1.
+ */
+static int
+samevideoline(int oln, int nln)
+{
+    REFRESH_STRING ol = obuf[oln], nl = nbuf[nln];
+    int cells = 0;
+
+    if (!ol || !nl)
+	return -1;
+    for (; ol->chr && nl->chr; ol++, nl++) {
+	if (!ZR_equal(*ol, *nl))
+	    return -1;
+	if (nl->chr != ZWC(' '))
+	    cells++;
+    }
+    for (; ol->chr; ol++)
+	if (ol->chr != ZWC(' ') || (ol->atr != 0 && ol->atr != prompt_attr))
+	    return -1;
+    for (; nl->chr; nl++)
+	if (nl->chr != ZWC(' ') || (nl->atr != 0 && nl->atr != prompt_attr))
+	    return -1;
+    return cells;
+}
+
+/*
+ * Estimate the output needed to turn old line ol on the screen into
+ * new line nl, either of which may be NULL for a blank line: a
+ * character for each cell that differs, and a bit to get there.
+ */
+static int
+videolinecost(REFRESH_STRING ol, REFRESH_STRING nl)
+{
+    static REFRESH_ELEMENT nullchr = { ZWC('\0'), 0 };
+    int cost = 0;
+
+    if (!ol)
+	ol = &nullchr;
+    if (!nl)
+	nl = &nullchr;
+    for (; ol->chr && nl->chr; ol++, nl++)
+	if (!ZR_equal(*ol, *nl))
+	    cost++;
+    for (; nl->chr; nl++)
+	cost++;
+    for (; ol->chr; ol++)
+	if (ol->chr != ZWC(' ')) {
+	    cost += tclen[TCCLEAREOL];
+	    break;
+	}
+    return cost ? cost + 4 : 0;
+}
+
+/*
+ * See whether deleting or inserting some lines at line ln brings the
+ * old lines below it to where they are now wanted for less output
+ * than updating the lines where they are, as when a long buffer
+ * scrolls.  Returns the number of lines to delete, minus the number
+ * to insert, or 0 to leave the screen as it is.
+ */
+static int
+videolineshift(int ln)
+{
+    int shift, oln, nln, cost, best = 0, bestcost = 0;
+
+    for (nln = ln; nln < nlnct; nln++)
+	bestcost += videolinecost(nln < olnct ? obuf[nln] : NULL, nbuf[nln]);
+
+    for (shift = 1; ln + shift < olnct || ln + shift < nlnct; shift++) {
+	if (tccan(TCDELLINE) && ln + shift < olnct &&
+	    samevideoline(ln + shift, ln) > 0) {
+	    cost = tcmultcost(TCDELLINE, TCMULTDELLINE, shift);
+	    for (nln = ln; nln < nlnct && cost < bestcost; nln++) {
+		oln = nln + shift;
+		cost += videolinecost(oln < olnct ? obuf[oln] : NULL,
+				      nbuf[nln]);
+	    }
+	    if (cost < bestcost)
+		best = shift, bestcost = cost;
+	}
+	/*
+	 * Inserting lines pushes lines down into the area we have
+	 * used before.  Any more that would be pushed beyond that are
+	 * deleted first, so nothing below the area moves.
+	 */
+	if (tccan(TCINSLINE) && ln + shift < nlnct &&
+	    (olnct + shift <= vmaxln ||
+	     (tccan(TCDELLINE) && ln + shift < vmaxln)) &&
+	    samevideoline(ln, ln + shift) > 0) {
+	    cost = tcmultcost(TCINSLINE, TCMULTINSLINE, shift);
+	    if (olnct + shift > vmaxln)
+		cost += 4 + tcmultcost(TCDELLINE, TCMULTDELLINE,
+				       olnct + shift - vmaxln);
+	    for (nln = ln; nln < nlnct && cost < bestcost; nln++) {
+		oln = nln - shift;
+		cost += videolinecost(oln >= ln && oln < olnct ?
+				      obuf[oln] : NULL, nbuf[nln]);
+	    }
+	    if (cost < bestcost)
+		best = -shift, bestcost = cost;
+	}
+    }
+    return best;
+}
 
 /**/
 mod_export void
@@ -976,13 +1060,17 @@ zrefresh(void)
 {
     static int inlist;		/* avoiding recursion			     */
     int iln;			/* current line as index in loops	     */
-    int t0 = -1;		/* tmp					     */
+    int shift;			/* lines to delete (insert if negative)	     */
+    int t0 = -1, t1;		/* tmp					     */
     ZLE_STRING_T tmpline,	/* line with added pre/post text	     */
 	t,			/* pointer into the real buffer		     */
 	scs,			/* pointer to cursor position in real buffer */
 	u;			/* pointer for status line stuff	     */
     int tmpcs, tmpll;		/* ditto cursor position and line length     */
     int tmppos;			/* t - tmpline				     */
+    int attrnext = 0;		/* next tmppos where highlighting changes    */
+    zattr base_attr = 0,	/* highlighting at tmppos		     */
+	all_attr = 0;		/* ditto, for text shown specially	     */
     int tmpalloced;		/* flag to free tmpline when finished	     */
     int remetafy;		/* flag that zle line is metafied	     */
     int rprompt_off = 1;	/* Offset of rprompt from right of screen    */
@@ -1170,7 +1258,6 @@ zrefresh(void)
 	    vcs = 0;
 	    moveto(0, lpromptw);
 	}
-	fflush(shout);
 	clearf = clearflag;
     } else if (winw != zterm_columns || rwinh != zterm_lines)
 	resetvideo();
@@ -1206,42 +1293,55 @@ zrefresh(void)
     rpms.s = nbuf[rpms.ln = 0] + lpromptw;
     rpms.sen = *nbuf + winw;
     for (t = tmpline, tmppos = 0; tmppos < tmpll; t++, tmppos++) {
-	zattr base_attr = mixattrs(default_attr, default_mask, prompt_attr);
-	zattr all_attr = 0;
-	struct region_highlight *rhp;
-	int layer, nextlayer = 0;
 	/*
-	 * Calculate attribute based on region.
+	 * Calculate attribute based on region.  This only changes
+	 * where a region starts or ends, so the result is kept
+	 * until the next such position, attrnext.
 	 */
-	do {
-	    unsigned ireg;
-	    layer = nextlayer;
-	    nextlayer = special_layer;
-	    for (ireg = 0, rhp = region_highlights;
-		ireg < n_region_highlights;
-		ireg++, rhp++) {
-		if (rhp->layer == layer) {
+	if (tmppos >= attrnext) {
+	    struct region_highlight *rhp;
+	    int layer, nextlayer = 0;
+
+	    base_attr = mixattrs(default_attr, default_mask, prompt_attr);
+	    all_attr = 0;
+	    attrnext = tmpll;
+	    do {
+		unsigned ireg;
+		layer = nextlayer;
+		nextlayer = special_layer;
+		for (ireg = 0, rhp = region_highlights;
+		     ireg < n_region_highlights;
+		     ireg++, rhp++) {
 		    int offset;
 		    if (rhp->flags & ZRH_PREDISPLAY)
 			offset = 0;	/* include predisplay in start end */
 		    else
 			offset = predisplaylen; /* increment over it */
-		    if (rhp->start + offset <= tmppos &&
-			tmppos < rhp->end + offset) {
-			base_attr = mixattrs(rhp->atr, rhp->atrmask, base_attr);
-			if (layer > special_layer)
-			    all_attr = mixattrs(rhp->atr, rhp->atrmask,
-				    all_attr);
+		    if (rhp->layer == layer) {
+			if (rhp->start + offset <= tmppos &&
+			    tmppos < rhp->end + offset) {
+			    base_attr = mixattrs(rhp->atr, rhp->atrmask,
+						 base_attr);
+			    if (layer > special_layer)
+				all_attr = mixattrs(rhp->atr, rhp->atrmask,
+						    all_attr);
+			}
+			if (rhp->start + offset > tmppos &&
+			    rhp->start + offset < attrnext)
+			    attrnext = rhp->start + offset;
+			if (rhp->end + offset > tmppos &&
+			    rhp->end + offset < attrnext)
+			    attrnext = rhp->end + offset;
+		    } else if (rhp->layer > layer &&
+			       (rhp->layer < nextlayer || nextlayer <= layer)) {
+			nextlayer = rhp->layer;
 		    }
-		} else if (rhp->layer > layer &&
-			(rhp->layer < nextlayer || nextlayer <= layer)) {
-		    nextlayer = rhp->layer;
 		}
-	    }
-	    if (special_layer == layer) {
-		all_attr = mixattrs(special_attr, special_mask, base_attr);
-	    }
-	} while (nextlayer > layer);
+		if (special_layer == layer) {
+		    all_attr = mixattrs(special_attr, special_mask, base_attr);
+		}
+	    } while (nextlayer > layer);
+	}
 
 	if (t == scs)			/* if cursor is here, remember it */
 	    rpms.nvcs = rpms.s - nbuf[rpms.nvln = rpms.ln];
@@ -1674,35 +1774,43 @@ zrefresh(void)
 	    cleareol = 1;
 
     /* if old line and new line are different,
-       see if we can insert/delete a line to speed up update */
+       see if we can insert/delete lines to speed up update */
 
 	if (!clearf && iln > 0 && iln < olnct - 1 &&
 	    !(hasam && vcs == winw) &&
-	    nbuf[iln] && obuf[iln] &&
-	    ZR_strncmp(obuf[iln], nbuf[iln], 16)) {
-	    if (tccan(TCDELLINE) && obuf[iln + 1] &&
-		obuf[iln + 1][0].chr && nbuf[iln] &&
-		!ZR_strncmp(obuf[iln + 1], nbuf[iln], 16)) {
-		moveto(iln, 0);
-		tcout(TCDELLINE);
-		zfree(obuf[iln], (winw + 2) * sizeof(**obuf));
-		for (t0 = iln; t0 != olnct; t0++)
-		    obuf[t0] = obuf[t0 + 1];
-		obuf[olnct--] = NULL;
-	    }
-	/* don't try to insert a line if olnct = vmaxln (vmaxln is the number
-	   of lines that have been displayed by this routine) so that we don't
-	   go off the end of the screen. */
+	    samevideoline(iln, iln) < 0 &&
+	    (shift = videolineshift(iln))) {
+	    REFRESH_STRING s;
 
-	    else if (tccan(TCINSLINE) && olnct < vmaxln && nbuf[iln + 1] &&
-		     obuf[iln] && !ZR_strncmp(obuf[iln], nbuf[iln + 1], 16)) {
+	    if (shift > 0) {
+		/* lines from below move up, leaving blank lines at the end */
+		moveto(iln, 0);
+		(void) tcmultout(TCDELLINE, TCMULTDELLINE, shift);
+		for (t0 = 0; t0 < shift; t0++) {
+		    s = obuf[iln];
+		    for (t1 = iln; t1 < winh; t1++)
+			obuf[t1] = obuf[t1 + 1];
+		    obuf[winh] = s;
+		}
+		olnct -= shift;
+	    } else {
+		/* lines move down, making room for them first */
+		shift = -shift;
+		if ((t0 = olnct + shift - vmaxln) > 0) {
+		    moveto(olnct - t0, 0);
+		    (void) tcmultout(TCDELLINE, TCMULTDELLINE, t0);
+		    olnct -= t0;
+		}
 		moveto(iln, 0);
-		tcout(TCINSLINE);
-		zfree(obuf[olnct], (winw + 2) * sizeof(**obuf));
-		for (t0 = olnct; t0 != iln; t0--)
-		    obuf[t0] = obuf[t0 - 1];
-		obuf[iln] = NULL;
-		olnct++;
+		(void) tcmultout(TCINSLINE, TCMULTINSLINE, shift);
+		for (t0 = 0; t0 < shift; t0++) {
+		    s = obuf[winh];
+		    for (t1 = winh; t1 > iln; t1--)
+			obuf[t1] = obuf[t1 - 1];
+		    if ((obuf[iln] = s))
+			*s = zr_zr;
+		}
+		olnct += shift;
 	    }
 	}
 
@@ -1876,13 +1984,14 @@ refreshline(int ln)
 	col_cleareol = -2;	/* clearing eol would be evil so don't */
     else {
 	col_cleareol = -1;
-	if (tccan(TCCLEAREOL) && (nllen == winw || put_rpmpt != oput_rpmpt)) {
+	if (tccan(TCCLEAREOL) && nllen &&
+	    (nllen == winw || ln || !put_rpmpt || !oput_rpmpt)) {
 	    zattr a = nl[nllen - 1].atr;
 	    for (i = nllen; i && nl[i - 1].chr == ' ' && nl[i - 1].atr == a; i--)
 		;
 	    if (nllen == winw && i < nllen) {
 		col_cleareol = i;
-            } else {
+            } else if (ollen) {
 		a = ol[ollen - 1].atr;
 		for (j = ollen; j && ol[j - 1].chr == ' ' && ol[j - 1].atr == a; j--)
 		    ;
@@ -2155,6 +2264,96 @@ refreshline(int ln)
     }
 }
 
+/*
+ * Test whether the cursor can be moved from column from to column to
+ * on line ln by writing out the characters that are already there.
+ * They must be on the screen, be single-width and have the attributes
+ * that are in effect already, so that nothing else needs outputting.
+ */
+
+/**/
+static int
+canrewrite(int ln, int from, int to)
+{
+    REFRESH_STRING t;
+    int i;
+
+    if (to >= winw || !nbuf[ln] || (!ln && from < lpromptw) ||
+	txtunknownattrs)
+	return 0;
+    for (i = 0, t = nbuf[ln]; i < to; i++, t++) {
+	if (!t->chr)
+	    return 0;
+	if (i >= from && (t->atr != txtcurrentattrs ||
+			  (t->atr & TXT_MULTIWORD_MASK)
+#ifdef MULTIBYTE_SUPPORT
+			  || t->chr == WEOF
+#endif
+		))
+	    return 0;
+    }
+#ifdef MULTIBYTE_SUPPORT
+    /* don't stop in the middle of a wide character */
+    return t->chr != WEOF;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Cost of moving right from column from to column to with a single
+ * capability, or -1 if the terminal has none.
+ */
+
+/**/
+static int
+rightmotioncost(int from, int to)
+{
+    if (tccan(TCMULTRIGHT))
+	return tcargcost(TCMULTRIGHT, to - from);
+    if (tccan(TCHORIZPOS))
+	return tcargcost(TCHORIZPOS, to);
+    return -1;
+}
+
+/* Cost of tc_rightcurs() from column from to column to on line ln */
+
+/**/
+static int
+rightcurscost(int ln, int from, int to)
+{
+    int cost = rightmotioncost(from, to);
+
+    if (cost < 0 || (to - from < cost && canrewrite(ln, from, to)))
+	return to - from;
+    return cost;
+}
+
+/*
+ * Cost of the cheapest way for singmoveto() to get from column from
+ * to column to on line ln: directly, or via the left margin.  With
+ * left non-zero, only return the cost of going via the left margin
+ * if that is no more expensive, else -1.
+ */
+
+/**/
+static int
+singmovecost(int ln, int from, int to, int left)
+{
+    int cost, crcost;
+
+    if (from == to)
+	return left ? -1 : 0;
+    crcost = 1 + (to ? rightcurscost(ln, 0, to) : 0);
+    if (to < from)
+	cost = tcmultcost(TCLEFT, TCMULTLEFT, from - to);
+    else
+	cost = rightcurscost(ln, from, to);
+    if (cost < 0 || crcost <= cost)
+	return crcost;
+    return left ? -1 : cost;
+}
+
 /* move the cursor to line ln (relative to the prompt line),
    absolute column cl; update vln, vcs - video line and column */
 
@@ -2163,6 +2362,7 @@ void
 moveto(int ln, int cl)
 {
     const REFRESH_ELEMENT *rep;
+    int t0;
 
     if (vcs == winw) {
 	vln++, vcs = 0;
@@ -2190,7 +2390,7 @@ moveto(int ln, int cl)
 	vln = ln;
     }
 /* move down; if we might go off the end of the screen, use newlines
-   instead of TCDOWN */
+   instead of TCDOWN, likewise if they get us there more cheaply */
 
     while (ln > vln) {
 	if (vln < vmaxln - 1) {
@@ -2198,7 +2398,9 @@ moveto(int ln, int cl)
 		if (tc_downcurs(vmaxln - 1 - vln))
 		    vcs = 0;
 		vln = vmaxln - 1;
-	    } else {
+	    } else if ((t0 = tcmultcost(TCDOWN, TCMULTDOWN, ln - vln)) < 0 ||
+		       t0 + singmovecost(ln, vcs, cl, 0) <=
+		       1 + ln - vln + singmovecost(ln, 0, cl, 0)) {
 		if (tc_downcurs(ln - vln))
 		    vcs = 0;
 		vln = ln;
@@ -2216,11 +2418,40 @@ moveto(int ln, int cl)
 	singmoveto(cl);
 }
 
+/* number of characters output by tcoutarg(cap, arg) */
+
+/**/
+static int
+tcargcost(int cap, int arg)
+{
+    return strlen(tgoto(tcstr[cap], arg, arg));
+}
+
+/*
+ * Number of characters output by tcmultout(cap, multcap, ct),
+ * or -1 if the terminal has neither capability.
+ */
+
+/**/
+static int
+tcmultcost(int cap, int multcap, int ct)
+{
+    int cost;
+
+    if (tccan(multcap)) {
+	cost = tcargcost(multcap, ct);
+	if (!tccan(cap) || cost <= tclen[cap] * ct)
+	    return cost;
+    }
+    return tccan(cap) ? tclen[cap] * ct : -1;
+}
+
 /**/
 mod_export int
 tcmultout(int cap, int multcap, int ct)
 {
-    if (tccan(multcap) && (!tccan(cap) || tclen[multcap] <= tclen[cap] * ct)) {
+    if (tccan(multcap) &&
+	(!tccan(cap) || tcargcost(multcap, ct) <= tclen[cap] * ct)) {
 	tcoutarg(multcap, ct);
 	return 1;
     } else if (tccan(cap)) {
@@ -2243,6 +2474,12 @@ tc_rightcurs(int ct)
 
     cl = ct + vcs;
 
+/* writing out what's already there may be shorter than any motion */
+    if (rightmotioncost(vcs, cl) > ct && canrewrite(vln, vcs, cl)) {
+	zwrite(nbuf[vln] + vcs, ct);
+	return;
+    }
+
 /* do a multright if we can - it's the most reliable */
     if (tccan(TCMULTRIGHT)) {
 	tcoutarg(TCMULTRIGHT, ct);
@@ -2747,10 +2984,10 @@ singmoveto(int pos)
     if (pos == vcs)
 	return;
 
-/* choose cheapest movements for ttys without multiple movement capabilities -
+/* go via the left margin if that's the cheapest movement -
    do this now because it's easier (to code) */
 
-    if ((!tccan(TCMULTLEFT) || pos == 0) && (pos <= vcs / 2)) {
+    if (singmovecost(vln, vcs, pos, 1) >= 0) {
 	zputc(&zr_cr);
 	vcs = 0;
     }
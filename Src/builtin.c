@@ -2632,6 +2632,17 @@ typeset_single(char *cname, char *pname, Param pm, int func,
     return pm;
 }
 
+/* List of parameters matched by typeset -m, filled in by scanaddpmlist() */
+
+static LinkList typeset_pmlist;
+
+/**/
+static void
+scanaddpmlist(HashNode hn, UNUSED(int flags))
+{
+    addlinknode(typeset_pmlist, hn);
+}
+
 /*
  * declare, export, float, integer, local, readonly, typeset
  *
@@ -2650,7 +2661,6 @@ bin_typeset(char *name, char **argv, LinkList assigns, Options ops, int func)
     Patprog pprog;
     char *optstr = TYPESET_OPTSTR;
     int on = 0, off = 0, roff, bit = PM_ARRAY;
-    int i;
     int returnval = 0, printflags = PRINT_WITH_NAMESPACE;
     int hasargs = *argv != NULL || (assigns && firstnode(assigns));
 
@@ -3067,17 +3077,12 @@ bin_typeset(char *name, char **argv, LinkList assigns, Options ops, int func)
 	     * Bad news:  if the parameter gets altered, e.g. by
 	     * a type conversion, then paramtab can be shifted around,
 	     * so we need to store the parameters to alter on a separate
-	     * list for later use.
+	     * list for later use.  The list is sorted so that the order
+	     * doesn't depend on the layout of the table.
 	     */
-	    for (i = 0; i < paramtab->hsize; i++) {
-		for (pm = (Param) paramtab->nodes[i]; pm;
-		     pm = (Param) pm->node.next) {
-		    if (pm->node.flags & PM_UNSET)
-			continue;
-		    if (pattry(pprog, pm->node.nam))
-			addlinknode(pmlist, pm);
-		}
-	    }
+	    typeset_pmlist = pmlist;
+	    scanmatchtable(paramtab, pprog, 1, 0, PM_UNSET, scanaddpmlist, 0);
+	    typeset_pmlist = NULL;
 	    for (pmnode = firstnode(pmlist); pmnode; incnode(pmnode)) {
 		pm = (Param) getdata(pmnode);
 		if (!typeset_single(name, pm->node.nam, pm, func, on, off, roff,
@@ -4231,8 +4236,12 @@ bin_hash(char *name, char **argv, Options ops, UNUSED(int func))
 	}
 
 	/* empty the hash table */
-	if (OPT_ISSET(ops,'r'))
+	if (OPT_ISSET(ops,'r')) {
 	    ht->emptytable(ht);
+	    /* check again which files in the directories are executable */
+	    if (ht == cmdnamtab)
+		uncheckdirlistings();
+	}
 
 	/* fill the hash table in a standard way */
 	if (OPT_ISSET(ops,'f'))
@@ -5025,6 +5034,7 @@ bin_print(char *name, char **args, Options ops, int func)
 	/* -s option -- add the arguments to the history list */
 	if (OPT_ISSET(ops,'s') || OPT_ISSET(ops,'S')) {
 	    int nwords = 0, nlen, iwords;
+	    short *words = NULL;
 	    char **pargs = args;
 
 	    queue_signals();
@@ -5033,37 +5043,33 @@ bin_print(char *name, char **args, Options ops, int func)
 	    if (nwords) {
 		if (OPT_ISSET(ops,'S')) {
 		    int wordsize;
-		    short *words;
 		    if (nwords > 1) {
 			zwarnnam(name, "option -S takes a single argument");
 			unqueue_signals();
 			return 1;
 		    }
-		    words = NULL;
 		    wordsize = 0;
 		    histsplitwords(*args, &words, &wordsize, &nwords, 1);
 		    ent = prepnexthistent();
-		    ent->words = (short *)zalloc(nwords*sizeof(short));
-		    memcpy(ent->words, words, nwords*sizeof(short));
+		    sethisttext(ent, *args, words, nwords/2);
 		    free(words);
-		    ent->nwords = nwords/2;
 		} else {
-		    ent = prepnexthistent();
-		    ent->words = (short *)zalloc(nwords*2*sizeof(short));
-		    ent->nwords = nwords;
+		    words = (short *)zalloc(nwords*2*sizeof(short));
 		    nlen = iwords = 0;
 		    for (pargs = args; *pargs; pargs++) {
-			ent->words[iwords++] = nlen;
+			words[iwords++] = nlen;
 			nlen += strlen(*pargs);
-			ent->words[iwords++] = nlen;
+			words[iwords++] = nlen;
 			nlen++;
 		    }
+		    ent = prepnexthistent();
+		    sethisttext(ent, zjoin(args, ' ', 1), words, nwords);
+		    zfree(words, nwords*2*sizeof(short));
 		}
 	    } else {
 		ent = prepnexthistent();
-		ent->words = (short *)NULL;
+		sethisttext(ent, "", NULL, 0);
 	    }
-	    ent->node.nam = zjoin(args, ' ', 0);
 	    ent->stim = ent->ftim = time(NULL);
 	    ent->node.flags = 0;
 	    addhistnode(histtab, ent->node.nam, ent);
@@ -5546,10 +5552,10 @@ bin_print(char *name, char **args, Options ops, int func)
 		    setsparam(OPT_ARG(ops, 'v'), stringval);
 		} else {
 		    ent = prepnexthistent();
-		    ent->node.nam = stringval;
+		    sethisttext(ent, stringval, NULL, 0);
+		    zsfree(stringval);
 		    ent->stim = ent->ftim = time(NULL);
 		    ent->node.flags = 0;
-		    ent->words = (short *)NULL;
 		    addhistnode(histtab, ent->node.nam, ent);
 		}
 	    }
@@ -6187,7 +6193,7 @@ eval(char **argv)
     } else
 	fpushed = 0;
 
-    prog = parse_string(zjoin(argv, ' ', 1), 1);
+    prog = parse_string_cached(zjoin(argv, ' ', 1), 1);
     if (prog) {
 	if (wc_code(*prog->prog) != WC_LIST) {
 	    /* No code to execute */
@@ -6198,6 +6204,7 @@ eval(char **argv)
 	    if (errflag && !lastval)
 		lastval = errflag;
 	}
+	freeeprog(prog);
     } else {
 	lastval = 1;
     }
@@ -6385,6 +6392,22 @@ bin_eval(UNUSED(char *nam), char **argv, UNUSED(Options ops), UNUSED(int func))
 static char *zbuf;
 static int readfd;
 
+/*
+ * Read-ahead buffer used by zread() when readfd is a regular file.
+ * Whatever was read but not used is given back with lseek() by
+ * zreadfinish(), so the file offset is left just past the input that
+ * was consumed and other commands reading the file see no difference.
+ * That isn't possible for pipes and terminals, which are still read a
+ * byte at a time.  The block size starts small so that short lines
+ * don't read far ahead, and doubles each time the buffer is refilled.
+ */
+
+#define READBUF_MIN 128
+#define READBUF_MAX 8192
+
+static char readbuf[READBUF_MAX];
+static int readbufpos, readbuflen, readbufsize;
+
 /* Read a character from readfd, or from the buffer zbuf.  Return EOF on end of
 file/buffer. */
 
@@ -6755,6 +6778,8 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 
     zbuforig = zbuf = (!OPT_ISSET(ops,'z')) ? NULL :
 	(nonempty(bufstack)) ? (char *) getlinknode(bufstack) : ztrdup("");
+    if (!izle && !zbuf)
+	zreadstart();
     first = 1;
     bslash = 0;
     while (*args || (OPT_ISSET(ops,'A') && !gotnl)) {
@@ -6937,6 +6962,8 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 	char **pp, **p = NULL;
 	LinkNode n;
 
+	zreadfinish();
+
 	p = (OPT_ISSET(ops,'e') ? (char **)NULL
 	     : (char **)zalloc((al + 1) * sizeof(char *)));
 
@@ -7064,6 +7091,7 @@ bin_read(char *name, char **args, Options ops, UNUSED(int func))
 	}
 	signal_setmask(s);
     }
+    zreadfinish();
 #ifdef MULTIBYTE_SUPPORT
     if (ret != MB_INCOMPLETE)
 	bptr = laststart;
@@ -7144,9 +7172,21 @@ zread(int izle, int *readchar, long izle_timeout)
 	*readchar = -1;
 	return (unsigned char) cc;
     }
+    if (readbufpos < readbuflen)
+	return (unsigned char) readbuf[readbufpos++];
     for (;;) {
-	/* read a character from readfd */
-	ret = read(readfd, &cc, 1);
+	/* read a character, or a block if buffering, from readfd */
+	if (readbufsize) {
+	    ret = read(readfd, readbuf, readbufsize);
+	    if (ret > 0) {
+		readbuflen = ret;
+		readbufpos = 1;
+		if (readbufsize < READBUF_MAX)
+		    readbufsize *= 2;
+		return (unsigned char) *readbuf;
+	    }
+	} else
+	    ret = read(readfd, &cc, 1);
 	switch (ret) {
 	case 1:
 	    /* return the character read */
@@ -7176,6 +7216,30 @@ zread(int izle, int *readchar, long izle_timeout)
     }
 }
 
+/* Use the read-ahead buffer if readfd is a regular file */
+
+/**/
+static void
+zreadstart(void)
+{
+    struct stat st;
+
+    readbufpos = readbuflen = readbufsize = 0;
+    if (readfd >= 0 && !fstat(readfd, &st) && S_ISREG(st.st_mode))
+	readbufsize = READBUF_MIN;
+}
+
+/* Give back anything read ahead but not used */
+
+/**/
+static void
+zreadfinish(void)
+{
+    if (readbufpos < readbuflen)
+	lseek(readfd, (off_t)(readbufpos - readbuflen), SEEK_CUR);
+    readbufpos = readbuflen = readbufsize = 0;
+}
+
 /* holds arguments for testlex() */
 /**/
 char **testargs, **curtestarg;
@@ -306,6 +306,181 @@ parse_string(char *s, int reset_lineno)
     return p;
 }
 
+/*
+ * Cache of programmes parsed from strings.
+ *
+ * Code such as eval "$snippet", $(date +%s) or *(e:...:) in a loop
+ * used to lex and parse the same text every time round.  For those,
+ * parse_string_cached() keeps the last PARSECACHE_SIZE programmes in a
+ * hash table, discarding the least recently used.  An entry is keyed
+ * on the text together with the state the lexer consults: the
+ * options, the starting line number, which is recorded in the code,
+ * the comment character and the variables that turn comments and
+ * aliases off.  Changes to aliases or reserved words, or to the
+ * locale, empty the cache.  Long strings are not kept.
+ *
+ * Patterns are compiled when first used and stored with the code,
+ * which for a cached programme could mean they were compiled under
+ * different options; they are thrown away each time the programme is
+ * handed out, so recompiling them is left to the pattern cache.
+ */
+
+#define PARSECACHE_SIZE		64
+#define PARSECACHE_BUCKETS	128
+#define PARSECACHE_MAXLEN	16384
+
+typedef struct parsecacheent *Parsecacheent;
+
+struct parsecacheent {
+    Parsecacheent hnext;	/* next in hash chain */
+    Parsecacheent lprev, lnext;	/* most recently used first */
+    unsigned hash;
+    char *text;			/* the string parsed */
+    zlong lineno;		/* lineno at start, if not reset */
+    int nocomments, noaliases;
+    unsigned char hashchar;
+    char opts[OPT_SIZE];
+    Eprog prog;			/* permanent copy of the programme */
+};
+
+static Parsecacheent *parsecachetab;
+static Parsecacheent parsecachefirst, parsecachelast;
+
+/* Statistics for the zsh/parameter module */
+
+/**/
+mod_export int parsecachecount;
+
+/**/
+mod_export zlong parsecachehits, parsecachemisses, parsecacheevictions;
+
+static void
+unlinkparsecache(Parsecacheent ent)
+{
+    if (ent->lprev)
+	ent->lprev->lnext = ent->lnext;
+    else
+	parsecachefirst = ent->lnext;
+    if (ent->lnext)
+	ent->lnext->lprev = ent->lprev;
+    else
+	parsecachelast = ent->lprev;
+}
+
+static void
+freeparsecache(Parsecacheent ent)
+{
+    Parsecacheent *entp;
+
+    for (entp = parsecachetab + ent->hash; *entp != ent;
+	 entp = &(*entp)->hnext)
+	;
+    *entp = ent->hnext;
+    unlinkparsecache(ent);
+    zsfree(ent->text);
+    /* Anything still running the code keeps it alive. */
+    freeeprog(ent->prog);
+    zfree(ent, sizeof(*ent));
+    parsecachecount--;
+}
+
+/* Empty the cache, when something has changed how strings parse. */
+
+/**/
+mod_export void
+clearparsecache(void)
+{
+    while (parsecachefirst)
+	freeparsecache(parsecachefirst);
+}
+
+/*
+ * Parse s as parse_string() does, using the cache.  The result is
+ * marked as in use, so the caller must freeeprog() it when finished;
+ * that does nothing if it is on the heap.
+ */
+
+/**/
+mod_export Eprog
+parse_string_cached(char *s, int reset_lineno)
+{
+    Parsecacheent ent;
+    Eprog p;
+    Patprog *pp;
+    unsigned hash;
+    zlong line = reset_lineno ? 1 : lineno;
+    int i;
+
+    if (strlen(s) > PARSECACHE_MAXLEN)
+	return parse_string(s, reset_lineno);
+
+    queue_signals();
+    hash = (hasher(s) + (unsigned)line) % PARSECACHE_BUCKETS;
+    for (ent = parsecachetab ? parsecachetab[hash] : NULL; ent;
+	 ent = ent->hnext) {
+	if (ent->lineno == line && ent->nocomments == nocomments &&
+	    ent->noaliases == noaliases && ent->hashchar == hashchar &&
+	    !strcmp(ent->text, s) &&
+	    !memcmp(ent->opts, opts, OPT_SIZE))
+	    break;
+    }
+    if (ent) {
+	parsecachehits++;
+	if (ent != parsecachefirst) {
+	    unlinkparsecache(ent);
+	    ent->lprev = NULL;
+	    if ((ent->lnext = parsecachefirst))
+		parsecachefirst->lprev = ent;
+	    parsecachefirst = ent;
+	}
+	p = ent->prog;
+	if (p->nref == 1) {
+	    for (i = p->npats, pp = p->pats; i--; pp++) {
+		freepatprog(*pp);
+		*pp = dummy_patprog1;
+	    }
+	}
+	useeprog(p);
+	unqueue_signals();
+	return p;
+    }
+    parsecachemisses++;
+    unqueue_signals();
+
+    if (!(p = parse_string(s, reset_lineno)) || errflag)
+	return p;
+
+    queue_signals();
+    if (!parsecachetab)
+	parsecachetab = (Parsecacheent *)
+	    zshcalloc(PARSECACHE_BUCKETS * sizeof(Parsecacheent));
+    if (parsecachecount == PARSECACHE_SIZE) {
+	freeparsecache(parsecachelast);
+	parsecacheevictions++;
+    }
+    ent = (Parsecacheent) zalloc(sizeof(*ent));
+    ent->text = ztrdup(s);
+    ent->lineno = line;
+    ent->nocomments = nocomments;
+    ent->noaliases = noaliases;
+    ent->hashchar = hashchar;
+    memcpy(ent->opts, opts, OPT_SIZE);
+    ent->prog = p = dupeprog(p, 0);
+    ent->hash = hash;
+    ent->hnext = parsecachetab[hash];
+    parsecachetab[hash] = ent;
+    ent->lprev = NULL;
+    if ((ent->lnext = parsecachefirst))
+	parsecachefirst->lprev = ent;
+    else
+	parsecachelast = ent;
+    parsecachefirst = ent;
+    parsecachecount++;
+    useeprog(p);
+    unqueue_signals();
+    return p;
+}
+
 /**/
 #ifdef HAVE_GETRLIMIT
 
@@ -2946,6 +3121,269 @@ execcmd_fork(Estate state, int how, int type, Wordcode varspc,
     return 0;
 }
 
+/**/
+#if defined(HAVE_POSIX_SPAWN) && defined(FD_CLOEXEC)
+
+/*
+ * Add file actions for the redirections of a command run by
+ * execcmd_spawn().  Only redirections to and from plain file names
+ * and duplications of the standard descriptors are handled; those
+ * are performed by the child in the same order as the forked shell
+ * would do them.  Anything that needs expanding, may produce multios
+ * or must report an error in a particular way is left to the fork
+ * path.  Return 0 if the redirections can't be handled here.
+ */
+
+static int
+spawnredirs(posix_spawn_file_actions_t *fa, LinkList redir,
+	    int input, int output)
+{
+    LinkNode node;
+    Redir fn;
+    int used = (input ? 1 : 0) | (output ? 2 : 0), flags;
+
+    if (!redir)
+	return 1;
+    for (node = firstnode(redir); node; incnode(node)) {
+	fn = (Redir) getdata(node);
+	if (fn->varid || fn->fd1 < 0 || fn->fd1 > 9 ||
+	    (used & (1 << fn->fd1)) || has_token(fn->name))
+	    return 0;
+	used |= 1 << fn->fd1;
+	switch (fn->type) {
+	case REDIR_READ:
+	    if (posix_spawn_file_actions_addopen(fa, fn->fd1,
+						 unmeta(fn->name),
+						 O_RDONLY | O_NOCTTY, 0))
+		return 0;
+	    break;
+	case REDIR_WRITE:
+	case REDIR_WRITENOW:
+	case REDIR_APP:
+	case REDIR_APPNOW:
+	    /* Noclobber needs to look at the file first. */
+	    if (unset(CLOBBER) && !IS_CLOBBER_REDIR(fn->type))
+		return 0;
+	    flags = O_WRONLY | O_CREAT | O_NOCTTY |
+		(IS_APPEND_REDIR(fn->type) ? O_APPEND : O_TRUNC);
+	    if (posix_spawn_file_actions_addopen(fa, fn->fd1,
+						 unmeta(fn->name),
+						 flags, 0666))
+		return 0;
+	    break;
+	case REDIR_MERGEIN:
+	case REDIR_MERGEOUT:
+	    if (!idigit(*fn->name) || fn->name[1])
+		return 0;
+	    if (posix_spawn_file_actions_adddup2(fa, *fn->name - '0',
+						 fn->fd1))
+		return 0;
+	    break;
+	default:
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Try to start a simple external command with posix_spawn() instead
+ * of forking the shell.  With a large shell this is much cheaper, as
+ * the C library can use vfork() semantics and nothing needs copying.
+ *
+ * This can only be done if the child needs to do nothing more than
+ * what posix_spawn() offers: set the process group and the terminal's
+ * foreground group, reset signals, set up pipes and simple
+ * redirections, close the shell's own descriptors, and exec.  The
+ * caller has already ruled out everything that needs the shell in the
+ * child (shell code, assignments, globbing, exec and the like); here
+ * we check the rest.  If the exec itself fails for any reason,
+ * posix_spawn() reports it and we fall back to forking, so the usual
+ * code handles the path search, scripts without #! and error
+ * messages.
+ *
+ * Return the pid of the new process, which has been added to the
+ * current job as execcmd_fork() would, or 0 if the command needs to
+ * be forked.
+ */
+
+/**/
+static pid_t
+execcmd_spawn(LinkList args, LinkList redir, HashNode hn, int input,
+	      int output, char *text, int oautocont, int close_if_forked)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask, defsigs;
+    struct timespec bgtime;
+    char *arg0 = (char *) peekfirst(args), *pth, *s, **argv, **envp, **ep;
+    char **pp;
+    LinkNode node;
+    int i, n, ret, attach = 0, gleader = -1, lpj = -1;
+    pid_t pid;
+#ifdef HAVE_GETRLIMIT
+    int limnum;
+
+    /* Limits set with "limit" apply only to children. */
+    for (limnum = 0; limnum < RLIM_NLIMITS; limnum++)
+	if (limits[limnum].rlim_max != current_limits[limnum].rlim_max ||
+	    limits[limnum].rlim_cur != current_limits[limnum].rlim_cur)
+	    return 0;
+#endif
+
+    if (unset(EXECOPT) || isset(XTRACE) || intrap || list_pipe || list_pipe_child ||
+	thisjob == -1 || zgetenv("ARGV0") ||
+	(thisjob >= jobtabsize - 1 && !expandjobtab()))
+	return 0;
+
+    /* Find the file as execute() would try it first. */
+    for (s = arg0; *s && *s != '/'; s++)
+	;
+    if (*s)
+	pth = arg0;
+    else {
+	Cmdnam cn = (Cmdnam) hn;
+
+	if (!cn)
+	    return 0;
+	if (cn->node.flags & HASHED)
+	    pth = cn->u.cmd;
+	else {
+	    if (!cn->u.name)
+		return 0;
+	    /* Relative directories earlier in the path are tried first. */
+	    for (pp = path; pp < cn->u.name; pp++)
+		if (**pp != '/')
+		    return 0;
+	    pth = zhtricat(*cn->u.name, "/", cn->node.nam);
+	}
+    }
+    if (ztrlen(pth) >= PATH_MAX)
+	return 0;
+    pth = unmetafy(dupstring(pth), NULL);
+
+    if (isset(MONITOR)) {
+	if (jobtab[thisjob].gleader)
+	    gleader = jobtab[thisjob].gleader;
+	else {
+	    attach = jobbing && interact && SHTTY != -1;
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+	    if (attach)
+		return 0;
+#endif
+	    gleader = 0;
+	}
+    }
+
+    /* The arguments, and the environment with $_ set to the command. */
+    n = countlinknodes(args);
+    argv = (char **) zhalloc((n + 1) * sizeof(char *));
+    for (pp = argv, node = firstnode(args); node; incnode(node)) {
+	s = (char *) getdata(node);
+	*pp++ = strchr(s, Meta) ? unmetafy(dupstring(s), NULL) : s;
+    }
+    *pp = NULL;
+    for (n = 0; environ[n]; n++)
+	;
+    envp = (char **) zhalloc((n + 2) * sizeof(char *));
+    for (ep = envp, pp = environ; *pp; pp++)
+	if ((*pp)[0] != '_' || (*pp)[1] != '=')
+	    *ep++ = *pp;
+    *ep++ = (*pth == '/') ? dyncat("_=", pth) :
+	zhtricat("_=", unmeta(pwd), dyncat("/", pth));
+    *ep = NULL;
+
+    if (posix_spawn_file_actions_init(&fa))
+	return 0;
+    if (posix_spawnattr_init(&attr)) {
+	posix_spawn_file_actions_destroy(&fa);
+	return 0;
+    }
+    pid = 0;
+    mask = child_block();
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+    if (attach && posix_spawn_file_actions_addtcsetpgrp_np(&fa, SHTTY))
+	goto out;
+#endif
+    if ((input && (posix_spawn_file_actions_adddup2(&fa, input, 0) ||
+		   posix_spawn_file_actions_addclose(&fa, input))) ||
+	(output && (posix_spawn_file_actions_adddup2(&fa, output, 1) ||
+		    posix_spawn_file_actions_addclose(&fa, output))) ||
+	!spawnredirs(&fa, redir, input, output))
+	goto out;
+    /* Close what closem(FDT_INTERNAL) and friends would close. */
+    for (i = 10; i <= max_zsh_fd; i++)
+	if ((fdtable[i] & FDT_TYPE_MASK) == FDT_INTERNAL ||
+	    fdtable[i] == FDT_XTRACE)
+	    if (posix_spawn_file_actions_addclose(&fa, i))
+		goto out;
+    if ((coprocin != -1 && posix_spawn_file_actions_addclose(&fa, coprocin)) ||
+	(coprocout != -1 &&
+	 posix_spawn_file_actions_addclose(&fa, coprocout)) ||
+	(close_if_forked >= 0 &&
+	 posix_spawn_file_actions_addclose(&fa, close_if_forked)))
+	goto out;
+
+    /* The signals entersubsh() would reset, and the mask for execute(). */
+    sigemptyset(&defsigs);
+    sigaddset(&defsigs, SIGTTOU);
+    sigaddset(&defsigs, SIGTTIN);
+    sigaddset(&defsigs, SIGTSTP);
+    if (interact) {
+	sigaddset(&defsigs, SIGTERM);
+	if (!(sigtrapped[SIGINT] & ZSIG_IGNORED))
+	    sigaddset(&defsigs, SIGINT);
+	if (!sigtrapped[SIGPIPE])
+	    sigaddset(&defsigs, SIGPIPE);
+    }
+    if (!(sigtrapped[SIGQUIT] & ZSIG_IGNORED))
+	sigaddset(&defsigs, SIGQUIT);
+    sigdelset(&mask, SIGCHLD);
+#ifdef SIGWINCH
+    sigdelset(&mask, SIGWINCH);
+#endif
+    if (posix_spawnattr_setsigdefault(&attr, &defsigs) ||
+	posix_spawnattr_setsigmask(&attr, &mask) ||
+	(gleader != -1 && posix_spawnattr_setpgroup(&attr, gleader)) ||
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+				 POSIX_SPAWN_SETSIGMASK |
+				 (gleader != -1 ? POSIX_SPAWN_SETPGROUP : 0)))
+	goto out;
+
+    zgettime_monotonic_if_available(&bgtime);
+    queue_signals();
+    ret = posix_spawn(&pid, pth, &fa, &attr, argv, envp);
+    unqueue_signals();
+    if (ret) {
+	pid = 0;
+	goto out;
+    }
+
+    /* Now do what execcmd_fork() does in the parent. */
+    if (gleader == 0) {
+	gleader = jobtab[thisjob].gleader = pid;
+	if (list_pipe_job != thisjob) {
+	    if (!jobtab[list_pipe_job].gleader)
+		jobtab[list_pipe_job].gleader = pid;
+	    lpj = list_pipe_job;
+	}
+    } else
+	gleader = -1;
+    addproc(pid, text, 0, &bgtime, gleader, lpj);
+    if (oautocont >= 0)
+	opts[AUTOCONTINUE] = oautocont;
+    pipecleanfilelist(jobtab[thisjob].filelist, 1);
+
+ out:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return pid;
+}
+
+/**/
+#endif /* HAVE_POSIX_SPAWN && FD_CLOEXEC */
+
 /*
  * Execute a command at the lowest level of the hierarchy.
  */
@@ -3718,6 +4156,14 @@ execcmd_exec(Estate state, Execcmd_params eparams,
 	    (((is_builtin || is_shfunc) && output) ||
 	     (!is_cursh && (last1 != 1 || nsigtrapped || havefiles() ||
 			    fdtable_flocks)))) {
+#if defined(HAVE_POSIX_SPAWN) && defined(FD_CLOEXEC)
+	    if (type == WC_SIMPLE && !is_cursh && !varspc && !use_defpath &&
+		!(cflags & (BINF_DASH | BINF_CLEARENV)) &&
+		(!eparams->htok || (cflags & BINF_NOGLOB)) &&
+		execcmd_spawn(args, redir, hn, input, output, text,
+			      oautocont, close_if_forked))
+		return;
+#endif
 	    switch (execcmd_fork(state, how, type, varspc, &filelist,
 				 text, oautocont, close_if_forked)) {
 	    case -1:
@@ -4764,6 +5210,296 @@ simple_redir_name(Eprog prog, int redir_type)
     return NULL;
 }
 
+/*
+ * With CMD_SUBST_IN_SHELL, $(...) whose body can't change the state of
+ * the shell is run without forking, with its standard output sent to an
+ * anonymous file that is then read back.  Since there is no general way
+ * to undo changes to the shell, the test is conservative: the body must
+ * be a list of simple commands, without assignments or redirections,
+ * each running one of the builtins below, and the words may only use
+ * expansions that have no side effects.  Anything else is forked as
+ * usual.
+ */
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+
+static char *inshellbuiltins[] = {
+    "echo", "print", "printf", "pwd", NULL
+};
+
+/*
+ * Options to print that have no effect other than on the output.  Not
+ * -D, which may run the zsh_directory_name function.
+ */
+#define INSHELL_PRINT_OPTS "rnlNcoOiambeER"
+
+/*
+ * Check a word in the body of the substitution.  Parameter
+ * substitutions that assign or fail, subscripts and arithmetic offsets,
+ * which can both assign, and anything with parentheses, which covers
+ * nested substitutions, flags and glob qualifiers, are rejected, as
+ * are tildes and =cmd which may run hooks or change the command hash.
+ */
+
+static int
+inshellwordok(char *s)
+{
+    int braces = 0;
+
+    for (; *s; s++) {
+	if (*s == Meta) {
+	    s++;
+	    continue;
+	}
+	switch (*s) {
+	case Inbrace:
+	    braces++;
+	    break;
+	case Outbrace:
+	    braces--;
+	    break;
+	case String:
+	case Qstring:
+	case Dnull:
+	case Snull:
+	case Bnull:
+	case Bnullkeep:
+	case Nularg:
+	case Star:
+	case Pound:
+	case Hat:
+	case Dash:
+	case Comma:
+	    break;
+	case Quest:
+	case '?':
+	case '=':
+	    if (braces)
+		return 0;
+	    break;
+	case ':':
+	    /* allow ${x:-y}, ${x:+y}, ${x:#pat} and common modifiers */
+	    if (braces && (!s[1] || !strchr("-+#htrelu", s[1])))
+		return 0;
+	    break;
+	default:
+	    if (itok(*s))
+		return 0;
+	    break;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Check whether the first word of a command that takes options is
+ * known not to start with "-" after expansion.
+ */
+
+static int
+inshellnotopt(char *s)
+{
+    while (*s == Dnull || *s == Snull || *s == Bnull)
+	s++;
+    return *s && *s != '-' && *s != Dash && !itok(*s);
+}
+
+/*
+ * If a word is a literal option, return the letters after the "-"
+ * (so "-" for "--"), else NULL.  The lexer may have tokenized the "-".
+ */
+
+static char *
+inshelloptword(char *s)
+{
+    char *t;
+
+    if (*s != '-' && *s != Dash)
+	return NULL;
+    for (t = ++s; *t; t++)
+	if (itok(*t) && *t != Dash)
+	    return NULL;
+    return s;
+}
+
+/*
+ * Check that a printf format is literal and has no conversions taking
+ * a number or a "*" width or precision, as printf evaluates the
+ * arguments for those as arithmetic, which can assign.
+ */
+
+static int
+inshellprintffmt(char *s)
+{
+    if (!inshellnotopt(s))
+	return 0;
+    for (; *s; s++) {
+	if (*s == Meta) {
+	    s++;
+	    continue;
+	}
+	if (*s == Dnull || *s == Snull || *s == Bnull)
+	    continue;
+	if (itok(*s))
+	    return 0;
+	if (*s != '%')
+	    continue;
+	/* flags, argument number, width and precision */
+	while (*++s && (idigit(*s) || strchr("-+ #'$.", *s) || *s == Dash))
+	    ;
+	if (!*s)
+	    break;
+	if (itok(*s) || strchr("*diouxXcfFeEgGaA", *s))
+	    return 0;
+    }
+    return 1;
+}
+
+/**/
+static int
+inshellsubstok(Eprog prog)
+{
+    Wordcode pc = prog->prog;
+    wordcode code, lcode;
+    int argc, nlists = 0, endopts, dashdash, tokflag;
+    char **bp, *arg, *o;
+
+    /* With GLOB_SUBST, parameter values could bring in glob qualifiers */
+    if (prog == &dummy_eprog || sigtrapped[SIGDEBUG] || sigtrapped[SIGZERR] ||
+	isset(GLOBSUBST))
+	return 0;
+    for (;;) {
+	lcode = *pc++;
+	if (wc_code(lcode) != WC_LIST || !(WC_LIST_TYPE(lcode) & Z_SYNC))
+	    return 0;
+	nlists++;
+	if (!(WC_LIST_TYPE(lcode) & Z_SIMPLE)) {
+	    /* A single sublist, perhaps itself simplified, or pipeline */
+	    code = *pc++;
+	    if (wc_code(code) != WC_SUBLIST ||
+		WC_SUBLIST_TYPE(code) != WC_SUBLIST_END ||
+		(WC_SUBLIST_FLAGS(code) & ~WC_SUBLIST_SIMPLE))
+		return 0;
+	    if (!(WC_SUBLIST_FLAGS(code) & WC_SUBLIST_SIMPLE) &&
+		(wc_code(*pc) != WC_PIPE || WC_PIPE_TYPE(*pc) != WC_PIPE_END))
+		return 0;
+	}
+	/* skip the line number or pipe code */
+	if (wc_code(pc[1]) != WC_SIMPLE || !(argc = WC_SIMPLE_ARGC(pc[1])))
+	    return 0;
+	pc += 2;
+	arg = ecrawstr(prog, pc++, &tokflag);
+	if (tokflag)
+	    return 0;
+	for (bp = inshellbuiltins; *bp; bp++)
+	    if (!strcmp(*bp, arg))
+		break;
+	if (!*bp || !builtintab->getnode(builtintab, arg) ||
+	    shfunctab->getnode(shfunctab, arg))
+	    return 0;
+	endopts = dashdash = 0;
+	while (--argc) {
+	    char *word = ecrawstr(prog, pc++, NULL);
+
+	    if (!inshellwordok(word))
+		return 0;
+	    if (endopts)
+		continue;
+	    if (!strcmp(*bp, "print")) {
+		/* Only harmless options, and nothing expanding to one */
+		if ((o = inshelloptword(word))) {
+		    if (!*o || (IS_DASH(*o) && !o[1])) {
+			endopts = 1;
+			continue;
+		    }
+		    for (; *o; o++)
+			if (!strchr(INSHELL_PRINT_OPTS, *o))
+			    return 0;
+		    continue;
+		}
+		if (!inshellnotopt(word))
+		    return 0;
+	    } else if (!strcmp(*bp, "printf")) {
+		/* Don't allow -v, which assigns; the format comes next */
+		if (!dashdash && (o = inshelloptword(word)) &&
+		    IS_DASH(*o) && !o[1]) {
+		    dashdash = 1;
+		    continue;
+		}
+		if (!inshellprintffmt(word))
+		    return 0;
+	    }
+	    endopts = 1;
+	}
+	if (WC_LIST_TYPE(lcode) & Z_END)
+	    break;
+    }
+    /* Only the last status counts, so ERR_EXIT could make a difference */
+    return nlists == 1 || (unset(ERREXIT) && unset(ERRRETURN));
+}
+
+/*
+ * Run the code for $(...) in the shell, as checked by inshellsubstok().
+ * Returns NULL if that's not possible, in which case nothing has run.
+ */
+
+/**/
+static LinkList
+getoutputinshell(Eprog prog, int qt)
+{
+    LinkList retval;
+    int fd, ofd, ef = errflag, onoerrexit = noerrexit;
+    int onumpipestats = numpipestats, *opipestats;
+    zlong olineno = lineno;
+    char *ous = dupstring(zunderscore);
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_MMAN_H)
+    fd = movefd(memfd_create("zsh-cmdsubst", 0));
+#else
+    {
+	char *nam;
+
+	if ((fd = movefd(gettempfile(NULL, 1, &nam))) >= 0)
+	    unlink(nam);
+    }
+#endif
+    if (fd < 0)
+	return NULL;
+    fflush(stdout);
+    ofd = movefd(1);
+    redup(fd, 1);
+    opipestats = (int *)zhalloc(sizeof(int) * numpipestats);
+    memcpy(opipestats, pipestats, sizeof(int) * numpipestats);
+
+    noerrexit |= NOERREXIT_EXIT | NOERREXIT_RETURN;
+    zsh_subshell++;
+    execode(prog, 1, 0, "cmdsubst");
+    fflush(stdout);
+    zsh_subshell--;
+    noerrexit = onoerrexit;
+    /* An error would only have ended the subshell */
+    cmdoutval = (errflag & ERRFLAG_ERROR) && !lastval ? 1 : lastval;
+    errflag = ef | (errflag & ERRFLAG_INT);
+    lineno = olineno;
+    setunderscore(ous);
+    numpipestats = onumpipestats;
+    memcpy(pipestats, opipestats, sizeof(int) * numpipestats);
+
+    fd = movefd(dup(1));
+    redup(ofd, 1);
+    if (fd < 0) {
+	lastval = cmdoutval;
+	return newlinklist();
+    }
+    lseek(fd, 0, SEEK_SET);
+    retval = readoutput(fd, qt, NULL);
+    fdtable[fd] = FDT_UNUSED;
+    lastval = cmdoutval;
+    return retval;
+}
+
 /* $(...) */
 
 /**/
@@ -4777,14 +5513,16 @@ getoutput(char *cmd, int qt)
 
     int onc = nocomments;
     nocomments = (interact && !sourcelevel && unset(INTERACTIVECOMMENTS));
-    prog = parse_string(cmd, 0);
+    prog = parse_string_cached(cmd, 0);
     nocomments = onc;
 
     if (!prog)
 	return NULL;
 
-    if (!isset(EXECOPT))
+    if (!isset(EXECOPT)) {
+	freeeprog(prog);
 	return newlinklist();
+    }
 
     if ((s = simple_redir_name(prog, REDIR_READ))) {
 	/* $(< word) */
@@ -4792,6 +5530,7 @@ getoutput(char *cmd, int qt)
 	LinkList retval;
 	int readerror;
 
+	freeeprog(prog);
 	singsub(&s);
 	if (errflag)
 	    return NULL;
@@ -4808,9 +5547,18 @@ getoutput(char *cmd, int qt)
 	}
 	return retval;
     }
+    if (isset(CMDSUBSTINSHELL) && inshellsubstok(prog)) {
+	LinkList retval = getoutputinshell(prog, qt);
+
+	if (retval) {
+	    freeeprog(prog);
+	    return retval;
+	}
+    }
     if (mpipe(pipes) < 0) {
 	errflag |= ERRFLAG_ERROR;
 	cmdoutpid = 0;
+	freeeprog(prog);
 	return NULL;
     }
     child_block();
@@ -4822,10 +5570,12 @@ getoutput(char *cmd, int qt)
 	errflag |= ERRFLAG_ERROR;
 	cmdoutpid = 0;
 	child_unblock();
+	freeeprog(prog);
 	return NULL;
     } else if (pid) {
 	LinkList retval;
 
+	freeeprog(prog);
 	zclose(pipes[1]);
 	retval = readoutput(pipes[0], qt, NULL);
 	fdtable[pipes[0]] = FDT_UNUSED;
@@ -4858,17 +5608,33 @@ getoutput(char *cmd, int qt)
  * occurred during the read.
  */
 
+/*
+ * Initial size of the buffer readoutput() reads into when it can't
+ * tell how much output to expect; it doubles whenever it fills.
+ */
+#define READOUTPUT_MIN 256
+
 /**/
 static LinkList
 readoutput(int in, int qt, int *readerror)
 {
     LinkList ret;
-    char *buf, *bufptr, *ptr, inbuf[64];
-    int bsiz, c, cnt = 0, readret;
+    char *buf, *ptr, *src;
+    size_t bsiz = READOUTPUT_MIN, cnt = 0, want;
+    int c, readret, nmeta;
     int q = queue_signal_level();
+    struct stat st;
 
     ret = newlinklist();
-    ptr = buf = (char *) hcalloc(bsiz = 64);
+    /*
+     * For $(<file) we know how much there is to read, so make the
+     * buffer big enough to take it all in one go (plus one byte
+     * for the read that sees end of file).
+     */
+    if (!fstat(in, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	st.st_size < (off_t)(INT_MAX / 2))
+	bsiz = (size_t)st.st_size + 2;
+    buf = (char *) zhalloc(bsiz);
     /*
      * We need to be sensitive to SIGCHLD else we can be
      * stuck forever with important processes unreaped.
@@ -4879,32 +5645,54 @@ readoutput(int in, int qt, int *readerror)
     dont_queue_signals();
     child_unblock();
     for (;;) {
-	readret = read(in, inbuf, 64);
+	/* Always leave room for the terminating NULL. */
+	if (cnt + 1 >= bsiz) {
+	    queue_signals();
+	    buf = (char *) hrealloc(buf, bsiz, bsiz * 2);
+	    dont_queue_signals();
+	    bsiz *= 2;
+	}
+	want = bsiz - cnt - 1;
+	readret = read(in, buf + cnt, want > INT_MAX / 2 ? INT_MAX / 2 : want);
 	if (readret <= 0) {
 	    if (readret < 0 && errno == EINTR)
 		continue;
 	    else
 		break;
 	}
-	for (bufptr = inbuf; bufptr < inbuf + readret; bufptr++) {
-	    c = *bufptr;
-	    if (imeta(c)) {
-		*ptr++ = Meta;
-		c ^= 32;
-		cnt++;
-	    }
-	    if (++cnt >= bsiz) {
-		char *pp;
+	/*
+	 * Metafy what we've just read in place, working backwards
+	 * from the end once we know how much room is needed.
+	 */
+	nmeta = 0;
+	for (src = buf + cnt; src < buf + cnt + readret; src++)
+	    if (imeta(*src))
+		nmeta++;
+	if (nmeta) {
+	    size_t nsiz = bsiz;
+
+	    while (cnt + readret + nmeta + 1 > nsiz)
+		nsiz *= 2;
+	    if (nsiz != bsiz) {
 		queue_signals();
-		pp = (char *) hcalloc(bsiz *= 2);
+		buf = (char *) hrealloc(buf, bsiz, nsiz);
 		dont_queue_signals();
-
-		memcpy(pp, buf, cnt - 1);
-		ptr = (buf = pp) + cnt - 1;
+		bsiz = nsiz;
+	    }
+	    src = buf + cnt + readret;
+	    ptr = src + nmeta;
+	    while (ptr > src) {
+		c = *--src;
+		if (imeta(c)) {
+		    *--ptr = c ^ 32;
+		    *--ptr = Meta;
+		} else
+		    *--ptr = c;
 	    }
-	    *ptr++ = c;
 	}
+	cnt += readret + nmeta;
     }
+    ptr = buf + cnt;
     child_block();
     restore_queue_signals(q);
     if (readerror)
@@ -6264,6 +7052,356 @@ runshfunc(Eprog prog, FuncWrap wrap, char *name)
     unqueue_signals();
 }
 
+/*
+ * Index of the functions in the directories in $fpath, so that
+ * autoloading a function doesn't need to try every directory in turn.
+ * It maps each name to the first element of $fpath with a digest
+ * file, a compiled file or a plain file for it; getfpfunc() then only
+ * has to look there.  The directories are read with scandirlisting(),
+ * which reuses unchanged listings, including those saved in
+ * $ZSH_HASHDIR_CACHE by other shells.
+ *
+ * The index is rebuilt when $fpath changes, or when any directory or
+ * digest file has changed.  All of them are checked at most once a
+ * second; in between, only those before the one where a function was
+ * found are checked, and all of them before deciding a function isn't
+ * there, so the result is always the same as searching $fpath.
+ * If $fpath contains relative directories the index isn't used, nor
+ * if a directory can't be listed, which doesn't stop files in it
+ * being read, or matches names regardless of case.
+ */
+
+struct fpstamp {
+    int ok;			/* the file exists */
+    unsigned long dev;
+    unsigned long ino;
+    long mtime;
+    long mtimensec;
+};
+
+typedef struct fpindexnode *FPIndexNode;
+
+struct fpindexnode {
+    struct hashnode node;
+    int dir;			/* index in $fpath */
+};
+
+static HashTable fpindextab;
+static char **fpindexpath;	/* copy of $fpath the index is for */
+static struct fpstamp *fpindexstamps;	/* directory and digest for each */
+static time_t fpindexchecked;
+static int fpindexincomplete;	/* the index can't be relied on */
+static char *fpindexcasename;	/* name in a directory to test for case */
+
+#define FPINDEX_NONE    (-1)	/* no index, search $fpath */
+#define FPINDEX_MISSING (-2)	/* function is nowhere in $fpath */
+
+/* Record the state of a file; return 1 if it exists */
+
+static int
+getfpstamp(char *file, struct fpstamp *fs, struct stat *st)
+{
+    memset(fs, 0, sizeof(*fs));
+    if (stat(file, st))
+	return 0;
+    fs->ok = 1;
+    fs->dev = (unsigned long) st->st_dev;
+    fs->ino = (unsigned long) st->st_ino;
+    fs->mtime = (long) st->st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+    fs->mtimensec = (long) GET_ST_MTIME_NSEC(*st);
+#endif
+    /* Could change again without the time changing: check next time */
+    if (fs->mtime >= (long) time(NULL) - 1)
+	fs->mtime = -1;
+    return 1;
+}
+
+static void
+freefpindexnode(HashNode hn)
+{
+    zsfree(hn->nam);
+    zfree(hn, sizeof(struct fpindexnode));
+}
+
+static void
+addfpindex(char *name, int dir)
+{
+    FPIndexNode fn;
+
+    if (strsfx(".zwc", name))
+	name = dupstrpfx(name, strlen(name) - 4);
+    if (!*name)
+	return;
+    if (!fpindexcasename) {
+	char *ptr;
+
+	for (ptr = name; *ptr; ptr++)
+	    if ((*ptr >= 'a' && *ptr <= 'z') || (*ptr >= 'A' && *ptr <= 'Z')) {
+		fpindexcasename = dupstring(name);
+		break;
+	    }
+    }
+    if (fpindextab->getnode2(fpindextab, name))
+	return;
+    fn = (FPIndexNode) zshcalloc(sizeof(*fn));
+    fn->dir = dir;
+    fpindextab->addnode(fpindextab, ztrdup(name), fn);
+}
+
+/*
+ * Return 1 if a directory, unmetafied, finds the file name (from its
+ * listing) with the case of its ASCII letters changed.
+ */
+
+static int
+fpdirignorescase(char *dir, char *name)
+{
+    struct stat st1, st2;
+    char *file = dyncat(dir, "/"), *ptr, *flip;
+
+    name = unmeta(name);
+    flip = dupstring(name);
+    for (ptr = flip; *ptr; ptr++) {
+	if (*ptr >= 'a' && *ptr <= 'z')
+	    *ptr += 'A' - 'a';
+	else if (*ptr >= 'A' && *ptr <= 'Z')
+	    *ptr += 'a' - 'A';
+    }
+    return !stat(dyncat(file, flip), &st1) &&
+	!stat(dyncat(file, name), &st2) &&
+	st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/**/
+static void
+buildfpindex(void)
+{
+    struct stat st;
+    char *dir;
+    int i, n = arrlen(fpath);
+
+    if (!fpindextab) {
+	fpindextab = newhashtable(1021, "fpindextab", NULL);
+
+	fpindextab->hash        = hasher;
+	fpindextab->emptytable  = emptyhashtable;
+	fpindextab->filltable   = NULL;
+	fpindextab->cmpnodes    = strcmp;
+	fpindextab->addnode     = addhashnode;
+	fpindextab->getnode     = gethashnode2;
+	fpindextab->getnode2    = gethashnode2;
+	fpindextab->removenode  = removehashnode;
+	fpindextab->disablenode = NULL;
+	fpindextab->enablenode  = NULL;
+	fpindextab->freenode    = freefpindexnode;
+	fpindextab->printnode   = NULL;
+    } else
+	fpindextab->emptytable(fpindextab);
+    if (fpindexpath) {
+	zfree(fpindexstamps, 2 * arrlen(fpindexpath) * sizeof(struct fpstamp));
+	freearray(fpindexpath);
+    }
+    fpindexpath = zarrdup(fpath);
+    fpindexstamps = (struct fpstamp *) zalloc(2 * n * sizeof(struct fpstamp));
+
+    fpindexincomplete = 0;
+    pushheap();
+    for (i = 0; i < n; i++) {
+	dir = dupstring(unmeta(fpath[i]));
+	memset(fpindexstamps + 2 * i, 0, sizeof(struct fpstamp));
+	if (strsfx(".zwc", dir)) {
+	    /* The element is itself a digest file */
+	    if (getfpstamp(dir, fpindexstamps + 2 * i + 1, &st))
+		scandumpfuncs(dir, addfpindex, i);
+	    continue;
+	}
+	if (getfpstamp(dir, fpindexstamps + 2 * i, &st) && S_ISDIR(st.st_mode)) {
+	    fpindexcasename = NULL;
+	    if (scandirlisting(fpath[i], &st, addfpindex, i) ||
+		(fpindexcasename && fpdirignorescase(dir, fpindexcasename)))
+		fpindexincomplete = 1;
+	}
+	dir = dyncat(dir, ".zwc");
+	if (getfpstamp(dir, fpindexstamps + 2 * i + 1, &st))
+	    scandumpfuncs(dir, addfpindex, i);
+    }
+    fpindexcasename = NULL;
+    popheap();
+    flushdirlistings();
+}
+
+/*
+ * Return 1 if nothing in the index has changed for the first n
+ * elements of $fpath, or for all of them if n is negative.
+ */
+
+/**/
+static int
+checkfpindex(int n)
+{
+    struct fpstamp fs;
+    struct stat st;
+    char *dir;
+    int i, ret = 1;
+
+    pushheap();
+    for (i = 0; ret && fpath[i] && i != n; i++) {
+	dir = dupstring(unmeta(fpath[i]));
+	if (!strsfx(".zwc", dir)) {
+	    getfpstamp(dir, &fs, &st);
+	    if (memcmp(&fs, fpindexstamps + 2 * i, sizeof(fs)) ||
+		fs.mtime == -1) {
+		ret = 0;
+		break;
+	    }
+	    dir = dyncat(dir, ".zwc");
+	}
+	getfpstamp(dir, &fs, &st);
+	if (memcmp(&fs, fpindexstamps + 2 * i + 1, sizeof(fs)) ||
+	    fs.mtime == -1)
+	    ret = 0;
+    }
+    popheap();
+    return ret;
+}
+
+/* Return the index in $fpath where to look for a function, or one of
+ * FPINDEX_NONE and FPINDEX_MISSING. */
+
+/**/
+static int
+lookupfpindex(char *name)
+{
+    FPIndexNode fn;
+    char **pp, **qq;
+    time_t now = zmonotime(NULL);
+    int checked = 1;
+
+    if (strchr(name, '/'))
+	return FPINDEX_NONE;
+    for (pp = fpath; *pp; pp++)
+	if (**pp != '/')
+	    return FPINDEX_NONE;
+
+    queue_signals();
+    if (fpindexpath) {
+	for (pp = fpath, qq = fpindexpath; *pp && *qq; pp++, qq++)
+	    if (strcmp(*pp, *qq))
+		break;
+    }
+    if (!fpindexpath || *pp || *qq)
+	buildfpindex();
+    else if (fpindexchecked != now) {
+	if (!checkfpindex(-1))
+	    buildfpindex();
+    } else
+	checked = 0;
+    fpindexchecked = now;
+
+    for (;;) {
+	fn = (FPIndexNode) fpindextab->getnode2(fpindextab, name);
+	if (checked)
+	    break;
+	/*
+	 * Not checked this time: make sure nothing before where it was
+	 * found, or anywhere if it wasn't, has changed.
+	 */
+	checked = 1;
+	if (checkfpindex(fn ? fn->dir : -1))
+	    break;
+	buildfpindex();
+    }
+    unqueue_signals();
+    if (fpindexincomplete)
+	return FPINDEX_NONE;
+    return fn ? fn->dir : FPINDEX_MISSING;
+}
+
+/*
+ * Look for function s (su unmetafied) in a single directory of the
+ * function path.  Return 1 if found, with the list of its contents
+ * (possibly NULL if it couldn't be parsed) in *rp.
+ */
+
+static int
+getfpfuncdir(char *dir, char *s, char *su, int *ksh, char **fdir,
+	     int test_only, Eprog *rp)
+{
+    char buf[PATH_MAX];
+    off_t len;
+    off_t rlen;
+    char *d, *ppu;
+    Eprog r;
+    int fd;
+
+    if (*dir) {
+	ppu = unmeta(dir);
+	if (ppu != dir) ppu = dupstring(ppu);
+	if (snprintf(buf, PATH_MAX, "%s/%s", ppu, su) >= PATH_MAX)
+	    return 0;
+    } else if (strlen(su) >= PATH_MAX) {
+	return 0;
+    } else {
+	strcpy(buf, su);
+	ppu = "";
+    }
+    if ((r = try_dump_file(ppu, s, buf, ksh, test_only))) {
+	if (fdir)
+	    *fdir = ppu;
+	*rp = r;
+	return 1;
+    }
+    if (!access(buf, R_OK) && (fd = open(buf, O_RDONLY | O_NOCTTY)) != -1) {
+	struct stat st;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    (len = lseek(fd, 0, 2)) != -1) {
+	    if (test_only) {
+		close(fd);
+		if (fdir)
+		    *fdir = ppu;
+		*rp = &dummy_eprog;
+		return 1;
+	    }
+	    if ((r = try_autoload_cache(buf, &st, s, ksh))) {
+		close(fd);
+		if (fdir)
+		    *fdir = ppu;
+		*rp = r;
+		return 1;
+	    }
+	    d = (char *) zalloc(len + 1);
+	    lseek(fd, 0, 0);
+	    if ((rlen = read(fd, d, len)) >= 0) {
+		char *oldscriptname = scriptname;
+
+		close(fd);
+		d[rlen] = '\0';
+		d = metafy(d, rlen, META_REALLOC);
+
+		scriptname = dupstring(s);
+		r = parse_string(d, 1);
+		scriptname = oldscriptname;
+		if (r)
+		    write_autoload_cache(buf, &st, r);
+
+		if (fdir)
+		    *fdir = ppu;
+
+		zfree(d, len + 1);
+
+		*rp = r;
+		return 1;
+	    } else
+		close(fd);
+
+	    zfree(d, len + 1);
+	} else
+	    close(fd);
+    }
+    return 0;
+}
+
 /*
  * Search fpath for an undefined function.  Finds the file, and returns the
  * list of its contents.
@@ -6280,71 +7418,22 @@ runshfunc(Eprog prog, FuncWrap wrap, char *name)
 Eprog
 getfpfunc(char *s, int *ksh, char **fdir, char **alt_path, int test_only)
 {
-    char **pp, buf[PATH_MAX];
-    off_t len;
-    off_t rlen;
-    char *d;
+    char **pp;
     Eprog r;
-    int fd;
+    int i;
 
     char *su = unmeta(s);
     if (su != s) su = dupstring(su);
-    pp = alt_path ? alt_path : fpath;
-    char *ppu = "";
-    for (; *pp; pp++) {
-	if (**pp) {
-	    ppu = unmeta(*pp);
-	    if (ppu != *pp) ppu = dupstring(ppu);
-	    if (snprintf(buf, PATH_MAX, "%s/%s", ppu, su) >= PATH_MAX)
-		continue;
-	} else if (strlen(su) >= PATH_MAX) {
-	    continue;
-	} else {
-	    strcpy(buf, su);
-	    ppu = "";
-	}
-	if ((r = try_dump_file(ppu, s, buf, ksh, test_only))) {
-	    if (fdir)
-		*fdir = ppu;
+    if (!alt_path && (i = lookupfpindex(s)) != FPINDEX_NONE) {
+	if (i == FPINDEX_MISSING)
+	    return test_only ? NULL : &dummy_eprog;
+	if (getfpfuncdir(fpath[i], s, su, ksh, fdir, test_only, &r))
 	    return r;
-	}
-	if (!access(buf, R_OK) && (fd = open(buf, O_RDONLY | O_NOCTTY)) != -1) {
-	    struct stat st;
-	    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
-		(len = lseek(fd, 0, 2)) != -1) {
-		if (test_only) {
-		    close(fd);
-		    if (fdir)
-			*fdir = ppu;
-		    return &dummy_eprog;
-		}
-		d = (char *) zalloc(len + 1);
-		lseek(fd, 0, 0);
-		if ((rlen = read(fd, d, len)) >= 0) {
-		    char *oldscriptname = scriptname;
-
-		    close(fd);
-		    d[rlen] = '\0';
-		    d = metafy(d, rlen, META_REALLOC);
-
-		    scriptname = dupstring(s);
-		    r = parse_string(d, 1);
-		    scriptname = oldscriptname;
-
-		    if (fdir)
-			*fdir = ppu;
-
-		    zfree(d, len + 1);
-
-		    return r;
-		} else
-		    close(fd);
-
-		zfree(d, len + 1);
-	    } else
-		close(fd);
-	}
+	/* The index is out of date, do it the long way */
     }
+    for (pp = alt_path ? alt_path : fpath; *pp; pp++)
+	if (getfpfuncdir(*pp, s, su, ksh, fdir, test_only, &r))
+	    return r;
     return test_only ? NULL : &dummy_eprog;
 }
 
@@ -30,6 +30,13 @@
 #include "zsh.mdh"
 #include "glob.pro"
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && \
+    defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR) && \
+    defined(HAVE_FSTATAT) && !defined(ZSH_MEM)
+/* Directories can be read ahead by threads for GLOB_PARALLEL */
+# define GLOB_READAHEAD
+#endif
+
 #if defined(OFF_T_IS_64_BIT) && defined(__GNUC__)
 # define ALIGN64 __attribute__((aligned(8)))
 #else
@@ -190,6 +197,18 @@ struct globdata {
     LinkList gd_gf_pre_words, gd_gf_post_words;
 
     char *gd_glob_pre, *gd_glob_suf;
+
+    int gd_qualtypes;		/* qualifiers only test the file type	*/
+
+    /* What is known about the entry just read from a directory */
+    char *gd_pfname;		/* name of the entry			*/
+    mode_t gd_pftype;		/* its type, or 0 if unknown		*/
+    struct stat *gd_pfstat;	/* its lstat() if read ahead, ...	*/
+    int gd_pferr;		/* ... or errno if that failed		*/
+
+    /* State for reading directories ahead with GLOB_PARALLEL */
+    int gd_readahead;		/* this glob is using the threads	*/
+    struct globjob *gd_curjob;	/* listing read ahead for pathbuf	*/
 };
 
 /* The variable with the current globbing state and convenience macros */
@@ -220,6 +239,13 @@ static struct globdata curglobdata;
 #define gf_sortlist   (curglobdata.gd_gf_sortlist)
 #define gf_pre_words  (curglobdata.gd_gf_pre_words)
 #define gf_post_words (curglobdata.gd_gf_post_words)
+#define qualtypes     (curglobdata.gd_qualtypes)
+#define pfname        (curglobdata.gd_pfname)
+#define pftype        (curglobdata.gd_pftype)
+#define pfstat        (curglobdata.gd_pfstat)
+#define pferr         (curglobdata.gd_pferr)
+#define readahead     (curglobdata.gd_readahead)
+#define curjob        (curglobdata.gd_curjob)
 
 /* and macros for save/restore */
 
@@ -273,6 +299,602 @@ addpath(char *s, int l)
     pathbuf[pathpos] = '\0';
 }
 
+#ifdef GLOB_READAHEAD
+
+/*
+ * Reading directories ahead for GLOB_PARALLEL.
+ *
+ * When a recursive glob has found the subdirectories at one level, they
+ * are pushed as jobs onto a stack, and a small pool of threads reads the
+ * names in them and lstat()s each one.  The main thread still walks the
+ * tree in the usual order and does all the matching, so the results are
+ * the same as without the option; when it reaches a directory it takes
+ * the listing from the job, waiting if a thread is reading it and
+ * reading it itself if no thread has started.  Since the newest jobs are
+ * the next ones the walk will need, the stack keeps the threads working
+ * just ahead of the main thread.
+ *
+ * The threads run with all signals blocked and use nothing but system
+ * calls and malloc(), never any shell state.  They don't open or close
+ * anything either: the main thread opens the directories, a few at a
+ * time, with movefd() so that they don't use the user's descriptors
+ * while qualifier code or traps may redirect them, and it closes them
+ * when it has finished with the job.  Paths are opened relative to a
+ * descriptor for the directory where the glob started, so they are not
+ * affected if the main thread changes directory.  The threads are
+ * started when a glob first needs them and stopped when it ends.
+ * Everything shared is protected by globmutex.
+ */
+
+#define GLOB_MAXWORKERS	8	/* threads in the pool */
+#define GLOB_MAXJOBS	512	/* directories read ahead at once */
+#define GLOB_MAXOPEN	32	/* directories opened ahead at once */
+#define GLOB_BATCH	64	/* jobs queued by one call */
+
+enum {
+    GJ_QUEUED,			/* waiting on globqueue */
+    GJ_RUNNING,			/* being read */
+    GJ_DONE			/* finished, successfully or not */
+};
+
+typedef struct globjob *Globjob;
+
+struct globjob {
+    Globjob qprev, qnext;	/* links in globqueue */
+    Globjob lprev, lnext;	/* links in globjobs */
+    int state;
+    int err;			/* errno if the directory couldn't be read */
+    int fd;			/* the directory once opened, else -1 ... */
+    DIR *dir;			/* ... and the stream on it once read */
+    char *path;			/* unmetafied, ending in a slash */
+    char *names;		/* names, each followed by a NUL */
+    struct stat *stats;		/* lstat() of each name ... */
+    int *errs;			/* ... or errno if that failed */
+    int nnames;
+};
+
+static pthread_mutex_t globmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t globwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t globdone = PTHREAD_COND_INITIALIZER;
+
+/* Stack of jobs waiting for a thread, newest first */
+static Globjob globqueue;
+/* All jobs not yet freed by the main thread, and their number */
+static Globjob globjobs;
+static int globnjobs;
+/* Threads started, threads waiting for work, jobs being read by them */
+static int globworkers, globidle, globrunning;
+/* Set to make the threads exit */
+static int globquit;
+/* Jobs holding an open directory; only used by the main thread */
+static int globnopen;
+/* Directory where the current parallel glob started */
+static int globbasefd = -1;
+
+static void
+freeglobjob(Globjob job)
+{
+    free(job->path);
+    free(job->names);
+    free(job->stats);
+    free(job->errs);
+    free(job);
+}
+
+static void
+unqueueglobjob(Globjob job)
+{
+    if (job->qprev)
+	job->qprev->qnext = job->qnext;
+    else
+	globqueue = job->qnext;
+    if (job->qnext)
+	job->qnext->qprev = job->qprev;
+}
+
+/*
+ * Open the directory for a job; called by the main thread, without
+ * globmutex held, before the job is given to a thread.
+ */
+
+static int
+openglobjob(Globjob job)
+{
+    int fd, flags = O_RDONLY | O_NOCTTY;
+
+#ifdef O_DIRECTORY
+    flags |= O_DIRECTORY;
+#endif
+    queue_signals();
+    if ((fd = movefd(openat(globbasefd, job->path, flags))) < 0)
+	job->err = errno;
+    else
+	globnopen++;
+    unqueue_signals();
+    return fd;
+}
+
+/* Close a job's directory once the job is finished with. */
+
+static void
+closeglobjob(Globjob job)
+{
+    if (job->fd < 0)
+	return;
+    if (job->dir) {
+	closedir(job->dir);
+	fdtable[job->fd] = FDT_UNUSED;
+    } else
+	zclose(job->fd);
+    job->fd = -1;
+    job->dir = NULL;
+    globnopen--;
+}
+
+/*
+ * Read the directory for a job, which is open; called without
+ * globmutex held.
+ */
+
+static void
+readglobjob(Globjob job)
+{
+    int nsize = 0;
+    size_t len = 0, size = 0;
+    struct dirent *de;
+    DIR *dir;
+
+    if (!(dir = fdopendir(job->fd))) {
+	job->err = errno;
+	return;
+    }
+    job->dir = dir;
+    while ((de = readdir(dir))) {
+	char *name = de->d_name;
+	size_t l;
+
+	if (name[0] == '.' &&
+	    (!name[1] || (name[1] == '.' && !name[2])))
+	    continue;
+	l = strlen(name) + 1;
+	if (len + l > size) {
+	    char *names;
+
+	    size = (len + l) * 2 + 256;
+	    if (!(names = realloc(job->names, size))) {
+		job->err = ENOMEM;
+		break;
+	    }
+	    job->names = names;
+	}
+	if (job->nnames == nsize) {
+	    struct stat *stats;
+	    int *errs;
+
+	    nsize = nsize * 2 + 16;
+	    if (!(stats = realloc(job->stats, nsize * sizeof(*stats)))) {
+		job->err = ENOMEM;
+		break;
+	    }
+	    job->stats = stats;
+	    if (!(errs = realloc(job->errs, nsize * sizeof(*errs)))) {
+		job->err = ENOMEM;
+		break;
+	    }
+	    job->errs = errs;
+	}
+	memcpy(job->names + len, name, l);
+	len += l;
+	job->errs[job->nnames] =
+	    fstatat(job->fd, name, job->stats + job->nnames,
+		    AT_SYMLINK_NOFOLLOW) ? errno : 0;
+	job->nnames++;
+    }
+}
+
+static void *
+globworker(UNUSED(void *arg))
+{
+    Globjob job;
+
+    pthread_mutex_lock(&globmutex);
+    for (;;) {
+	/* Only jobs whose directory has been opened can be taken */
+	for (;;) {
+	    for (job = globqueue; job && job->fd < 0; job = job->qnext)
+		;
+	    if (job || globquit)
+		break;
+	    globidle++;
+	    pthread_cond_wait(&globwork, &globmutex);
+	    globidle--;
+	}
+	if (globquit)
+	    break;
+	unqueueglobjob(job);
+	job->state = GJ_RUNNING;
+	globrunning++;
+	pthread_mutex_unlock(&globmutex);
+
+	readglobjob(job);
+
+	pthread_mutex_lock(&globmutex);
+	globrunning--;
+	job->state = GJ_DONE;
+	pthread_cond_broadcast(&globdone);
+    }
+    globworkers--;
+    pthread_cond_broadcast(&globdone);
+    pthread_mutex_unlock(&globmutex);
+    return NULL;
+}
+
+/*
+ * Around fork(), make sure no thread holds globmutex, then forget in the
+ * child about the threads, which don't exist there.  Any job that was
+ * waiting or being read is marked as failed so that the main thread reads
+ * the directory itself if it gets that far; a stream a thread was in the
+ * middle of reading is not touched, just the descriptor closed.
+ */
+
+static void
+globforkprepare(void)
+{
+    pthread_mutex_lock(&globmutex);
+}
+
+static void
+globforkparent(void)
+{
+    pthread_mutex_unlock(&globmutex);
+}
+
+static void
+globforkchild(void)
+{
+    Globjob job;
+
+    pthread_mutex_unlock(&globmutex);
+    pthread_cond_init(&globwork, NULL);
+    pthread_cond_init(&globdone, NULL);
+    globworkers = globidle = globrunning = globquit = 0;
+    globqueue = NULL;
+    for (job = globjobs; job; job = job->lnext) {
+	if (job->state != GJ_DONE) {
+	    job->state = GJ_DONE;
+	    job->err = EINTR;
+	    job->dir = NULL;
+	}
+    }
+}
+
+/* Start a thread; called with globmutex held. */
+
+static int
+startglobworker(void)
+{
+    static int atforkdone;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    int ret;
+
+    /*
+     * The fork handlers are installed here rather than at start-up, so
+     * that only shells which have used GLOB_PARALLEL pay for them on
+     * each fork.  Without them there must be no thread.
+     */
+    if (!atforkdone) {
+	if (pthread_atfork(globforkprepare, globforkparent, globforkchild))
+	    return 0;
+	atforkdone = 1;
+    }
+    /* The new thread inherits the mask, so never handles signals. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, globworker, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret)
+	return 0;
+    globworkers++;
+    return 1;
+}
+
+/*
+ * Open the directories for the jobs nearest the top of the stack, as far
+ * as GLOB_MAXOPEN allows, and hand them to the threads.  The threads
+ * never take a job that isn't open, so until then the main thread can
+ * work on it without globmutex.
+ */
+
+static void
+openglobjobs(void)
+{
+    Globjob batch[GLOB_MAXOPEN], job;
+    int fds[GLOB_MAXOPEN], i, n = 0;
+
+    if (globnopen >= GLOB_MAXOPEN)
+	return;
+    pthread_mutex_lock(&globmutex);
+    for (job = globqueue; job && n < GLOB_MAXOPEN - globnopen;
+	 job = job->qnext)
+	if (job->fd < 0)
+	    batch[n++] = job;
+    pthread_mutex_unlock(&globmutex);
+    if (!n)
+	return;
+
+    for (i = 0; i < n; i++)
+	fds[i] = openglobjob(batch[i]);
+
+    pthread_mutex_lock(&globmutex);
+    for (i = 0; i < n; i++) {
+	job = batch[i];
+	if ((job->fd = fds[i]) < 0) {
+	    unqueueglobjob(job);
+	    job->state = GJ_DONE;
+	}
+    }
+    if (!globidle && globworkers < GLOB_MAXWORKERS)
+	startglobworker();
+    pthread_cond_broadcast(&globwork);
+    pthread_mutex_unlock(&globmutex);
+}
+
+/*
+ * Queue jobs for the subdirectories of the directory in pathbuf.  rec
+ * points into scanner()'s list of subdirectories, each stored as the
+ * name, the error count and a job pointer; jobs are created from rec
+ * onwards for those that don't have one, as far as the limits allow.
+ */
+
+static void
+queueglobjobs(char *rec, char *end)
+{
+    Globjob batch[GLOB_BATCH], job;
+    char *dir = dupstring(unmeta(pathbuf)), *name;
+    size_t dirlen = strlen(dir);
+    int n = 0, room;
+
+    pthread_mutex_lock(&globmutex);
+    room = GLOB_MAXJOBS - globnjobs;
+    pthread_mutex_unlock(&globmutex);
+    if (room > GLOB_BATCH)
+	room = GLOB_BATCH;
+
+    while (rec < end && n < room) {
+	char *slot = rec + strlen(rec) + 1 + sizeof(int);
+
+	name = unmeta(rec);
+	rec = slot + sizeof(Globjob);
+	memcpy(&job, slot, sizeof(Globjob));
+	if (job)
+	    continue;
+	if (!(job = calloc(1, sizeof(*job))))
+	    break;
+	if (!(job->path = malloc(dirlen + strlen(name) + 2))) {
+	    free(job);
+	    break;
+	}
+	job->fd = -1;
+	strcpy(job->path, dir);
+	strcpy(job->path + dirlen, name);
+	strcat(job->path, "/");
+	memcpy(slot, &job, sizeof(Globjob));
+	batch[n++] = job;
+    }
+    if (!n)
+	return;
+
+    pthread_mutex_lock(&globmutex);
+    /* Push in reverse, so the first subdirectory is on top. */
+    while (n--) {
+	job = batch[n];
+	job->state = GJ_QUEUED;
+	if ((job->qnext = globqueue))
+	    globqueue->qprev = job;
+	globqueue = job;
+	if ((job->lnext = globjobs))
+	    globjobs->lprev = job;
+	globjobs = job;
+	globnjobs++;
+    }
+    pthread_mutex_unlock(&globmutex);
+    openglobjobs();
+}
+
+/*
+ * Get the listing for a job, reading the directory here if no thread
+ * has started on it yet.  Return NULL if it couldn't be read, in which
+ * case the caller reads the directory in the normal way.
+ */
+
+static Globjob
+waitglobjob(Globjob job)
+{
+    pthread_mutex_lock(&globmutex);
+    if (job->state == GJ_QUEUED) {
+	unqueueglobjob(job);
+	job->state = GJ_RUNNING;
+	pthread_mutex_unlock(&globmutex);
+	if (job->fd < 0)
+	    job->fd = openglobjob(job);
+	if (job->fd >= 0)
+	    readglobjob(job);
+	pthread_mutex_lock(&globmutex);
+	job->state = GJ_DONE;
+    } else {
+	while (job->state != GJ_DONE)
+	    pthread_cond_wait(&globdone, &globmutex);
+    }
+    pthread_mutex_unlock(&globmutex);
+    closeglobjob(job);
+    /* Keep the threads supplied while this one is scanned */
+    openglobjobs();
+    return job->err ? NULL : job;
+}
+
+/* Free a job, waiting for its thread if it is still being read. */
+
+static void
+dropglobjob(Globjob job)
+{
+    pthread_mutex_lock(&globmutex);
+    if (job->lprev)
+	job->lprev->lnext = job->lnext;
+    else
+	globjobs = job->lnext;
+    if (job->lnext)
+	job->lnext->lprev = job->lprev;
+    globnjobs--;
+    if (job->state == GJ_QUEUED)
+	unqueueglobjob(job);
+    else
+	while (job->state == GJ_RUNNING)
+	    pthread_cond_wait(&globdone, &globmutex);
+    pthread_mutex_unlock(&globmutex);
+    closeglobjob(job);
+    freeglobjob(job);
+}
+
+/*
+ * Return the next name from a job's listing, in the form zreaddir()
+ * would, and make its lstat() available to statfullpath().
+ */
+
+static char *
+globjobname(Globjob job, int *entp, char **namep)
+{
+    char *name = *namep;
+
+    if (*entp == job->nnames)
+	return NULL;
+    *namep += strlen(name) + 1;
+    pfstat = job->stats + *entp;
+    pferr = job->errs[*entp];
+    pftype = pferr ? 0 : (pfstat->st_mode & S_IFMT);
+    (*entp)++;
+    return pfname = zdirentname(name);
+}
+
+/* Start reading ahead for a glob, unless one is already doing so. */
+
+static int
+startglobscan(void)
+{
+    int flags = O_RDONLY | O_NOCTTY;
+
+#ifdef O_DIRECTORY
+    flags |= O_DIRECTORY;
+#endif
+    if (globbasefd >= 0)
+	return 0;
+    if ((globbasefd = open(".", flags)) < 0)
+	return 0;
+    globbasefd = movefd(globbasefd);
+    return globbasefd >= 0;
+}
+
+/* Drop any jobs left by the glob and stop the threads. */
+
+static void
+endglobscan(void)
+{
+    while (globjobs)
+	dropglobjob(globjobs);
+    pthread_mutex_lock(&globmutex);
+    globquit = 1;
+    pthread_cond_broadcast(&globwork);
+    while (globworkers)
+	pthread_cond_wait(&globdone, &globmutex);
+    globquit = 0;
+    pthread_mutex_unlock(&globmutex);
+    zclose(globbasefd);
+    globbasefd = -1;
+}
+
+#define SUBDIR_JOBSIZE	sizeof(Globjob)
+
+#else
+
+#define SUBDIR_JOBSIZE	0
+
+#endif /* GLOB_READAHEAD */
+
+/*
+ * Return the type of a directory entry as S_IFMT bits, if readdir()
+ * says what it is, else 0.
+ */
+
+static mode_t
+direnttype(UNUSED(struct dirent *de))
+{
+#ifdef DT_UNKNOWN
+    switch (de->d_type) {
+    case DT_DIR:
+	return S_IFDIR;
+    case DT_REG:
+	return S_IFREG;
+    case DT_LNK:
+	return S_IFLNK;
+# if defined(DT_FIFO) && defined(S_IFIFO)
+    case DT_FIFO:
+	return S_IFIFO;
+# endif
+# if defined(DT_SOCK) && defined(S_IFSOCK)
+    case DT_SOCK:
+	return S_IFSOCK;
+# endif
+# if defined(DT_CHR) && defined(S_IFCHR)
+    case DT_CHR:
+	return S_IFCHR;
+# endif
+# if defined(DT_BLK) && defined(S_IFBLK)
+    case DT_BLK:
+	return S_IFBLK;
+# endif
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Read the next name for scanner(), like zreaddir() skipping "." and
+ * "..", and note the type of the entry if readdir() gives it.
+ */
+
+static char *
+globreaddir(DIR *dir)
+{
+    struct dirent *de;
+
+    do {
+	if (!(de = readdir(dir)))
+	    return NULL;
+    } while (de->d_name[0] == '.' &&
+	     (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])));
+    pfstat = NULL;
+    pftype = direnttype(de);
+    return pfname = zdirentname(de->d_name);
+}
+
+/*
+ * If s is the entry just read from the directory and its type is known
+ * without a stat, return the type, else 0.  follow is true if the type
+ * is needed after following a symbolic link.
+ */
+
+static mode_t
+globfiletype(const char *s, int follow)
+{
+    if (s != pfname || !pftype || (follow && S_ISLNK(pftype)))
+	return 0;
+    return pftype;
+}
+
 /* stat the filename s appended to pathbuf.  l should be true for lstat,    *
  * false for stat.  If st is NULL, the file is only checked for existence.  *
  * s == "" is treated as s == ".".  This is necessary since on most systems *
@@ -285,6 +907,19 @@ statfullpath(const char *s, struct stat *st, int l)
     char buf[PATH_MAX+1];
     int check_for_being_a_directory = 0;
 
+#ifdef GLOB_READAHEAD
+    /* Use the lstat() done when the directory was read ahead */
+    if (st && s == pfname && pfstat) {
+	if (pferr) {
+	    errno = pferr;
+	    return -1;
+	}
+	if (l || !S_ISLNK(pfstat->st_mode)) {
+	    memcpy(st, pfstat, sizeof(*st));
+	    return 0;
+	}
+    }
+#endif
     DPUTS(strlen(s) + !*s + pathpos - pathbufcwd >= PATH_MAX,
 	  "BUG: statfullpath(): pathname too long");
     strcpy(buf, pathbuf + pathbufcwd);
@@ -355,19 +990,21 @@ insert(char *s, int checked)
     if (gf_listtypes || gf_markdirs) {
 	/* Add the type marker to the end of the filename */
 	mode_t mode;
-	if (statfullpath(s, &buf, 1)) {
+	if (!gf_listtypes && (mode = globfiletype(s, gf_follow))) {
+	    /* Only need to know if it's a directory */
+	    checked = 1;
+	} else if (statfullpath(s, &buf, 1)) {
 	    unqueue_signals();
 	    return;
-	}
-	else {
+	} else {
 	    checked = statted = 1;
-	}
-	mode = buf.st_mode;
-	if (gf_follow) {
-	    if (!S_ISLNK(mode) || statfullpath(s, &buf2, 0))
-		memcpy(&buf2, &buf, sizeof(buf));
-	    statted |= 2;
-	    mode = buf2.st_mode;
+	    mode = buf.st_mode;
+	    if (gf_follow) {
+		if (!S_ISLNK(mode) || statfullpath(s, &buf2, 0))
+		    memcpy(&buf2, &buf, sizeof(buf));
+		statted |= 2;
+		mode = buf2.st_mode;
+	    }
 	}
 	if (gf_listtypes || S_ISDIR(mode)) {
 	    int ll = strlen(s);
@@ -381,8 +1018,17 @@ insert(char *s, int checked)
     if (qualct || qualorct) {
 	/* Go through the qualifiers, rejecting the file if appropriate */
 	struct qual *qo, *qn;
-
-	if (!statted && statfullpath(s, &buf, 1)) {
+	mode_t type;
+	int typeonly = 0;
+
+	if (statted)
+	    ;
+	else if (qualtypes && (type = globfiletype(s, 0))) {
+	    /* The qualifiers don't need anything but the type. */
+	    memset(&buf, 0, sizeof(buf));
+	    buf.st_mode = type;
+	    typeonly = 1;
+	} else if (statfullpath(s, &buf, 1)) {
 	    unqueue_signals();
 	    return;
 	}
@@ -416,6 +1062,9 @@ insert(char *s, int checked)
 	    }
 	    qn = qn->next;
 	}
+	/* Don't let sorting use the incomplete stat */
+	if (typeonly)
+	    statted = 0;
     } else if (!checked) {
 	if (statfullpath(s, NULL, 1)) {
 	    unqueue_signals();
@@ -579,15 +1228,31 @@ scanner(Complist q, int shortcircuit)
 	}
     } else {
 	/* Do pattern matching on current path section. */
-	char *fn = pathbuf[pathbufcwd] ? unmeta(pathbuf + pathbufcwd) : ".";
+	char *fn;
 	int dirs = !!q->next;
-	DIR *lock = opendir(fn);
+	DIR *lock = NULL;
 	char *subdirs = NULL;
 	int subdirlen = 0;
-
-	if (lock == NULL)
-	    return;
-	while ((fn = zreaddir(lock, 1)) && !errflag) {
+#ifdef GLOB_READAHEAD
+	Globjob job = NULL;
+	char *jobname = NULL;
+	int jobent = 0;
+
+	if (curjob && !strcmp(curjob->path, unmeta(pathbuf)) &&
+	    (job = waitglobjob(curjob)))
+	    jobname = job->names;
+	else
+#endif
+	{
+	    fn = pathbuf[pathbufcwd] ? unmeta(pathbuf + pathbufcwd) : ".";
+	    if ((lock = opendir(fn)) == NULL)
+		return;
+	}
+	while ((fn =
+#ifdef GLOB_READAHEAD
+		job ? globjobname(job, &jobent, &jobname) :
+#endif
+		globreaddir(lock)) && !errflag) {
 	    /* prefix and suffix are zle trickery */
 	    if (!dirs && !colonmod &&
 		((glob_pre && !strpfx(glob_pre, fn))
@@ -643,48 +1308,85 @@ scanner(Complist q, int shortcircuit)
 		    if (closure) {
 			/* if matching multiple directories */
 			struct stat buf;
+			mode_t type;
 
-			if (statfullpath(fn, &buf, !q->follow)) {
-			    if (errno != ENOENT && errno != EINTR &&
-				errno != ENOTDIR && !errflag) {
-				zwarn("%e: %s", errno, fn);
+			if (!(type = globfiletype(fn, q->follow))) {
+			    if (statfullpath(fn, &buf, !q->follow)) {
+				if (errno != ENOENT && errno != EINTR &&
+				    errno != ENOTDIR && !errflag) {
+				    zwarn("%e: %s", errno, fn);
+				}
+				continue;
 			    }
-			    continue;
+			    type = buf.st_mode;
 			}
-			if (!S_ISDIR(buf.st_mode))
+			if (!S_ISDIR(type))
 			    continue;
 		    }
 		    l = strlen(fn) + 1;
 		    subdirs = hrealloc(subdirs, subdirlen, subdirlen + l
-				       + sizeof(int));
+				       + sizeof(int) + SUBDIR_JOBSIZE);
 		    strcpy(subdirs + subdirlen, fn);
 		    subdirlen += l;
 		    /* store the count of errors made so far, too */
 		    memcpy(subdirs + subdirlen, (char *)&errsfound,
 			   sizeof(int));
 		    subdirlen += sizeof(int);
+#ifdef GLOB_READAHEAD
+		    /* and room for a job to read it ahead */
+		    memset(subdirs + subdirlen, 0, SUBDIR_JOBSIZE);
+		    subdirlen += SUBDIR_JOBSIZE;
+#endif
 		} else {
 		    /* if the last filename component, just add it */
 		    insert(fn, 1);
 		    if (shortcircuit && shortcircuit == matchct) {
-			closedir(lock);
+			if (lock)
+			    closedir(lock);
+			pfname = NULL;
 			return;
 		    }
 		}
 	    }
 	}
-	closedir(lock);
+	if (lock)
+	    closedir(lock);
+	pfname = NULL;
 	if (subdirs) {
 	    int oppos = pathpos;
+#ifdef GLOB_READAHEAD
+	    Globjob savjob = curjob, subjob = NULL;
+#endif
 
 	    for (fn = subdirs; fn < subdirs+subdirlen; ) {
 		int l = strlen(fn);
+#ifdef GLOB_READAHEAD
+		if (readahead && closure) {
+		    char *slot = fn + l + 1 + sizeof(int);
+
+		    memcpy(&subjob, slot, sizeof(Globjob));
+		    if (!subjob) {
+			queueglobjobs(fn, subdirs + subdirlen);
+			memcpy(&subjob, slot, sizeof(Globjob));
+		    }
+		}
+#endif
 		addpath(fn, l);
 		fn += l + 1;
 		memcpy((char *)&errsfound, fn, sizeof(int));
-		fn += sizeof(int);
+		fn += sizeof(int) + SUBDIR_JOBSIZE;
 		/* scan next level */
+#ifdef GLOB_READAHEAD
+		curjob = subjob;
+#endif
 		scanner((q->closure) ? q : q->next, shortcircuit); 
+#ifdef GLOB_READAHEAD
+		curjob = savjob;
+		if (subjob) {
+		    dropglobjob(subjob);
+		    subjob = NULL;
+		}
+#endif
 		if (shortcircuit && shortcircuit == matchct)
 		    return;
 		pathbuf[pathpos = oppos] = '\0';
@@ -1204,6 +1906,29 @@ checkglobqual(char *str, int sl, int nobareglob, char **sp)
 /* notify zglob() that it is called from expandredir() */
 static int in_expandredir = 0;
 
+/*
+ * Check if a list of qualifiers tests nothing a stat() would give but
+ * the type of the file, in which case the type from readdir() will do.
+ */
+
+static int
+qualstypeonly(struct qual *qo)
+{
+    struct qual *qn;
+
+    for (; qo; qo = qo->or) {
+	for (qn = qo; qn && qn->func; qn = qn->next) {
+	    if (qn->func != qualisdir && qn->func != qualisreg &&
+		qn->func != qualislnk && qn->func != qualissock &&
+		qn->func != qualisfifo && qn->func != qualisblk &&
+		qn->func != qualischr && qn->func != qualisdev &&
+		qn->func != qualnonemptydir && qn->func != qualsheval)
+		return 0;
+	}
+    }
+    return 1;
+}
+
 /* Main entry point to the globbing code for filename globbing. *
  * np points to a node in the list which will be expanded  *
  * into a series of nodes.                                      */
@@ -1864,10 +2589,20 @@ zglob(LinkList list, LinkNode np, int nountok)
 					 sizeof(struct gmatch));
     matchct = 0;
     pattrystart();
+    qualtypes = qualstypeonly(quals);
+    pfname = NULL;
+#ifdef GLOB_READAHEAD
+    readahead = isset(GLOBPARALLEL) && startglobscan();
+    curjob = NULL;
+#endif
 
     /* The actual processing takes place here: matches go into  *
      * matchbuf.  This is the only top-level call to scanner(). */
     scanner(q, shortcircuit);
+#ifdef GLOB_READAHEAD
+    if (readahead)
+	endglobscan();
+#endif
 
     /* Deal with failures to match depending on options */
     if (matchct)
@@ -2552,9 +3287,14 @@ get_match_ret(Imatchdata imd, int b, int e)
     int ll = 0, bl = 0, t = 0, add = 0, fl = imd->flags, i;
 
     /* Account for b and e referring to unmetafied string */
-    for (p = imd->ustr; p < imd->ustr + b; p++)
+    if (b < imd->umetaoff)
+	imd->umetaoff = imd->umetaadd = 0;
+    add = imd->umetaadd;
+    for (p = imd->ustr + imd->umetaoff; p < imd->ustr + b; p++)
 	if (imeta(*p))
 	    add++;
+    imd->umetaoff = b;
+    imd->umetaadd = add;
     b += add;
     for (; p < imd->ustr + e; p++)
 	if (imeta(*p))
@@ -2774,6 +3514,29 @@ freematchlist(LinkList repllist)
     freelinklist(repllist, freerepldata);
 }
 
+/*
+ * Return the literal string, unmetafied, that any match of p must
+ * start with, so that when looking for substrings we can skip
+ * straight to the places it occurs.  NULL if there isn't one.
+ */
+
+/**/
+static char *
+getmatchprefix(Patprog p, int *lenp)
+{
+    char *pfx;
+
+    if (p->flags & PAT_PURES) {
+	if (!p->patmlen)
+	    return NULL;
+	pfx = dupstrpfx((char *)p + p->startoff, p->patmlen);
+	unmetafy(pfx, lenp);
+	return pfx;
+    }
+    *lenp = p->prelen;
+    return p->prelen ? (char *)p + p->preoff : NULL;
+}
+
 /**/
 static void
 set_pat_start(Patprog p, int offs)
@@ -2831,7 +3594,7 @@ static int
 igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	  LinkList *repllistp)
 {
-    char *s = *sp, *t, *tmatch, *send;
+    char *s = *sp, *t, *tmatch, *send, *pfx;
     /*
      * Note that ioff counts (possibly multibyte) characters in the
      * character set (Meta's are not included), while l counts characters in
@@ -2845,7 +3608,7 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
      * the string (typically t).
      */
     int ioff, l = strlen(*sp), matched = 1, umltot = ztrlen(*sp);
-    int umlen, nmatches;
+    int umlen, nmatches, pfxlen;
     struct patstralloc patstralloc;
     struct imatchdata imd;
 
@@ -2861,24 +3624,12 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
     imd.flags = fl;
     imd.replstr = replstr;
     imd.repllist = NULL;
+    imd.umetaoff = imd.umetaadd = 0;
 
     /* perform must-match test for complex closures */
     if (p->mustoff)
-    {
-	char *muststr = (char *)p + p->mustoff;
-
-	matched = 0;
-	if (p->patmlen <= umltot)
-	{
-	    for (t = s; t <= send - p->patmlen; t++)
-	    {
-		if (!memcmp(muststr, t, p->patmlen)) {
-		    matched = 1;
-		    break;
-		}
-	    }
-	}
-    }
+	matched = patmemmem(s, umltot, (char *)p + p->mustoff,
+			    p->patmlen) != NULL;
 
     /* in case we used the prog before... */
     p->flags &= ~(PAT_NOTSTART|PAT_NOTEND);
@@ -3026,11 +3777,25 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    }
 	    ioff = 0;		/* offset into string */
 	    umlen = umltot;
+	    pfx = getmatchprefix(p, &pfxlen);
 	    mb_charinit();
 	    do {
 		/* loop over all matches for global substitution */
 		matched = 0;
 		for (; t <= send; ioff++) {
+		    /*
+		     * A match must start with the literal prefix of the
+		     * pattern, if any, so skip straight to the next one.
+		     */
+		    if (pfx) {
+			char *pre = patmemmem(t, send - t, pfx, pfxlen);
+			if (!pre)
+			    break;
+			while (t < pre) {
+			    ioff++;
+			    umlen -= iincchar(&t, send - t);
+			}
+		    }
 		    /* Find the longest match from this position. */
 		    set_pat_start(p, t-s);
 		    if (pattrylen(p, t, umlen, 0, &patstralloc, ioff)) {
@@ -3247,14 +4012,14 @@ static int
 igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	  LinkList *repllistp)
 {
-    char *s = *sp, *t, *send;
+    char *s = *sp, *t, *send, *pfx;
     /*
      * Note that ioff and uml count characters in the character
      * set (Meta's are not included), while l counts characters in the
      * metafied string.  umlen is a counter for (unmetafied) character
      * lengths.
      */
-    int ioff, l = strlen(*sp), uml = ztrlen(*sp), matched = 1, umlen;
+    int ioff, l = strlen(*sp), uml = ztrlen(*sp), matched = 1, umlen, pfxlen;
     struct patstralloc patstralloc;
     struct imatchdata imd;
 
@@ -3270,24 +4035,12 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
     imd.flags = fl;
     imd.replstr = replstr;
     imd.repllist = NULL;
+    imd.umetaoff = imd.umetaadd = 0;
 
     /* perform must-match test for complex closures */
     if (p->mustoff)
-    {
-	char *muststr = (char *)p + p->mustoff;
-
-	matched = 0;
-	if (p->patmlen <= uml)
-	{
-	    for (t = s; t <= send - p->patmlen; t++)
-	    {
-		if (!memcmp(muststr, t, p->patmlen)) {
-		    matched = 1;
-		    break;
-		}
-	    }
-	}
-    }
+	matched = patmemmem(s, uml, (char *)p + p->mustoff,
+			    p->patmlen) != NULL;
 
     /* in case we used the prog before... */
     p->flags &= ~(PAT_NOTSTART|PAT_NOTEND);
@@ -3388,10 +4141,20 @@ igetmatch(char **sp, Patprog p, int fl, int n, char *replstr,
 	    }
 	    ioff = 0;		/* offset into string */
 	    umlen = uml;
+	    pfx = getmatchprefix(p, &pfxlen);
 	    do {
 		/* loop over all matches for global substitution */
 		matched = 0;
 		for (; t <= send; t++, ioff++, umlen--) {
+		    /* Skip to the next literal prefix:  see above */
+		    if (pfx) {
+			char *pre = patmemmem(t, send - t, pfx, pfxlen);
+			if (!pre)
+			    break;
+			ioff += pre - t;
+			umlen -= pre - t;
+			t = pre;
+		    }
 		    /* Find the longest match from this position. */
 		    set_pat_start(p, t-s);
 		    if (pattrylen(p, t, send - t, umlen, &patstralloc, ioff)) {
@@ -3920,7 +4683,7 @@ qualsheval(char *name, UNUSED(struct stat *buf), UNUSED(off_t days), char *str)
 {
     Eprog prog;
 
-    if ((prog = parse_string(str, 0))) {
+    if ((prog = parse_string_cached(str, 0))) {
 	int ef = errflag, lv = lastval, ret;
 	int cshglob = badcshglob;
 
@@ -3930,6 +4693,7 @@ qualsheval(char *name, UNUSED(struct stat *buf), UNUSED(off_t days), char *str)
 	badcshglob = 0;
 
 	execode(prog, 1, 0, "globqual");
+	freeeprog(prog);
 
 	if ((ret = lastval))
 	    badcshglob |= cshglob;
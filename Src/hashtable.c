@@ -42,6 +42,12 @@ struct hashtableimpl {
     /* HASHTABLE INTERNAL MEMBERS */
     ScanStatus scan;		/* status of a scan over this hashtable     */
 
+    /* OPEN ADDRESSING MEMBERS (only used if ctrl is non-NULL) */
+    unsigned char *ctrl;	/* control byte for each slot of nodes[]    */
+    unsigned *hashvals;		/* cached hash value for each slot          */
+    int deleted;		/* number of slots marked HT_DELETED        */
+    int shift;			/* 32 - log2(hsize), for slot selection     */
+
 #ifdef ZSH_HASH_DEBUG
     /* HASHTABLE DEBUG MEMBERS */
     HashTableImpl next, last;	/* linked list of all hash tables           */
@@ -52,12 +58,38 @@ struct hashtableimpl {
 
 static inline HashTableImpl impl(HashTable ht) { return (HashTableImpl)ht; }
 
+/*
+ * Hash tables created by newopenhashtable() don't chain nodes.  Instead,
+ * nodes[] is a power-of-two sized array of slots holding at most one
+ * node each (so the next pointer of every node is NULL, and code that
+ * walks nodes[i] and the next chains directly still works).  Lookups
+ * probe linearly from the slot selected by the hash value, looking
+ * first at the contiguous array of control bytes and the cached hash
+ * values and only dereferencing a node when both match.
+ *
+ * The control byte is HT_EMPTY for a slot that has never been used,
+ * HT_DELETED for a slot whose node has been removed (the probe must
+ * continue past it), or else the low seven bits of the hash value.
+ * Nodes never move when other nodes are removed, so it is still safe
+ * to remove the current node while walking nodes[].
+ */
+
+#define HT_EMPTY	0x80
+#define HT_DELETED	0xfe
+#define HT_CTRL(H)	((unsigned char)((H) & 0x7f))
+
+#define ishtopen(HT)	(impl(HT)->ctrl != NULL)
+
 /* Structure for recording status of a hashtable scan in progress.  When a *
  * scan starts, the .scan member of the hashtable structure points to one  *
- * of these.  That member being non-NULL disables resizing of the          *
+ * of these.  That member being non-NULL disables resizing of a chained    *
  * hashtable (when adding elements).  When elements are deleted, the       *
  * contents of this structure is used to make sure the scan won't stumble  *
- * into the deleted element.                                               */
+ * into the deleted element.                                               *
+ *                                                                         *
+ * Scans of open addressing tables always work from a copy of the nodes,   *
+ * as for a sorted scan, since slots may be reused or the table resized    *
+ * while the scan is in progress.                                          */
 
 struct scanstatus {
     int sorted;
@@ -79,18 +111,57 @@ static void printhashtabinfo(HashTable ht);
 static HashTableImpl firstht, lastht;
 #endif /* ZSH_HASH_DEBUG */
 
-/* Generic hash function */
+/*
+ * Generic hash function.  The string is consumed a machine word at a
+ * time:  each word is mixed into the state with a multiplication by a
+ * large odd constant and the high bits folded back down, so that every
+ * byte affects every bit of the result.  Any tail shorter than a word
+ * is zero-padded.  The values are only ever used within one shell, so
+ * it doesn't matter that they differ between byte orders.
+ */
+
+#if defined(ZSH_64_BIT_TYPE) || defined(LONG_IS_64_BIT)
+typedef zulong hashword;
+#define HASH_MULT	((zulong)ZLONG_CONST(0x9e3779b97f4a7c15))
+#define HASH_FOLD	32
+#else
+typedef unsigned hashword;
+#define HASH_MULT	0x9e3779b9U
+#define HASH_FOLD	16
+#endif
+
+/* Hash a string whose length is already known */
 
 /**/
 mod_export unsigned
-hasher(const char *str)
+hasherlen(const char *str, size_t len)
 {
-    unsigned hashval = 0, c;
+    const unsigned char *s = (const unsigned char *) str;
+    hashword hashval = (hashword) len, w;
+
+    for (; len >= sizeof(hashword); s += sizeof(hashword),
+	     len -= sizeof(hashword)) {
+	memcpy(&w, s, sizeof(hashword));
+	hashval = (hashval ^ w) * HASH_MULT;
+	hashval ^= hashval >> HASH_FOLD;
+    }
+    if (len) {
+	w = 0;
+	memcpy(&w, s, len);
+	hashval = (hashval ^ w) * HASH_MULT;
+    }
+    hashval ^= hashval >> HASH_FOLD;
+    hashval *= HASH_MULT;
+    hashval ^= hashval >> HASH_FOLD;
 
-    while ((c = *((unsigned char *) str++)))
-	hashval += (hashval << 5) + c;
+    return (unsigned) hashval;
+}
 
-    return hashval;
+/**/
+mod_export unsigned
+hasher(const char *str)
+{
+    return hasherlen(str, strlen(str));
 }
 
 /* Get a new hash table */
@@ -121,6 +192,141 @@ newhashtable(int size, UNUSED(char const *name), UNUSED(PrintTableStats printinf
     return &ht->pub;
 }
 
+/* Get a new hash table using open addressing rather than chaining.  *
+ * size is only a hint for the initial number of slots.  The methods *
+ * are set up by the caller exactly as for newhashtable().           */
+
+/**/
+mod_export HashTable
+newopenhashtable(int size, char const *name, PrintTableStats printinfo)
+{
+    HashTable ht = newhashtable(0, name, printinfo);
+
+    zfree(ht->nodes, 0);
+    allocopenslots(ht, size);
+    return ht;
+}
+
+/* Allocate the slot arrays of an open addressing table with room *
+ * for at least size nodes.  Any previous arrays must be freed by *
+ * the caller.                                                    */
+
+/**/
+static void
+allocopenslots(HashTable ht, int size)
+{
+    int hsize = 8, shift = 29;
+
+    /* keep the load (including deleted slots) below 7/8 */
+    while (hsize - hsize / 8 <= size) {
+	hsize *= 2;
+	shift--;
+    }
+    ht->hsize = hsize;
+    ht->nodes = (HashNode *) zshcalloc(hsize * sizeof(HashNode));
+    impl(ht)->ctrl = (unsigned char *) zalloc(hsize);
+    memset(impl(ht)->ctrl, HT_EMPTY, hsize);
+    impl(ht)->hashvals = (unsigned *) zalloc(hsize * sizeof(unsigned));
+    impl(ht)->deleted = 0;
+    impl(ht)->shift = shift;
+}
+
+/* Free the slot arrays of an open addressing table */
+
+/**/
+static void
+freeopenslots(HashTable ht)
+{
+    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+    zfree(impl(ht)->ctrl, ht->hsize);
+    zfree(impl(ht)->hashvals, ht->hsize * sizeof(unsigned));
+}
+
+/* Return the first slot to probe for a given hash value.  The    *
+ * multiplication spreads the hash over the high order bits, so   *
+ * that weak hash functions still give a reasonable distribution. */
+
+static inline int
+openslot(HashTable ht, unsigned hashval)
+{
+    return (int)((hashval * 0x9e3779b9U) >> impl(ht)->shift);
+}
+
+/* Find the slot containing the node with the given name in an *
+ * open addressing table, or -1 if there is no such node.       */
+
+/**/
+static int
+findopenslot(HashTable ht, const char *nam, unsigned hashval)
+{
+    unsigned char *ctrl = impl(ht)->ctrl, c = HT_CTRL(hashval);
+    unsigned *hashvals = impl(ht)->hashvals;
+    int mask = ht->hsize - 1, i = openslot(ht, hashval);
+
+    for (; ctrl[i] != HT_EMPTY; i = (i + 1) & mask)
+	if (ctrl[i] == c && hashvals[i] == hashval &&
+	    ht->cmpnodes(ht->nodes[i]->nam, nam) == 0)
+	    return i;
+    return -1;
+}
+
+/* Find the slot where a node with the given hash value would be *
+ * stored in an open addressing table, i.e. the first empty or    *
+ * deleted slot along its probe sequence.                         */
+
+/**/
+static int
+insertopenslot(HashTable ht, unsigned hashval)
+{
+    unsigned char *ctrl = impl(ht)->ctrl;
+    int mask = ht->hsize - 1, i = openslot(ht, hashval);
+
+    while (ctrl[i] != HT_EMPTY && ctrl[i] != HT_DELETED)
+	i = (i + 1) & mask;
+    return i;
+}
+
+/* Store a node in slot i of an open addressing table, as returned *
+ * by insertopenslot().                                            */
+
+/**/
+static void
+putopenslot(HashTable ht, int i, HashNode hn, unsigned hashval)
+{
+    if (impl(ht)->ctrl[i] == HT_DELETED)
+	impl(ht)->deleted--;
+    impl(ht)->ctrl[i] = HT_CTRL(hashval);
+    impl(ht)->hashvals[i] = hashval;
+    hn->next = NULL;
+    ht->nodes[i] = hn;
+    ht->ct++;
+}
+
+/* Rebuild the slot arrays of an open addressing table so that  *
+ * there is room for at least size nodes.  This also clears out *
+ * deleted slots.  Using the cached hash values means the hash  *
+ * function need not be called again.                           */
+
+/**/
+static void
+rehashopentable(HashTable ht, int size)
+{
+    HashNode *onodes = ht->nodes;
+    unsigned char *octrl = impl(ht)->ctrl;
+    unsigned *ohashvals = impl(ht)->hashvals;
+    int i, osize = ht->hsize;
+
+    allocopenslots(ht, size);
+    ht->ct = 0;
+    for (i = 0; i < osize; i++)
+	if (onodes[i])
+	    putopenslot(ht, insertopenslot(ht, ohashvals[i]), onodes[i],
+			ohashvals[i]);
+    zfree(onodes, osize * sizeof(HashNode));
+    zfree(octrl, osize);
+    zfree(ohashvals, osize * sizeof(unsigned));
+}
+
 /* Delete a hash table.  After this function has been used, any *
  * existing pointers to the hash table are invalid.             */
 
@@ -140,10 +346,34 @@ deletehashtable(HashTable ht)
 	firstht = impl(ht)->next;
     zsfree(impl(ht)->tablename);
 #endif /* ZSH_HASH_DEBUG */
-    zfree(ht->nodes, ht->hsize * sizeof(HashNode));
+    if (ishtopen(ht))
+	freeopenslots(ht);
+    else
+	zfree(ht->nodes, ht->hsize * sizeof(HashNode));
     zfree(ht, sizeof(struct hashtableimpl));
 }
 
+/* Make sure a scan in progress sees the replacement node hn *
+ * rather than hp, or doesn't see hp at all if hn is NULL.   */
+
+/**/
+static void
+scanreplacenode(HashTable ht, HashNode hp, HashNode hn)
+{
+    ScanStatus st = impl(ht)->scan;
+
+    if (!st)
+	return;
+    if (st->sorted) {
+	HashNode *hashtab = st->u.s.hashtab;
+	int i;
+	for (i = st->u.s.ct; i--; )
+	    if (hashtab[i] == hp)
+		hashtab[i] = hn;
+    } else if (st->u.u == hp)
+	st->u.u = hn ? hn : hp->next;
+}
+
 /* Add a node to a hash table.                          *
  * nam is the key to use in hashing.  nodeptr points    *
  * to the node to add.  If there is already a node in   *
@@ -167,13 +397,46 @@ addhashnode(HashTable ht, char *nam, void *nodeptr)
 HashNode
 addhashnode2(HashTable ht, char *nam, void *nodeptr)
 {
-    unsigned hashval;
+    return addhashnodeval(ht, nam, nodeptr, ht->hash(nam));
+}
+
+/* As addhashnode2(), given the full hash value of the name as *
+ * returned by the table's hash function.                      */
+
+/**/
+HashNode
+addhashnodeval(HashTable ht, char *nam, void *nodeptr, unsigned hashval)
+{
     HashNode hn, hp, hq;
 
     hn = (HashNode) nodeptr;
     hn->nam = nam;
 
-    hashval = ht->hash(hn->nam) % ht->hsize;
+    if (ishtopen(ht)) {
+	int i;
+
+	if ((i = findopenslot(ht, hn->nam, hashval)) >= 0) {
+	    hp = ht->nodes[i];
+	    hn->next = NULL;
+	    ht->nodes[i] = hn;
+	    scanreplacenode(ht, hp, hn);
+	    return hp;
+	}
+	/*
+	 * Reusing a deleted slot doesn't increase the load, so
+	 * removing and re-adding a node never resizes the table.
+	 */
+	i = insertopenslot(ht, hashval);
+	if (impl(ht)->ctrl[i] == HT_EMPTY &&
+	    ht->ct + impl(ht)->deleted >= ht->hsize - ht->hsize / 8 - 1) {
+	    rehashopentable(ht, ht->ct * 2 + 1);
+	    i = insertopenslot(ht, hashval);
+	}
+	putopenslot(ht, i, hn, hashval);
+	return NULL;
+    }
+
+    hashval %= ht->hsize;
     hp = ht->nodes[hashval];
 
     /* check if this is the first node for this hash value */
@@ -190,16 +453,7 @@ addhashnode2(HashTable ht, char *nam, void *nodeptr)
 	ht->nodes[hashval] = hn;
 	replacing:
 	hn->next = hp->next;
-	if(impl(ht)->scan) {
-	    if(impl(ht)->scan->sorted) {
-		HashNode *hashtab = impl(ht)->scan->u.s.hashtab;
-		int i;
-		for(i = impl(ht)->scan->u.s.ct; i--; )
-		    if(hashtab[i] == hp)
-			hashtab[i] = hn;
-	    } else if(impl(ht)->scan->u.u == hp)
-		impl(ht)->scan->u.u = hn;
-	}
+	scanreplacenode(ht, hp, hn);
 	return hp;
     }
 
@@ -230,19 +484,11 @@ addhashnode2(HashTable ht, char *nam, void *nodeptr)
 mod_export HashNode
 gethashnode(HashTable ht, const char *nam)
 {
-    unsigned hashval;
-    HashNode hp;
+    HashNode hp = gethashnode2(ht, nam);
 
-    hashval = ht->hash(nam) % ht->hsize;
-    for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
-	if (ht->cmpnodes(hp->nam, nam) == 0) {
-	    if (hp->flags & DISABLED)
-		return NULL;
-	    else
-		return hp;
-	}
-    }
-    return NULL;
+    if (hp && (hp->flags & DISABLED))
+	return NULL;
+    return hp;
 }
 
 /* Get an entry in a hash table.  It will *
@@ -254,11 +500,41 @@ gethashnode(HashTable ht, const char *nam)
 mod_export HashNode
 gethashnode2(HashTable ht, const char *nam)
 {
-    unsigned hashval;
+    return gethashnodeval(ht, nam, ht->hash(nam));
+}
+
+/* Get an enabled entry in a hash table whose hash function is *
+ * hasher(), given the hash value of the name as returned by   *
+ * hasherlen().  This is for callers that already know the     *
+ * length of the name or look it up in more than one table.    */
+
+/**/
+mod_export HashNode
+gethashnodehashed(HashTable ht, const char *nam, unsigned hashval)
+{
     HashNode hp;
 
-    hashval = ht->hash(nam) % ht->hsize;
-    for (hp = ht->nodes[hashval]; hp; hp = hp->next) {
+    DPUTS(ht->hash != hasher, "BUG: gethashnodehashed() on wrong table");
+    hp = gethashnodeval(ht, nam, hashval);
+    if (hp && (hp->flags & DISABLED))
+	return NULL;
+    return hp;
+}
+
+/* Look up a name in a hash table, given its full hash value */
+
+/**/
+static HashNode
+gethashnodeval(HashTable ht, const char *nam, unsigned hashval)
+{
+    HashNode hp;
+
+    if (ishtopen(ht)) {
+	int i = findopenslot(ht, nam, hashval);
+	return i < 0 ? NULL : ht->nodes[i];
+    }
+
+    for (hp = ht->nodes[hashval % ht->hsize]; hp; hp = hp->next) {
 	if (ht->cmpnodes(hp->nam, nam) == 0)
 	    return hp;
     }
@@ -277,6 +553,20 @@ removehashnode(HashTable ht, const char *nam)
     unsigned hashval;
     HashNode hp, hq;
 
+    if (ishtopen(ht)) {
+	int i = findopenslot(ht, nam, ht->hash(nam));
+
+	if (i < 0)
+	    return NULL;
+	hp = ht->nodes[i];
+	ht->nodes[i] = NULL;
+	impl(ht)->ctrl[i] = HT_DELETED;
+	impl(ht)->deleted++;
+	ht->ct--;
+	scanreplacenode(ht, hp, NULL);
+	return hp;
+    }
+
     hashval = ht->hash(nam) % ht->hsize;
     hp = ht->nodes[hashval];
 
@@ -289,16 +579,7 @@ removehashnode(HashTable ht, const char *nam)
 	ht->nodes[hashval] = hp->next;
 	gotit:
 	ht->ct--;
-	if(impl(ht)->scan) {
-	    if(impl(ht)->scan->sorted) {
-		HashNode *hashtab = impl(ht)->scan->u.s.hashtab;
-		int i;
-		for(i = impl(ht)->scan->u.s.ct; i--; )
-		    if(hashtab[i] == hp)
-			hashtab[i] = NULL;
-	    } else if(impl(ht)->scan->u.u == hp)
-		impl(ht)->scan->u.u = hp->next;
-	}
+	scanreplacenode(ht, hp, NULL);
 	return hp;
     }
 
@@ -386,7 +667,7 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 	ht->scantab(ht, scanfunc, scanflags);
 	return ht->ct;
     }
-    if (sorted) {
+    if (sorted || ishtopen(ht)) {
 	int i, ct = ht->ct;
 	VARARR(HashNode, hnsorttab, ct);
 	HashNode *htp, hn;
@@ -399,7 +680,8 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 	for (htp = hnsorttab, i = 0; i < ht->hsize; i++)
 	    for (hn = ht->nodes[i]; hn; hn = hn->next)
 		*htp++ = hn;
-	qsort((void *)hnsorttab, ct, sizeof(HashNode), hnamcmp);
+	if (sorted)
+	    qsort((void *)hnsorttab, ct, sizeof(HashNode), hnamcmp);
 
 	st.sorted = 1;
 	st.u.s.hashtab = hnsorttab;
@@ -407,7 +689,8 @@ scanmatchtable(HashTable ht, Patprog pprog, int sorted,
 	impl(ht)->scan = &st;
 
 	for (htp = hnsorttab, i = 0; i < ct; i++, htp++) {
-	    if ((!flags1 || ((*htp)->flags & flags1)) &&
+	    /* nodes removed during the scan have been set to NULL */
+	    if (*htp && (!flags1 || ((*htp)->flags & flags1)) &&
 		!((*htp)->flags & flags2) &&
 		(!pprog || pattry(pprog, (*htp)->nam))) {
 		match++;
@@ -450,8 +733,8 @@ scanhashtable(HashTable ht, int sorted, int flags1, int flags2,
 			  scanfunc, scanflags);
 }
 
-/* Expand hash tables when they get too many entries. *
- * The new size is 4 times the previous size.         */
+/* Expand chained hash tables when they get too many entries. *
+ * The new size is 4 times the previous size.                 */
 
 /**/
 static void
@@ -498,6 +781,19 @@ resizehashtable(HashTable ht, int newsize)
 	}
     }
 
+    if (ishtopen(ht)) {
+	if (ht->hsize != newsize) {
+	    freeopenslots(ht);
+	    allocopenslots(ht, newsize);
+	} else {
+	    memset(ht->nodes, 0, newsize * sizeof(HashNode));
+	    memset(impl(ht)->ctrl, HT_EMPTY, newsize);
+	    impl(ht)->deleted = 0;
+	}
+	ht->ct = 0;
+	return;
+    }
+
     /* If new size desired is different from current size, *
      * we free it and allocate a new nodes array.          */
     if (ht->hsize != newsize) {
@@ -542,6 +838,31 @@ printhashtabinfo(HashTable ht)
 
     memset(chainlen, 0, sizeof(chainlen));
 
+    if (ishtopen(ht)) {
+	int mask = ht->hsize - 1;
+
+	/* chainlen[] counts the distance of each node from its home slot */
+	total = 0;
+	for (i = 0; i < ht->hsize; i++) {
+	    if (!ht->nodes[i])
+		continue;
+	    tmpcount = (i - openslot(ht, impl(ht)->hashvals[i])) & mask;
+	    if (tmpcount >= MAXDEPTH)
+		chainlen[MAXDEPTH]++;
+	    else
+		chainlen[tmpcount]++;
+	    total++;
+	}
+
+	printf("number of deleted slots                 : %4d\n",
+	       impl(ht)->deleted);
+	for (i = 0; i < MAXDEPTH; i++)
+	    printf("number of nodes with probe distance %d  : %4d\n", i, chainlen[i]);
+	printf("number of nodes with probe distance %d+ : %4d\n", MAXDEPTH, chainlen[MAXDEPTH]);
+	printf("total number of nodes                   : %4d\n", total);
+	return;
+    }
+
     /* count the number of nodes just to be sure */
     total = 0;
     for (i = 0; i < ht->hsize; i++) {
@@ -561,6 +882,16 @@ printhashtabinfo(HashTable ht)
     printf("total number of nodes                         : %4d\n", total);
 }
 
+/* Print info about the history table and the storage of its entries */
+
+/**/
+static void
+printhisttabinfo(HashTable ht)
+{
+    printhashtabinfo(ht);
+    printhistarenainfo();
+}
+
 /**/
 int
 bin_hashinfo(UNUSED(char *nam), UNUSED(char **args), UNUSED(Options ops), UNUSED(int func))
@@ -600,7 +931,7 @@ mod_export char **pathchecked;
 void
 createcmdnamtable(void)
 {
-    cmdnamtab = newhashtable(201, "cmdnamtab", NULL);
+    cmdnamtab = newopenhashtable(201, "cmdnamtab", NULL);
 
     cmdnamtab->hash        = hasher;
     cmdnamtab->emptytable  = emptycmdnamtable;
@@ -626,82 +957,513 @@ emptycmdnamtable(HashTable ht)
     pathchecked = path;
 }
 
-/* Add all commands in a given directory *
- * to the command hashtable.             */
+/*
+ * Listings of the directories in the path.  Each one records the
+ * files hashdir() found in a directory, along with the device, inode
+ * and modification time of the directory; while those are unchanged,
+ * the listing is used instead of reading the directory again.
+ * Directories modified within the last second aren't remembered, since
+ * they could change again without the time changing.  Listings for
+ * directories no longer in either path are dropped whenever the
+ * listings are flushed.
+ *
+ * Each name is preceded by a character saying whether the file is an
+ * executable, for HASH_EXECUTABLES_ONLY, or whether that hasn't been
+ * checked yet; the check is made the first time it's needed.  A file
+ * being made executable doesn't change the directory, so `hash -r'
+ * marks all the files as unchecked, without reading the directories.
+ *
+ * If $ZSH_HASHDIR_CACHE names a file, the listings for the directories
+ * in the path are saved there by a full rehash, and read back the
+ * first time a directory is hashed, so that other shells can use them.
+ *
+ * The directories in the function path are listed the same way, for
+ * the index of autoloadable functions in exec.c, sharing the listing
+ * of any directory that is in both; they are saved in the same file.
+ */
+
+struct dirlisting {
+    struct hashnode node;	/* nam is the directory */
+    unsigned long dev;
+    unsigned long ino;
+    long mtime;
+    long mtimensec;
+    int nnames;			/* number of names */
+    int size;			/* total size of names */
+    char *names;		/* the names, each null-terminated ... */
+};
+
+/* ... and preceded by one of these */
+
+#define DIRLIST_EXE	'x'	/* an executable file */
+#define DIRLIST_NOTEXE	'-'	/* not an executable file */
+#define DIRLIST_UNCHECKED '?'	/* not checked yet */
+
+static HashTable dirlisttab;
+
+/* The file the listings were read from, and if they need saving */
+
+static char *dirlistfile;
+static int dirlistdirty;
+
+#define DIRLIST_HEADER "zsh hashdir cache 2\n"
 
 /**/
-void
-hashdir(char **dirp)
+static void
+freedirlisting(HashNode hn)
 {
-    Cmdnam cn;
-    DIR *dir;
-    char *fn, *unmetadir, *pathbuf, *pathptr;
-    int dirlen;
-#if defined(_WIN32) || defined(__CYGWIN__)
-    char *exe;
-#endif /* _WIN32 || _CYGWIN__ */
+    Dirlisting dl = (Dirlisting) hn;
 
-    if (isrelative(*dirp))
+    zsfree(dl->node.nam);
+    if (dl->names)
+	zfree(dl->names, dl->size);
+    zfree(dl, sizeof(struct dirlisting));
+}
+
+/**/
+static void
+createdirlisttable(void)
+{
+    dirlisttab = newhashtable(31, "dirlisttab", NULL);
+
+    dirlisttab->hash        = hasher;
+    dirlisttab->emptytable  = emptyhashtable;
+    dirlisttab->filltable   = NULL;
+    dirlisttab->cmpnodes    = strcmp;
+    dirlisttab->addnode     = addhashnode;
+    dirlisttab->getnode     = gethashnode2;
+    dirlisttab->getnode2    = gethashnode2;
+    dirlisttab->removenode  = removehashnode;
+    dirlisttab->disablenode = NULL;
+    dirlisttab->enablenode  = NULL;
+    dirlisttab->freenode    = freedirlisting;
+    dirlisttab->printnode   = NULL;
+}
+
+/* Set the fields of a listing identifying the state of the directory */
+
+/**/
+static void
+setdirlistingstat(Dirlisting dl, struct stat *st)
+{
+    dl->dev = (unsigned long) st->st_dev;
+    dl->ino = (unsigned long) st->st_ino;
+    dl->mtime = (long) st->st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+    dl->mtimensec = (long) GET_ST_MTIME_NSEC(*st);
+#else
+    dl->mtimensec = 0;
+#endif
+}
+
+/* Read the listings saved in a file */
+
+/**/
+static void
+loaddirlistings(char *fn)
+{
+    struct stat st;
+    char *buf, *ptr, *end, *fields[6];
+    int fd, len, i, nnames;
+
+    if ((fd = open(unmeta(fn), O_RDONLY | O_NOCTTY)) < 0)
 	return;
-    unmetadir = unmeta(*dirp);
-    if (!(dir = opendir(unmetadir)))
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	st.st_size <= (off_t)strlen(DIRLIST_HEADER) ||
+	st.st_size > 64 * 1024 * 1024) {
+	close(fd);
 	return;
+    }
+    len = (int) st.st_size;
+    buf = (char *) zalloc(len + 1);
+    if (read_loop(fd, buf, len) != len ||
+	strncmp(buf, DIRLIST_HEADER, strlen(DIRLIST_HEADER))) {
+	zfree(buf, len + 1);
+	close(fd);
+	return;
+    }
+    close(fd);
+    buf[len] = '\0';
+    end = buf + len;
+
+    /*
+     * Each listing is the directory, device, inode, mtime, nanoseconds
+     * and number of names, then the names; all null-terminated.
+     */
+    for (ptr = buf + strlen(DIRLIST_HEADER); ptr < end; ) {
+	Dirlisting dl;
+	char *names;
+
+	for (i = 0; i < 6 && ptr < end; i++) {
+	    fields[i] = ptr;
+	    ptr += strlen(ptr) + 1;
+	}
+	if (i < 6 || (nnames = atoi(fields[5])) < 0)
+	    break;
+	for (names = ptr, i = 0; i < nnames && ptr < end; i++) {
+	    if ((*ptr != DIRLIST_EXE && *ptr != DIRLIST_NOTEXE &&
+		 *ptr != DIRLIST_UNCHECKED) || !ptr[1])
+		break;
+	    ptr += strlen(ptr) + 1;
+	}
+	if (i < nnames || ptr > end)
+	    break;
+	if (dirlisttab->getnode2(dirlisttab, fields[0]))
+	    continue;
+	dl = (Dirlisting) zshcalloc(sizeof(struct dirlisting));
+	dl->dev = strtoul(fields[1], NULL, 10);
+	dl->ino = strtoul(fields[2], NULL, 10);
+	dl->mtime = strtol(fields[3], NULL, 10);
+	dl->mtimensec = strtol(fields[4], NULL, 10);
+	dl->nnames = nnames;
+	if ((dl->size = ptr - names)) {
+	    dl->names = (char *) zalloc(dl->size);
+	    memcpy(dl->names, names, dl->size);
+	}
+	dirlisttab->addnode(dirlisttab, ztrdup(fields[0]), dl);
+    }
+    zfree(buf, len + 1);
+}
+
+/* Save the listings for the directories in the path */
+
+/**/
+static void
+savedirlistings(char *fn)
+{
+    char *tmpfile, **pp, **qq, pidbuf[DIGBUFSIZE];
+    FILE *out;
+    Dirlisting dl;
+    int fp, fd;
+
+    /* Unique to this shell, since several may save at once */
+    sprintf(pidbuf, "%ld", (long)mypid);
+    tmpfile = tricat(unmeta(fn), ".new.", pidbuf);
+    unlink(tmpfile);
+    if ((fd = open(tmpfile, O_WRONLY | O_CREAT | O_EXCL | O_NOCTTY,
+		   0600)) < 0) {
+	zsfree(tmpfile);
+	return;
+    }
+    if (!(out = fdopen(fd, "w"))) {
+	close(fd);
+	unlink(tmpfile);
+	zsfree(tmpfile);
+	return;
+    }
+    fputs(DIRLIST_HEADER, out);
+    /* The path, then any directories only in the function path */
+    for (fp = 0; fp < 2; fp++) {
+	for (pp = fp ? fpath : path; *pp; pp++) {
+	    if (fp) {
+		for (qq = path; *qq && strcmp(*qq, *pp); qq++)
+		    ;
+		if (*qq)
+		    continue;
+	    }
+	    if (!(dl = (Dirlisting) dirlisttab->getnode2(dirlisttab, *pp)))
+		continue;
+	    fprintf(out, "%s%c%lu%c%lu%c%ld%c%ld%c%d%c", dl->node.nam, 0,
+		    dl->dev, 0, dl->ino, 0, dl->mtime, 0, dl->mtimensec, 0,
+		    dl->nnames, 0);
+	    if (dl->size)
+		fwrite(dl->names, 1, dl->size, out);
+	}
+    }
+    if (fclose(out) == 0)
+	rename(tmpfile, unmeta(fn));
+    else
+	unlink(tmpfile);
+    zsfree(tmpfile);
+}
+
+/*
+ * Read the files in a directory into a new listing.  The caller frees
+ * it if it's not added to dirlisttab.
+ */
+
+/**/
+static Dirlisting
+readdirlisting(char *unmetadir, struct stat *st)
+{
+    Dirlisting dl;
+    DIR *dir;
+    char *fn;
+    int len;
+
+    if (!(dir = opendir(unmetadir)))
+	return NULL;
+
+    dl = (Dirlisting) zshcalloc(sizeof(struct dirlisting));
+    setdirlistingstat(dl, st);
+    while ((fn = zreaddir(dir, 1))) {
+	len = strlen(fn) + 1;
+	dl->names = (char *) zrealloc(dl->names, dl->size + len + 1);
+	dl->names[dl->size] = DIRLIST_UNCHECKED;
+	memcpy(dl->names + dl->size + 1, fn, len);
+	dl->size += len + 1;
+	dl->nnames++;
+    }
+    closedir(dir);
+    return dl;
+}
+
+/*
+ * Check which of the files in a listing not yet checked are executable.
+ * Return 1 if any were checked.
+ */
+
+/**/
+static int
+checkdirlisting(Dirlisting dl, char *unmetadir)
+{
+    char *fn, *pathbuf, *pathptr;
+    int i, dirlen, dummylen, ret = 0;
 
     dirlen = strlen(unmetadir);
     pathbuf = (char *)zalloc(dirlen + PATH_MAX + 2);
     sprintf(pathbuf, "%s/", unmetadir);
     pathptr = pathbuf + dirlen + 1;
 
-    while ((fn = zreaddir(dir, 1))) {
-	if (!cmdnamtab->getnode(cmdnamtab, fn)) {
-	    char *fname = ztrdup(fn);
-	    struct stat statbuf;
-	    int add = 0, dummylen;
-
-	    unmetafy(fn, &dummylen);
-	    if (strlen(fn) > PATH_MAX) {
-		/* Too heavy to do all the allocation */
-		add = 1;
-	    } else {
-		strcpy(pathptr, fn);
-		/*
-		 * This is the same test as for the glob qualifier for
-		 * executable plain files.
-		 */
-		if (unset(HASHEXECUTABLESONLY) ||
-		    (access(pathbuf, X_OK) == 0 &&
-		     stat(pathbuf, &statbuf) == 0 &&
-		     S_ISREG(statbuf.st_mode) && (statbuf.st_mode & S_IXUGO)))
-		    add = 1;
-	    }
-	    if (add) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
-		cn->node.flags = 0;
-		cn->u.name = dirp;
-		cmdnamtab->addnode(cmdnamtab, fname, cn);
-	    } else
-		zsfree(fname);
+    for (i = 0, fn = dl->names; i < dl->nnames; i++, fn += strlen(fn) + 1) {
+	char *ufn;
+	struct stat statbuf;
+	int add;
+
+	if (*fn != DIRLIST_UNCHECKED)
+	    continue;
+	ufn = dupstring(fn + 1);
+	unmetafy(ufn, &dummylen);
+	if (strlen(ufn) > PATH_MAX) {
+	    /* Too heavy to do all the allocation */
+	    add = 1;
+	} else {
+	    strcpy(pathptr, ufn);
+	    /*
+	     * This is the same test as for the glob qualifier for
+	     * executable plain files.
+	     */
+	    add = (access(pathbuf, X_OK) == 0 &&
+		   stat(pathbuf, &statbuf) == 0 &&
+		   S_ISREG(statbuf.st_mode) &&
+		   (statbuf.st_mode & S_IXUGO));
 	}
+	*fn = add ? DIRLIST_EXE : DIRLIST_NOTEXE;
+	ret = 1;
+    }
+    zfree(pathbuf, dirlen + PATH_MAX + 2);
+    return ret;
+}
+
+/* Add a command found in a directory to the command hashtable */
+
+/**/
+static void
+hashdirname(char **dirp, char *fn)
+{
+    Cmdnam cn;
 #if defined(_WIN32) || defined(__CYGWIN__)
-	/* Hash foo.exe as foo, since when no real foo exists, foo.exe
-	   will get executed by DOS automatically.  This quiets
-	   spurious corrections when CORRECT or CORRECT_ALL is set. */
-	if ((exe = strrchr(fn, '.')) &&
-	    (exe[1] == 'E' || exe[1] == 'e') &&
-	    (exe[2] == 'X' || exe[2] == 'x') &&
-	    (exe[3] == 'E' || exe[3] == 'e') && exe[4] == 0) {
-	    *exe = 0;
-	    if (!cmdnamtab->getnode(cmdnamtab, fn)) {
-		cn = (Cmdnam) zshcalloc(sizeof *cn);
-		cn->node.flags = 0;
-		cn->u.name = dirp;
-		cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
-	    }
+    char *exe;
+#endif /* _WIN32 || _CYGWIN__ */
+
+    if (!cmdnamtab->getnode(cmdnamtab, fn)) {
+	cn = (Cmdnam) zshcalloc(sizeof *cn);
+	cn->node.flags = 0;
+	cn->u.name = dirp;
+	cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
+    }
+#if defined(_WIN32) || defined(__CYGWIN__)
+    /* Hash foo.exe as foo, since when no real foo exists, foo.exe
+       will get executed by DOS automatically.  This quiets
+       spurious corrections when CORRECT or CORRECT_ALL is set. */
+    if ((exe = strrchr(fn, '.')) &&
+	(exe[1] == 'E' || exe[1] == 'e') &&
+	(exe[2] == 'X' || exe[2] == 'x') &&
+	(exe[3] == 'E' || exe[3] == 'e') && exe[4] == 0) {
+	fn = dupstrpfx(fn, exe - fn);
+	if (!cmdnamtab->getnode(cmdnamtab, fn)) {
+	    cn = (Cmdnam) zshcalloc(sizeof *cn);
+	    cn->node.flags = 0;
+	    cn->u.name = dirp;
+	    cmdnamtab->addnode(cmdnamtab, ztrdup(fn), cn);
 	}
+    }
 #endif /* _WIN32 || __CYGWIN__ */
+}
+
+/*
+ * Find the listing of a directory, which has been stat'ed, reading it
+ * if the one in dirlisttab is out of date.  If *tmpp is set on return,
+ * the listing isn't in the table and must be freed by the caller.
+ */
+
+/**/
+static Dirlisting
+finddirlisting(char *dir, char *unmetadir, struct stat *st, int *tmpp)
+{
+    Dirlisting dl;
+    char *cachefile;
+
+    if (!dirlisttab)
+	createdirlisttable();
+    if ((cachefile = getsparam("ZSH_HASHDIR_CACHE")) && *cachefile &&
+	(!dirlistfile || strcmp(dirlistfile, cachefile))) {
+	zsfree(dirlistfile);
+	dirlistfile = ztrdup(cachefile);
+	loaddirlistings(cachefile);
+    }
+
+    if ((dl = (Dirlisting) dirlisttab->getnode2(dirlisttab, dir))) {
+	struct dirlisting cur;
+
+	setdirlistingstat(&cur, st);
+	if (dl->dev != cur.dev || dl->ino != cur.ino ||
+	    dl->mtime != cur.mtime || dl->mtimensec != cur.mtimensec) {
+	    dirlisttab->freenode(dirlisttab->removenode(dirlisttab, dir));
+	    dl = NULL;
+	}
+    }
+    *tmpp = 0;
+    if (!dl) {
+	if (!(dl = readdirlisting(unmetadir, st)))
+	    return NULL;
+	if (!(*tmpp = (long) st->st_mtime >= (long) time(NULL) - 1)) {
+	    dirlisttab->addnode(dirlisttab, ztrdup(dir), dl);
+	    dirlistdirty = 1;
+	}
+    }
+    return dl;
+}
+
+/*
+ * Call func for the name of every file in a directory, which has been
+ * stat'ed, using the saved listing if the directory is unchanged.
+ * Return 1 if the directory can't be read.
+ */
+
+/**/
+int
+scandirlisting(char *dir, struct stat *st, ScanNameFunc func, int arg)
+{
+    Dirlisting dl;
+    char *fn;
+    int i, tmp;
+
+    if (!(dl = finddirlisting(dir, unmeta(dir), st, &tmp)))
+	return 1;
+    for (i = 0, fn = dl->names; i < dl->nnames; i++, fn += strlen(fn) + 1)
+	func(fn + 1, arg);
+    if (tmp) {
+	dl->node.nam = NULL;
+	freedirlisting(&dl->node);
+    }
+    return 0;
+}
+
+/* Return 1 if a directory is in the path or the function path */
+
+/**/
+static int
+indirlistingpath(char *dir)
+{
+    char **pp;
+
+    for (pp = path; *pp; pp++)
+	if (!strcmp(*pp, dir))
+	    return 1;
+    for (pp = fpath; *pp; pp++)
+	if (!strcmp(*pp, dir))
+	    return 1;
+    return 0;
+}
+
+/*
+ * Drop the listings of directories no longer in either path, then
+ * save the listings if there are new ones and a file to save them in.
+ */
+
+/**/
+void
+flushdirlistings(void)
+{
+    HashNode hn, next;
+    char *cachefile;
+    int i;
+
+    if (dirlisttab) {
+	for (i = 0; i < dirlisttab->hsize; i++)
+	    for (hn = dirlisttab->nodes[i]; hn; hn = next) {
+		next = hn->next;
+		if (!indirlistingpath(hn->nam))
+		    dirlisttab->freenode(dirlisttab->removenode(dirlisttab,
+								hn->nam));
+	    }
+    }
+    if (dirlistdirty && (cachefile = getsparam("ZSH_HASHDIR_CACHE")) &&
+	*cachefile) {
+	savedirlistings(cachefile);
+	dirlistdirty = 0;
+    }
+}
+
+/*
+ * For `hash -r', mark all the files in the listings as not checked to
+ * be executable.  The listings themselves are still used as long as
+ * the directories are unchanged.
+ */
+
+/**/
+void
+uncheckdirlistings(void)
+{
+    HashNode hn;
+    Dirlisting dl;
+    char *fn;
+    int i, j;
+
+    if (!dirlisttab)
+	return;
+    for (i = 0; i < dirlisttab->hsize; i++)
+	for (hn = dirlisttab->nodes[i]; hn; hn = hn->next) {
+	    dl = (Dirlisting) hn;
+	    for (j = 0, fn = dl->names; j < dl->nnames;
+		 j++, fn += strlen(fn) + 1)
+		*fn = DIRLIST_UNCHECKED;
+	}
+}
+
+/* Add all commands in a given directory *
+ * to the command hashtable.             */
+
+/**/
+void
+hashdir(char **dirp)
+{
+    Dirlisting dl;
+    struct stat st;
+    char *unmetadir, *fn;
+    int i, tmp;
+
+    if (isrelative(*dirp))
+	return;
+    unmetadir = unmeta(*dirp);
+    if (stat(unmetadir, &st) < 0 || !S_ISDIR(st.st_mode))
+	return;
+
+    if (!(dl = finddirlisting(*dirp, unmetadir, &st, &tmp)))
+	return;
+    if (isset(HASHEXECUTABLESONLY) && checkdirlisting(dl, unmetadir) &&
+	!tmp)
+	dirlistdirty = 1;
+
+    for (i = 0, fn = dl->names; i < dl->nnames; i++, fn += strlen(fn) + 1)
+	if (*fn == DIRLIST_EXE || !isset(HASHEXECUTABLESONLY))
+	    hashdirname(dirp, fn + 1);
+
+    if (tmp) {
+	dl->node.nam = NULL;
+	freedirlisting(&dl->node);
     }
-    closedir(dir);
-    zfree(pathbuf, dirlen + PATH_MAX + 2);
 }
 
 /* Go through user's PATH and add everything to *
@@ -717,6 +1479,8 @@ fillcmdnamtable(UNUSED(HashTable ht))
 	hashdir(pq);
 
     pathchecked = pq;
+
+    flushdirlistings();
 }
 
 /**/
@@ -1108,6 +1872,43 @@ static struct reswd reswds[] = {
     {{NULL, NULL, 0}, 0}
 };
 
+/*
+ * Reserved words and aliases affect how code is parsed, so changing
+ * them empties the cache of parsed strings in exec.c.
+ */
+
+/**/
+static void
+addlexnode(HashTable ht, char *nam, void *nodeptr)
+{
+    addhashnode(ht, nam, nodeptr);
+    clearparsecache();
+}
+
+/**/
+static HashNode
+removelexnode(HashTable ht, const char *nam)
+{
+    clearparsecache();
+    return removehashnode(ht, nam);
+}
+
+/**/
+static void
+disablelexnode(HashNode hn, int flags)
+{
+    disablehashnode(hn, flags);
+    clearparsecache();
+}
+
+/**/
+static void
+enablelexnode(HashNode hn, int flags)
+{
+    enablehashnode(hn, flags);
+    clearparsecache();
+}
+
 /* hash table containing the reserved words */
 
 /**/
@@ -1127,12 +1928,12 @@ createreswdtable(void)
     reswdtab->emptytable  = NULL;
     reswdtab->filltable   = NULL;
     reswdtab->cmpnodes    = strcmp;
-    reswdtab->addnode     = addhashnode;
+    reswdtab->addnode     = addlexnode;
     reswdtab->getnode     = gethashnode;
     reswdtab->getnode2    = gethashnode2;
     reswdtab->removenode  = NULL;
-    reswdtab->disablenode = disablehashnode;
-    reswdtab->enablenode  = enablehashnode;
+    reswdtab->disablenode = disablelexnode;
+    reswdtab->enablenode  = enablelexnode;
     reswdtab->freenode    = NULL;
     reswdtab->printnode   = printreswdnode;
 
@@ -1191,12 +1992,12 @@ createaliastable(HashTable ht)
     ht->emptytable  = NULL;
     ht->filltable   = NULL;
     ht->cmpnodes    = strcmp;
-    ht->addnode     = addhashnode;
+    ht->addnode     = addlexnode;
     ht->getnode     = gethashnode;
     ht->getnode2    = gethashnode2;
-    ht->removenode  = removehashnode;
-    ht->disablenode = disablehashnode;
-    ht->enablenode  = enablehashnode;
+    ht->removenode  = removelexnode;
+    ht->disablenode = disablelexnode;
+    ht->enablenode  = enablelexnode;
     ht->freenode    = freealiasnode;
     ht->printnode   = printaliasnode;
 }
@@ -1344,7 +2145,11 @@ printaliasnode(HashNode hn, int printflags)
 void
 createhisttable(void)
 {
-    histtab = newhashtable(599, "histtab", NULL);
+#ifdef ZSH_HASH_DEBUG
+    histtab = newopenhashtable(599, "histtab", printhisttabinfo);
+#else
+    histtab = newopenhashtable(599, "histtab", NULL);
+#endif
 
     histtab->hash        = histhasher;
     histtab->emptytable  = emptyhisttable;
@@ -1426,12 +2231,22 @@ histstrcmp(const char *str1, const char *str2)
 void
 addhistnode(HashTable ht, char *nam, void *nodeptr)
 {
-    HashNode oldnode = addhashnode2(ht, nam, nodeptr);
+    addhistnodeval(ht, nam, nodeptr, ht->hash(nam));
+}
+
+/* As addhistnode(), given the value of histhasher() for nam */
+
+/**/
+void
+addhistnodeval(HashTable ht, char *nam, void *nodeptr, unsigned hashval)
+{
+    HashNode oldnode = addhashnodeval(ht, nam, nodeptr, hashval);
     Histent he = (Histent)nodeptr;
     if (oldnode && oldnode != (HashNode)nodeptr) {
 	if (he->node.flags & HIST_MAKEUNIQUE
 	 || (he->node.flags & HIST_FOREIGN && (Histent)oldnode == he->up)) {
-	    (void) addhashnode2(ht, oldnode->nam, oldnode); /* restore hash */
+	    /* restore hash */
+	    (void) addhashnodeval(ht, oldnode->nam, oldnode, hashval);
 	    he->node.flags |= HIST_DUP;
 	    he->node.flags &= ~HIST_MAKEUNIQUE;
 	}
@@ -1450,7 +2265,7 @@ void
 freehistnode(HashNode nodeptr)
 {
     freehistdata((Histent)nodeptr, 1);
-    zfree(nodeptr, sizeof (struct histent));
+    freehistent((Histent)nodeptr);
 }
 
 /**/
@@ -1466,9 +2281,7 @@ freehistdata(Histent he, int unlink)
     if (!(he->node.flags & (HIST_DUP | HIST_TMPSTORE)))
 	removehashnode(histtab, he->node.nam);
 
-    zsfree(he->node.nam);
-    if (he->nwords)
-	zfree(he->words, he->nwords*2*sizeof(short));
+    freehisttext(he);
 
     if (unlink) {
 	if (!--histlinect)
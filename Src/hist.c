@@ -216,17 +216,145 @@ static zlong defev;
  */
 static int hist_keep_comment;
 
-/* Remember the last line in the history file so we can find it again. */
+/*
+ * With HIST_ATOMIC_APPEND, other shells may append between our own
+ * lines before we read the file again, so we keep the start and end
+ * offsets of up to this many runs of lines we appended ourselves.
+ */
+#define HISTOWNMAX 16
+
+/*
+ * Remember the last line in the history file so we can find it again,
+ * and the runs of lines we appended that we haven't yet read past.
+ */
 static struct histfile_stats {
     char *text;
     time_t stim, mtim;
     off_t fpos, fsiz;
+    off_t own[2 * HISTOWNMAX];
+    int nown;
     int interrupted;
     zlong next_write_ev;
 } lasthist;
 
+/*
+ * The text and word positions of history entries are not allocated
+ * separately for each entry but carved out of large chunks.  Each
+ * entry's words array is followed directly by its text.  Freeing an
+ * entry only counts its space as dead; once the dead space outweighs
+ * the live space, the next request for a new chunk copies the live
+ * entries into fresh chunks instead.  Each level of the history stack
+ * has its own arena.
+ */
+
+#define HISTCHUNKSZ 65536
+
+/* Number of history entries allocated together */
+
+#define HISTENTBLOCK 256
+
+struct histchunk {
+    struct histchunk *next;
+    size_t size;		/* bytes of data following this header */
+    size_t used;		/* bytes of those handed out */
+};
+
+static struct histarena {
+    struct histchunk *chunks;	/* chunk being filled, then older ones */
+    int nchunks;
+    size_t size;		/* total data bytes in all chunks */
+    size_t used;		/* bytes handed out */
+    size_t dead;		/* bytes of those belonging to freed entries */
+} histarena;
+
+/* Unused history entries, linked through their up pointers */
+
+static Histent freehistents;
+
+/**/
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+
+#include <sys/mman.h>
+
+/**/
+#if defined(MAP_PRIVATE) && defined(PROT_READ) && defined(PROT_WRITE)
+
+/**/
+#define USE_MMAP 1
+
+/**/
+#endif
+/**/
+#endif
+
+#ifdef USE_MMAP
+
+/*
+ * With HIST_INDEX, rewriting the history file also writes an index of
+ * it to $HISTFILE.idx.  The index starts with a struct histidxhdr and
+ * goes on with the words array and text of each line, laid out as in
+ * the history arena, then a struct histidxent for each line.  Reading
+ * the history file maps the index and points the entries straight at
+ * it, so nothing is parsed, copied or hashed for the lines it covers,
+ * and the text of a line is only read from disk if its entry is used.
+ * The index always covers the whole file, so it is no longer used once
+ * anything has been appended to the file.
+ */
+
+#define HISTIDX_MAGIC 0x7a686932	/* "zhi2" */
+
+/* Alignment of the entries, enough for any of their members */
+
+#define HISTIDX_ALIGN 16
+
+struct histidxhdr {
+    unsigned magic;
+    unsigned hdrsize;		/* sizeof(struct histidxhdr) */
+    unsigned entsize;		/* sizeof(struct histidxent) */
+    long mtimnsec;		/* the history file as it was written */
+    dev_t dev;
+    ino_t ino;
+    time_t mtim;
+    off_t size;
+    off_t ents;			/* where the entries start in the index */
+    zlong nents;
+};
+
+struct histidxent {
+    off_t fpos;			/* where the line starts in the file */
+    time_t stim, ftim;		/* as they appear in the file */
+    off_t data;			/* where the words array and text start */
+    int nwords;
+    unsigned hash;		/* histhasher() of the text */
+};
+
+/* An index being written */
+
+struct histidxout {
+    FILE *out;
+    char *tmpfile;
+    off_t datalen;		/* bytes of words and text written */
+    off_t fsize;		/* bytes of the file the lines take */
+    struct histidxent *ents;
+    zlong nents, entsalloc;
+    short *words;		/* for histsplitwords() */
+    int nwords;
+};
+
+/* Mapped indexes that history entries still point into */
+
+static struct histmap {
+    struct histmap *next;
+    char *addr;
+    size_t len;
+    zlong live;			/* number of those entries */
+} *histmaps;
+
+#endif /* USE_MMAP */
+
 static struct histsave {
     struct histfile_stats lasthist;
+    struct histarena histarena;
     char *histfile;
     HashTable histtab;
     Histent hist_ring;
@@ -1382,6 +1510,442 @@ putoldhistentryontop(short keep_going)
     hist_ring = he;
 }
 
+/* Space taken in the history arena by text with nwords words */
+
+static size_t
+histarenalen(char *text, int nwords)
+{
+    size_t len = nwords * 2 * sizeof(short) + strlen(text) + 1;
+
+    /* keep the next words array aligned */
+    return (len + sizeof(short) - 1) & ~(sizeof(short) - 1);
+}
+
+/* Free all chunks of the history arena */
+
+static void
+freehistarena(void)
+{
+    struct histchunk *c, *next;
+
+    for (c = histarena.chunks; c; c = next) {
+	next = c->next;
+	zfree(c, sizeof(struct histchunk) + c->size);
+    }
+    memset(&histarena, 0, sizeof histarena);
+}
+
+/* Take len bytes from the history arena, starting a chunk if needed */
+
+static char *
+carvehistarena(size_t len)
+{
+    struct histchunk *c = histarena.chunks;
+    char *ptr;
+
+    if (!c || c->size - c->used < len) {
+	size_t size = len > HISTCHUNKSZ ? len : HISTCHUNKSZ;
+
+	c = (struct histchunk *)zalloc(sizeof(struct histchunk) + size);
+	c->next = histarena.chunks;
+	c->size = size;
+	c->used = 0;
+	histarena.chunks = c;
+	histarena.nchunks++;
+	histarena.size += size;
+    }
+    ptr = (char *)(c + 1) + c->used;
+    c->used += len;
+    histarena.used += len;
+    return ptr;
+}
+
+/* Whether enough of the history arena is dead to be worth compacting */
+
+static int
+histarenawasteful(void)
+{
+    return histarena.dead >= HISTCHUNKSZ &&
+	histarena.dead > histarena.used / 2;
+}
+
+/*
+ * Copy the live entries of the history ring into fresh chunks.  Those
+ * whose text is in a mapped history index stay where they are.
+ */
+
+static void
+compacthistarena(void)
+{
+    struct histchunk *c = histarena.chunks, *next;
+    Histent he;
+
+    memset(&histarena, 0, sizeof histarena);
+    if (hist_ring) {
+	/* oldest first, so that entries stay in order in the chunks */
+	for (he = hist_ring->down; ; he = he->down) {
+	    if (he != &curline && he->node.nam &&
+		!(he->node.flags & HIST_MAPPED)) {
+		size_t wlen = he->nwords * 2 * sizeof(short);
+		char *ptr = carvehistarena(histarenalen(he->node.nam,
+							he->nwords));
+
+		if (wlen) {
+		    memcpy(ptr, he->words, wlen);
+		    he->words = (short *)ptr;
+		}
+		strcpy(ptr + wlen, he->node.nam);
+		he->node.nam = ptr + wlen;
+	    }
+	    if (he == hist_ring)
+		break;
+	}
+    }
+    for (; c; c = next) {
+	next = c->next;
+	zfree(c, sizeof(struct histchunk) + c->size);
+    }
+}
+
+/*
+ * Index used by the ZLE history searches.  For each history number
+ * there is a slot holding the entry with that number and a signature
+ * of its text: one bit is set for each (lower-cased) trigram in it.
+ * An entry whose signature lacks a bit set for the search string can't
+ * contain that string, so a search can step through the slots and
+ * only look at entries that might match.  Entries containing non-ASCII
+ * characters, where case-insensitive matching is not simply bytewise,
+ * get all bits set.
+ *
+ * The index is only built when a search first asks for it; after that
+ * it is kept up to date as entries are added and freed.  Every entry
+ * in the history ring apart from curline must have a slot, so if an
+ * entry can't be given one the index is thrown away instead.
+ */
+
+#define HISTSIGBITS 128
+#define HISTSIGWORDS (HISTSIGBITS / (8 * sizeof(unsigned)))
+
+struct histslot {
+    Histent he;			/* NULL if number not in use */
+    unsigned sig[HISTSIGWORDS];
+};
+
+static struct histindex {
+    struct histslot *slots;	/* NULL if not built */
+    zlong base;			/* history number of slots[0] */
+    int start;			/* no entries below this slot */
+    int size;			/* no entries from this slot on */
+    int alloc;
+} histindex;
+
+/* Add the signature of the trigrams in str to sig */
+
+static void
+histsig(const char *str, unsigned *sig, int entry)
+{
+    unsigned char c, t[3] = { 0, 0, 0 };
+    int n = 0;
+
+    while ((c = (unsigned char)*str++)) {
+	if (c >= 0x80) {
+	    if (entry) {
+		memset(sig, 0xff, HISTSIGWORDS * sizeof(unsigned));
+		return;
+	    }
+	    n = 0;
+	    continue;
+	}
+	t[0] = t[1];
+	t[1] = t[2];
+	t[2] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	if (++n >= 3) {
+	    unsigned bit = (((t[0] * 31U + t[1]) * 31U + t[2]) *
+			    2654435761U >> 16) % HISTSIGBITS;
+
+	    sig[bit / (8 * sizeof(unsigned))] |=
+		1U << (bit % (8 * sizeof(unsigned)));
+	}
+    }
+}
+
+static void
+freehistindex(void)
+{
+    if (histindex.slots)
+	zfree(histindex.slots, histindex.alloc * sizeof(struct histslot));
+    memset(&histindex, 0, sizeof histindex);
+}
+
+static void
+histindexadd(Histent he)
+{
+    zlong i = he->histnum - histindex.base;
+    int empty = histindex.start >= histindex.size;
+    struct histslot *slot;
+
+    if (i < 0) {
+	freehistindex();
+	return;
+    }
+    if (i >= histindex.alloc && histindex.start > histindex.size / 2) {
+	/* the oldest half has gone, make room by moving the rest down */
+	memmove(histindex.slots, histindex.slots + histindex.start,
+		(histindex.size - histindex.start) * sizeof(struct histslot));
+	memset(histindex.slots + histindex.size - histindex.start, 0,
+	       histindex.start * sizeof(struct histslot));
+	histindex.base += histindex.start;
+	histindex.size -= histindex.start;
+	i -= histindex.start;
+	histindex.start = 0;
+    }
+    if (i >= histindex.alloc) {
+	int alloc = histindex.alloc * 2;
+
+	if (alloc <= i)
+	    alloc = i + 64;
+	histindex.slots = zrealloc(histindex.slots,
+				   alloc * sizeof(struct histslot));
+	memset(histindex.slots + histindex.alloc, 0,
+	       (alloc - histindex.alloc) * sizeof(struct histslot));
+	histindex.alloc = alloc;
+    }
+    if (i >= histindex.size)
+	histindex.size = i + 1;
+    if (empty || i < histindex.start)
+	histindex.start = i;
+    slot = histindex.slots + i;
+    slot->he = he;
+    memset(slot->sig, 0, sizeof(slot->sig));
+    histsig(he->node.nam, slot->sig, 1);
+}
+
+static void
+histindexremove(Histent he)
+{
+    zlong i = he->histnum - histindex.base;
+
+    if (i < 0 || i >= histindex.size || histindex.slots[i].he != he)
+	return;
+    histindex.slots[i].he = NULL;
+    while (histindex.start < histindex.size &&
+	   !histindex.slots[histindex.start].he)
+	histindex.start++;
+    while (histindex.size > histindex.start &&
+	   !histindex.slots[histindex.size - 1].he)
+	histindex.size--;
+}
+
+/* Build the search index for the current history list if needed */
+
+static int
+histindexready(void)
+{
+    Histent he;
+
+    if (histindex.slots)
+	return 1;
+    if (!hist_ring)
+	return 0;
+    for (he = hist_ring->down; ; he = he->down) {
+	if (he != &curline && he->node.nam) {
+	    if (!histindex.slots)
+		histindex.base = he->histnum;
+	    histindexadd(he);
+	    if (!histindex.slots)
+		return 0;
+	}
+	if (he == hist_ring)
+	    break;
+    }
+    return histindex.slots != NULL;
+}
+
+/*
+ * As movehistent(he, n, xflags) with n = 1 or -1, but skip entries
+ * that can't contain str.  Entries whose text is being edited are
+ * never skipped.
+ */
+
+/**/
+mod_export Histent
+movehistentmatch(Histent he, int n, int xflags, char *str)
+{
+    unsigned sig[HISTSIGWORDS];
+    zlong i;
+    int j;
+
+    memset(sig, 0, sizeof(sig));
+    histsig(str, sig, 0);
+    for (j = 0; j < (int)HISTSIGWORDS && !sig[j]; j++)
+	;
+    if (j == (int)HISTSIGWORDS || !histindexready())
+	return movehistent(he, n, xflags);
+    if (he == &curline) {
+	if (n > 0)
+	    return movehistent(he, n, xflags);
+	i = histindex.size - 1;
+    } else {
+	i = he->histnum - histindex.base;
+	if (i < histindex.start || i >= histindex.size ||
+	    histindex.slots[i].he != he)
+	    return movehistent(he, n, xflags);
+	i += n;
+    }
+    for (; i >= histindex.start && i < histindex.size; i += n) {
+	struct histslot *slot = histindex.slots + i;
+
+	if (!slot->he || (slot->he->node.flags & xflags))
+	    continue;
+	if (!slot->he->zle_text) {
+	    for (j = 0; j < (int)HISTSIGWORDS; j++)
+		if ((slot->sig[j] & sig[j]) != sig[j])
+		    break;
+	    if (j < (int)HISTSIGWORDS)
+		continue;
+	}
+	return slot->he;
+    }
+    /* below the newest entry there can only be the line being edited */
+    if (n > 0 && hist_ring == &curline && histindex.size > histindex.start)
+	return movehistent(histindex.slots[histindex.size - 1].he, n, xflags);
+    return NULL;
+}
+
+/*
+ * Store a copy of text and its nwords pairs of word positions as the
+ * contents of history entry he, which must not hold any already.
+ */
+
+/**/
+void
+sethisttext(Histent he, char *text, short *words, int nwords)
+{
+    size_t len = histarenalen(text, nwords), wlen;
+    struct histchunk *c = histarena.chunks;
+    char *ptr;
+
+    if ((!c || c->size - c->used < len) && histarenawasteful())
+	compacthistarena();
+    ptr = carvehistarena(len);
+    if ((he->nwords = nwords)) {
+	wlen = nwords * 2 * sizeof(short);
+	memcpy(ptr, words, wlen);
+	he->words = (short *)ptr;
+	ptr += wlen;
+    } else
+	he->words = NULL;
+    strcpy(ptr, text);
+    he->node.nam = ptr;
+    if (histindex.slots)
+	histindexadd(he);
+}
+
+#ifdef USE_MMAP
+
+/* Unmap the index containing ptr once nothing points into it */
+
+static void
+unrefhistmap(char *ptr)
+{
+    struct histmap **mp, *m;
+
+    for (mp = &histmaps; (m = *mp); mp = &m->next) {
+	if (ptr >= m->addr && ptr < m->addr + m->len) {
+	    if (!--m->live) {
+		*mp = m->next;
+		munmap(m->addr, m->len);
+		zfree(m, sizeof *m);
+	    }
+	    return;
+	}
+    }
+    DPUTS(1, "BUG: mapped history entry not in a history index");
+}
+
+#endif /* USE_MMAP */
+
+/* Release the text of history entry he back to the arena */
+
+/**/
+void
+freehisttext(Histent he)
+{
+    if (he->node.nam) {
+	if (histindex.slots)
+	    histindexremove(he);
+#ifdef USE_MMAP
+	if (he->node.flags & HIST_MAPPED) {
+	    unrefhistmap(he->node.nam);
+	    he->node.flags &= ~HIST_MAPPED;
+	} else
+#endif
+	    histarena.dead += histarenalen(he->node.nam, he->nwords);
+	he->node.nam = NULL;
+    }
+    he->words = NULL;
+    he->nwords = 0;
+}
+
+/*
+ * History entries themselves are allocated in blocks and kept on a
+ * free list when released rather than being returned to malloc.
+ */
+
+/**/
+Histent
+allochistent(void)
+{
+    Histent he;
+
+    if (!freehistents) {
+	int i;
+
+	he = (Histent)zalloc(HISTENTBLOCK * sizeof *he);
+	for (i = 0; i < HISTENTBLOCK; i++, he++) {
+	    he->up = freehistents;
+	    freehistents = he;
+	}
+    }
+    he = freehistents;
+    freehistents = he->up;
+    memset(he, 0, sizeof *he);
+    return he;
+}
+
+/**/
+void
+freehistent(Histent he)
+{
+    he->up = freehistents;
+    freehistents = he;
+}
+
+/**/
+#ifdef ZSH_HASH_DEBUG
+
+/* Print memory use of the history arena, for hashinfo */
+
+/**/
+void
+printhistarenainfo(void)
+{
+    printf("\nhistory arena chunks                    : %4d\n",
+	   histarena.nchunks);
+    printf("bytes in history arena chunks           : %ld\n",
+	   (long)(histarena.size + histarena.nchunks *
+		  sizeof(struct histchunk)));
+    printf("bytes used by history entries           : %ld\n",
+	   (long)(histarena.used - histarena.dead));
+    printf("bytes left by freed history entries     : %ld\n",
+	   (long)histarena.dead);
+    printf("bytes in history entry headers          : %ld\n",
+	   (long)(histlinect * sizeof(struct histent)));
+}
+
+/**/
+#endif /* ZSH_HASH_DEBUG */
+
 /**/
 Histent
 prepnexthistent(void)
@@ -1397,7 +1961,7 @@ prepnexthistent(void)
     }
 
     if (histlinect < histsiz || !hist_ring) {
-	he = (Histent)zshcalloc(sizeof *he);
+	he = allochistent();
 	if (!hist_ring)
 	    hist_ring = he->up = he->down = he;
 	else {
@@ -1524,9 +2088,12 @@ hend(Eprog prog)
 	errflag &= ~ERRFLAG_ERROR;
 	errflag |= save_errflag;
     }
-    /* For history sharing, lock history file once for both read and write */
+    /*
+     * For history sharing, lock history file once for both read and write,
+     * unless appending atomically, when neither needs the lock.
+     */
     hf = getsparam("HISTFILE");
-    if (isset(SHAREHISTORY) && !lockhistfile(hf, 0)) {
+    if (isset(SHAREHISTORY) && (histatomicappend() || !lockhistfile(hf, 0))) {
 	readhistfile(hf, 0, HFILE_USE_OPTIONS | HFILE_FAST);
 	curline.histnum = curhist+1;
     }
@@ -1613,15 +2180,11 @@ hend(Eprog prog)
 	} else
 	    he = prepnexthistent();
 
-	he->node.nam = ztrdup(chline);
+	sethisttext(he, chline, chwords, chwordpos/2);
 	he->stim = time(NULL);
 	he->ftim = 0L;
 	he->node.flags = newflags;
 
-	if ((he->nwords = chwordpos/2)) {
-	    he->words = (short *)zalloc(chwordpos * sizeof(short));
-	    memcpy(he->words, chwords, chwordpos * sizeof(short));
-	}
 	if (!(newflags & HIST_TMPSTORE))
 	    addhistnode(histtab, he->node.nam, he);
     }
@@ -1633,7 +2196,7 @@ hend(Eprog prog)
     /*
      * For normal INCAPPENDHISTORY case and reasoning, see hbegin().
      */
-    if (isset(SHAREHISTORY) ? histfileIsLocked() :
+    if (isset(SHAREHISTORY) ? histatomicappend() || histfileIsLocked() :
 	(isset(INCAPPENDHISTORY) || (isset(INCAPPENDHISTORYTIME) &&
 				     histsave_stack_pos != 0)))
 	savehistfile(hf, 0, HFILE_USE_OPTIONS | HFILE_FAST);
@@ -2628,9 +3191,58 @@ resizehistents(void)
 	    putoldhistentryontop(1);
 	    freehistnode(&hist_ring->node);
 	}
+	if (histarenawasteful())
+	    compacthistarena();
     }
 }
 
+#ifdef HAVE_FCNTL_H
+static int flock_fd = -1;
+
+/*
+ * Wait for a lock of the given type on the whole of the file open on fd.
+ * Where available, use a lock belonging to the open file rather than to
+ * the process, so that it isn't dropped when we close some other
+ * descriptor for the same file, as happens when the file is read back
+ * while we are rewriting it.
+ */
+
+static int
+lockhistfd(int fd, int type)
+{
+    struct flock lck;
+
+    lck.l_type = type;
+    lck.l_whence = SEEK_SET;
+    lck.l_start = 0;
+    lck.l_len = 0;  /* lock the whole file */
+    lck.l_pid = 0;
+#ifdef F_OFD_SETLKW
+    if (fcntl(fd, F_OFD_SETLKW, &lck) == 0)
+	return 0;
+    if (errno != EINVAL)
+	return -1;
+#endif
+    return fcntl(fd, F_SETLKW, &lck);
+}
+#endif
+
+/*
+ * Are new lines appended to the history file with a single write(),
+ * without taking the history file lock?
+ */
+
+/**/
+static int
+histatomicappend(void)
+{
+#ifdef HAVE_FCNTL_H
+    return isset(HISTATOMICAPPEND);
+#else
+    return 0;
+#endif
+}
+
 static int
 readhistline(int start, char **bufp, int *bufsiz, FILE *in, int *readbytes)
 {
@@ -2670,8 +3282,165 @@ readhistline(int start, char **bufp, int *bufsiz, FILE *in, int *readbytes)
     return 0;
 }
 
+/* Set the times of history entry he as read from the history file */
+
+static void
+sethisttimes(Histent he, time_t stim, time_t ftim, time_t tim)
+{
+    if ((he->stim = stim) == 0)
+	he->stim = he->ftim = tim;
+    else if (ftim < stim)
+	he->ftim = stim + ftim;
+    else
+	he->ftim = ftim;
+}
+
+#ifdef USE_MMAP
+
+/*
+ * Check that the history index mapped at addr, len bytes long, is for
+ * the history file with the status sb.  The file must be exactly as it
+ * was when the index was written, as for the fast reread of the file.
+ * Everything the entries point to must be within the index, and the
+ * words of each line within its text, whatever is in the file.
+ */
+
+static int
+checkhistindex(char *addr, size_t len, struct stat *sb)
+{
+    struct histidxhdr *hdr = (struct histidxhdr *)addr;
+    struct histidxent *ent, *end;
+    off_t fpos = 0;
+
+    if (len < sizeof(*hdr) || hdr->magic != HISTIDX_MAGIC ||
+	hdr->hdrsize != sizeof(*hdr) || hdr->entsize != sizeof(*ent) ||
+	hdr->dev != sb->st_dev || hdr->ino != sb->st_ino ||
+	hdr->size != sb->st_size || hdr->mtim != sb->st_mtime ||
+#ifdef GET_ST_MTIME_NSEC
+	hdr->mtimnsec != (long)GET_ST_MTIME_NSEC(*sb) ||
+#endif
+	hdr->size <= 0 || hdr->nents <= 0 ||
+	hdr->ents <= (off_t)sizeof(*hdr) || hdr->ents > (off_t)len ||
+	hdr->ents % HISTIDX_ALIGN ||
+	(len - hdr->ents) / sizeof(*ent) != (size_t)hdr->nents ||
+	(len - hdr->ents) % sizeof(*ent) ||
+	/* so that the text of every entry ends within the data */
+	addr[hdr->ents - 1] != '\0')
+	return 0;
+    ent = (struct histidxent *)(addr + hdr->ents);
+    for (end = ent + hdr->nents; ent < end; ent++) {
+	short *words;
+	int i, wpos = 0, tlen;
+
+	if (ent->fpos < fpos || ent->fpos >= hdr->size ||
+	    ent->nwords < 0 || ent->data < (off_t)sizeof(*hdr) ||
+	    ent->data % sizeof(short) ||
+	    ent->data + ent->nwords * 2 * (off_t)sizeof(short) >= hdr->ents)
+	    return 0;
+	fpos = ent->fpos;
+	/* Word starts and ends must be in order and within the text */
+	words = (short *)(addr + ent->data);
+	tlen = strlen((char *)(words + 2 * ent->nwords));
+	for (i = 0; i < 2 * ent->nwords; i++) {
+	    if (words[i] < wpos || words[i] > tlen)
+		return 0;
+	    wpos = words[i];
+	}
+    }
+    return 1;
+}
+
+/*
+ * Add the lines in the history file fn, which has the status sb, to
+ * the history from its index as readhistfile() would from the file
+ * itself.  Return the size of the file, or 0 if there is no usable
+ * index.
+ */
+
+static off_t
+readhistindex(char *fn, struct stat *sb, int newflags, int readflags,
+	      time_t tim)
+{
+    struct histidxhdr *hdr;
+    struct histidxent *ent, *end;
+    struct histmap *map;
+    struct stat isb;
+    Histent he;
+    char *addr, *text = NULL;
+    size_t len;
+    off_t size;
+    int fd;
+
+    if ((fd = open(dyncat(unmeta(fn), ".idx"), O_RDONLY | O_NOCTTY)) < 0)
+	return 0;
+    /*
+     * Private and writable, as the text of entries is sometimes cut
+     * short in place for a moment.
+     */
+    if (fstat(fd, &isb) < 0 || isb.st_size < (off_t)sizeof(*hdr) ||
+	(addr = (char *)mmap(NULL, len = isb.st_size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE, fd, 0)) == (char *)-1) {
+	close(fd);
+	return 0;
+    }
+    close(fd);
+    if (!checkhistindex(addr, len, sb)) {
+	munmap(addr, len);
+	return 0;
+    }
+    hdr = (struct histidxhdr *)addr;
+    size = hdr->size;
+
+    map = (struct histmap *)zalloc(sizeof *map);
+    map->next = histmaps;
+    map->addr = addr;
+    map->len = len;
+    /* Keep it mapped until we've finished, even if every line is a dup */
+    map->live = 1;
+    histmaps = map;
+
+    ent = (struct histidxent *)(addr + hdr->ents);
+    for (end = ent + hdr->nents; ent < end; ent++) {
+	if (readflags & HFILE_USE_OPTIONS) {
+	    lasthist.fpos = ent->fpos;
+	    lasthist.stim = ent->stim;
+	    histfile_linect++;
+	}
+	he = prepnexthistent();
+	he->node.flags = newflags | HIST_MAPPED;
+	sethisttimes(he, ent->stim, ent->ftim, tim);
+	if ((he->nwords = ent->nwords))
+	    he->words = (short *)(addr + ent->data);
+	text = addr + ent->data + ent->nwords * 2 * sizeof(short);
+	he->node.nam = text;
+	map->live++;
+	if (histindex.slots)
+	    histindexadd(he);
+	addhistnodeval(histtab, text, he, ent->hash);
+	if (he->node.flags & HIST_DUP) {
+	    freehistnode(&he->node);
+	    curhist--;
+	}
+    }
+    if (readflags & HFILE_USE_OPTIONS) {
+	zsfree(lasthist.text);
+	lasthist.text = ztrdup(text);
+    }
+    unrefhistmap(addr);
+
+    return size;
+}
+
+#endif /* USE_MMAP */
+
+/*
+ * Read lines from the history file into the history.  Returns the
+ * offset in the file after the last line read, or -1 if the file
+ * wasn't read.
+ */
+
 /**/
-void
+off_t
 readhistfile(char *fn, int err, int readflags)
 {
     char *buf, *start = NULL;
@@ -2683,29 +3452,45 @@ readhistfile(char *fn, int err, int readflags)
     struct stat sb;
     int nwordpos, nwords, bufsiz;
     int searching, newflags, l, ret, uselex, readbytes;
+    /*
+     * Reading without the lock, either as asked or because other
+     * shells append atomically: we must skip our own lines and stop
+     * at a line that is still being written.
+     */
+    int tail = (readflags & HFILE_UNLOCKED) ||
+	((readflags & HFILE_FAST) && histatomicappend());
 
     if (!fn && !(fn = getsparam("HISTFILE")))
-	return;
+	return -1;
     if (stat(unmeta(fn), &sb) < 0 ||
 	sb.st_size == 0)
-	return;
+	return -1;
     if (readflags & HFILE_FAST) {
 	if (!lasthist.interrupted &&
 	    ((lasthist.fsiz == sb.st_size && lasthist.mtim == sb.st_mtime)
-	     || lockhistfile(fn, 0)))
-	    return;
+	     || (!tail && lockhistfile(fn, 0))))
+	    return -1;
 	lasthist.fsiz = sb.st_size;
 	lasthist.mtim = sb.st_mtime;
 	lasthist.interrupted = 0;
-    } else if ((ret = lockhistfile(fn, 1))) {
+    } else if (!tail && (ret = lockhistfile(fn, 1))) {
 	if (ret == 2) {
 	    zwarn("locking failed for %s: %e: reading anyway", fn, errno);
 	} else {
 	    zerr("locking failed for %s: %e", fn, errno);
-	    return;
+	    return -1;
 	}
     }
     if ((in = fopen(unmeta(fn), "r"))) {
+#ifdef HAVE_FCNTL_H
+	/*
+	 * Keep out a rewrite in place, which only happens locked.  A
+	 * long read in the background does without, so as not to keep
+	 * shells from locking the file meanwhile.
+	 */
+	if (tail && readflags & HFILE_FAST && flock_fd < 0)
+	    (void)lockhistfd(fileno(in), F_RDLCK);
+#endif
 	nwords = 64;
 	words = (short *)zalloc(nwords*sizeof(short));
 	bufsiz = 1024;
@@ -2723,6 +3508,8 @@ readhistfile(char *fn, int err, int readflags)
 	    }
 	} else
 	    searching = 0;
+	if (searching < 0)
+	    lasthist.nown = 0;
 
 	fpos = ftell(in);
 	readbytes = 0;
@@ -2732,6 +3519,18 @@ readhistfile(char *fn, int err, int readflags)
 	if (readflags & HFILE_SKIPOLD
 	 || (hist_ignore_all_dups && newflags & hist_skip_flags))
 	    newflags |= HIST_MAKEUNIQUE;
+#ifdef USE_MMAP
+	/* Take what we can from the index; its words are split at blanks */
+	if (!(readflags & HFILE_FAST) && !tail && isset(HISTINDEX) &&
+	    !isset(HISTLEXWORDS)) {
+	    off_t done = readhistindex(fn, &sb, newflags, readflags, tim);
+
+	    if (done) {
+		fpos = done;
+		fseek(in, fpos, SEEK_SET);
+	    }
+	}
+#endif
 	while (fpos += readbytes, readbytes = 0, (l = readhistline(0, &buf, &bufsiz, in, &readbytes))) {
 	    char *pt;
 	    int remeta = 0;
@@ -2740,6 +3539,12 @@ readhistfile(char *fn, int err, int readflags)
 		zerr("corrupt history file %s", fn);
 		break;
 	    }
+	    /*
+	     * readhistline() only leaves the line unterminated if it
+	     * ran into the end of the file before the newline.
+	     */
+	    if (tail && buf[l - 1] != '\0')
+		break;
 
 	    /*
 	     * Handle the special case that we're reading from an
@@ -2792,8 +3597,10 @@ readhistfile(char *fn, int err, int readflags)
 			searching = 0;
 		    else {
 			fseek(in, 0, SEEK_SET);
+			fpos = readbytes = 0;
 			histfile_linect = 0;
 			searching = -1;
+			lasthist.nown = 0;
 		    }
 		    continue;
 		}
@@ -2805,20 +3612,30 @@ readhistfile(char *fn, int err, int readflags)
 	    }
 
 	    if (readflags & HFILE_USE_OPTIONS) {
-		histfile_linect++;
 		lasthist.fpos = fpos;
 		lasthist.stim = stim;
+		if (tail) {
+		    /*
+		     * The buffer may be overwritten by a partial line
+		     * before we finish, so remember each line as we go.
+		     */
+		    zsfree(lasthist.text);
+		    lasthist.text = ztrdup(pt);
+		}
+		while (lasthist.nown && fpos >= lasthist.own[1]) {
+		    lasthist.nown--;
+		    memmove(lasthist.own, lasthist.own + 2,
+			    2 * lasthist.nown * sizeof(off_t));
+		}
+		/* Our own lines are already counted and in the history */
+		if (lasthist.nown && fpos >= lasthist.own[0])
+		    continue;
+		histfile_linect++;
 	    }
 
 	    he = prepnexthistent();
-	    he->node.nam = ztrdup(pt);
 	    he->node.flags = newflags;
-	    if ((he->stim = stim) == 0)
-		he->stim = he->ftim = tim;
-	    else if (ftim < stim)
-		he->ftim = stim + ftim;
-	    else
-		he->ftim = ftim;
+	    sethisttimes(he, stim, ftim, tim);
 
 	    /*
 	     * Divide up the words.
@@ -2826,13 +3643,7 @@ readhistfile(char *fn, int err, int readflags)
 	    start = pt;
 	    uselex = isset(HISTLEXWORDS) && !(readflags & HFILE_FAST);
 	    histsplitwords(pt, &words, &nwords, &nwordpos, uselex);
-
-	    he->nwords = nwordpos/2;
-	    if (he->nwords) {
-		he->words = (short *)zalloc(nwordpos*sizeof(short));
-		memcpy(he->words, words, nwordpos*sizeof(short));
-	    } else
-		he->words = (short *)NULL;
+	    sethisttext(he, pt, words, nwordpos/2);
 	    addhistnode(histtab, he->node.nam, he);
 	    if (he->node.flags & HIST_DUP) {
 		freehistnode(&he->node);
@@ -2851,7 +3662,7 @@ readhistfile(char *fn, int err, int readflags)
 	    /* Can't assume fast read next time if interrupted. */
 	    lasthist.interrupted = 1;
 	}
-	if (start && readflags & HFILE_USE_OPTIONS) {
+	if (start && readflags & HFILE_USE_OPTIONS && !tail) {
 	    zsfree(lasthist.text);
 	    lasthist.text = ztrdup(start);
 	}
@@ -2860,18 +3671,22 @@ readhistfile(char *fn, int err, int readflags)
 
 	popheap();
 	fclose(in);
-    } else if (err)
-	zerr("can't read history file %s", fn);
+    } else {
+	if (err)
+	    zerr("can't read history file %s", fn);
+	fpos = -1;
+    }
 
-    unlockhistfile(fn);
+    if (!tail)
+	unlockhistfile(fn);
 
     if (zleactive)
 	zleentry(ZLE_CMD_SET_HIST_LINE, curhist);
+
+    return fpos;
 }
 
 #ifdef HAVE_FCNTL_H
-static int flock_fd = -1;
-
 /*
  * Lock file using fcntl().  Return 0 on success, 1 on failure of
  * locking mechanism, 2 on permanent failure (e.g. permission).
@@ -2880,7 +3695,6 @@ static int flock_fd = -1;
 static int
 flockhistfile(char *fn, int keep_trying)
 {
-    struct flock lck;
     long sleep_us = 0x10000; /* about 67 ms */
     time_t end_time;
 
@@ -2890,16 +3704,11 @@ flockhistfile(char *fn, int keep_trying)
     if ((flock_fd = open(unmeta(fn), O_RDWR | O_NOCTTY)) < 0)
 	return errno == ENOENT ? 0 : 2; /* "successfully" locked missing file */
 
-    lck.l_type = F_WRLCK;
-    lck.l_whence = SEEK_SET;
-    lck.l_start = 0;
-    lck.l_len = 0;  /* lock the whole file */
-
     /*
      * Timeout is ten seconds.
      */
     end_time = zmonotime(NULL) + (time_t)10;
-    while (fcntl(flock_fd, F_SETLKW, &lck) == -1) {
+    while (lockhistfd(flock_fd, F_WRLCK) == -1) {
 	if (!keep_trying || zmonotime(NULL) >= end_time ||
 	    /*
 	     * Randomise wait to minimise clashes with shells exiting at
@@ -2915,18 +3724,246 @@ flockhistfile(char *fn, int keep_trying)
 
     return 0;
 }
+
+/*
+ * Append complete lines to the history file with a single write(),
+ * and remember where they went so we don't read them back.
+ * Return -1 on failure.
+ */
+
+static int
+appendhistfile(char *fn, char *buf, int len)
+{
+    struct stat sb, fsb;
+    off_t end;
+    int fd, tries, ret;
+
+    for (tries = 0; ; tries++) {
+	/* O_RDWR as a shared lock needs the file open for reading */
+	fd = open(unmeta(fn), O_CREAT | O_RDWR | O_APPEND | O_NOCTTY, 0600);
+	if (fd < 0)
+	    return -1;
+	/*
+	 * Appending shells can share the lock; a rewrite can't.
+	 * Once we have it the file may have been replaced, in which
+	 * case we need the new one.
+	 */
+	if (flock_fd >= 0 || lockhistfd(fd, F_RDLCK) < 0 || tries == 3 ||
+	    fstat(fd, &fsb) < 0 || stat(unmeta(fn), &sb) < 0 ||
+	    (fsb.st_dev == sb.st_dev && fsb.st_ino == sb.st_ino))
+	    break;
+	close(fd);
+    }
+
+    if ((ret = write(fd, buf, len)) == len) {
+	ret = 0;
+	if ((end = lseek(fd, 0, SEEK_CUR)) >= len) {
+	    off_t *own = lasthist.own + 2 * lasthist.nown;
+
+	    if (!lasthist.nown || own[-1] != end - len) {
+		if (lasthist.nown == HISTOWNMAX) {
+		    /* Too far behind: forget the oldest */
+		    memmove(lasthist.own, lasthist.own + 2,
+			    2 * --lasthist.nown * sizeof(off_t));
+		    own -= 2;
+		}
+		lasthist.nown++;
+		*own = end - len;
+		own += 2;
+	    }
+	    own[-1] = end;
+	    /*
+	     * If nobody else wrote since we last read the file, there
+	     * is no need to read it next time.
+	     */
+	    if (lasthist.fsiz == end - len && fstat(fd, &fsb) == 0 &&
+		fsb.st_size == end) {
+		lasthist.fsiz = end;
+		lasthist.mtim = fsb.st_mtime;
+	    }
+	}
+    } else
+	ret = -1;
+    close(fd);
+
+    return ret;
+}
 #endif
 
+/*
+ * Add the line for he in the history file to the buffer at offset off,
+ * growing the buffer as needed.  Return the offset after the line.
+ */
+
+static int
+histfileline(Histent he, int extended_history, char **bufp, int *sizep,
+	     int off)
+{
+    char *t = he->node.nam, *ptr;
+    /* Every character may need a backslash, then the times and newline */
+    int end_backslashes = 0, need = off + 2 * strlen(t) + 64;
+
+    if (need > *sizep) {
+	if (need < 2 * *sizep)
+	    need = 2 * *sizep;
+	*bufp = zrealloc(*bufp, need);
+	*sizep = need;
+    }
+    ptr = *bufp + off;
+    if (extended_history) {
+	sprintf(ptr, ": %ld:%ld;", (long)he->stim,
+		he->ftim? (long)(he->ftim - he->stim) : 0L);
+	ptr += strlen(ptr);
+    } else if (*t == ':')
+	*ptr++ = '\\';
+
+    for (; *t; t++) {
+	if (*t == '\n')
+	    *ptr++ = '\\';
+	end_backslashes = (*t == '\\' || (end_backslashes && *t == ' '));
+	*ptr++ = *t;
+    }
+    if (end_backslashes)
+	*ptr++ = ' ';
+    *ptr++ = '\n';
+
+    return ptr - *bufp;
+}
+
+#ifdef USE_MMAP
+
+/*
+ * Start writing an index of the history file fn, which is being
+ * written from the beginning.  Returns NULL if there is to be none.
+ */
+
+static struct histidxout *
+starthistidx(char *fn)
+{
+    struct histidxout *idx;
+    struct histidxhdr hdr;
+    char *tmpfile;
+    FILE *out;
+    int fd;
+
+    if (!isset(HISTINDEX) ||
+	(fd = gettempfile(dyncat(fn, ".idx"), 1, &tmpfile)) < 0)
+	return NULL;
+    if (!(out = fdopen(fd, "w"))) {
+	close(fd);
+	unlink(tmpfile);
+	return NULL;
+    }
+    /* The header is filled in when we know what goes in it */
+    memset(&hdr, 0, sizeof hdr);
+    fwrite(&hdr, sizeof hdr, 1, out);
+
+    idx = (struct histidxout *)zshcalloc(sizeof *idx);
+    idx->out = out;
+    idx->tmpfile = tmpfile;
+    idx->datalen = sizeof hdr;
+    idx->nwords = 64;
+    idx->words = (short *)zalloc(idx->nwords * sizeof(short));
+    return idx;
+}
+
+/* Add he, written to the history file as a line len bytes long */
+
+static void
+histidxline(struct histidxout *idx, Histent he, int extended_history,
+	    off_t len)
+{
+    struct histidxent *ent;
+    size_t tlen = strlen(he->node.nam) + 1, alen;
+    int nwordpos;
+
+    if (idx->nents == idx->entsalloc) {
+	idx->entsalloc = idx->entsalloc ? 2 * idx->entsalloc : 256;
+	idx->ents = (struct histidxent *)
+	    zrealloc(idx->ents, idx->entsalloc * sizeof *ent);
+    }
+    ent = idx->ents + idx->nents++;
+    memset(ent, 0, sizeof *ent);
+    ent->fpos = idx->fsize;
+    /* What readhistfile() would make of the line */
+    if (extended_history) {
+	ent->stim = he->stim;
+	ent->ftim = he->ftim ? he->ftim - he->stim : 0;
+    }
+    histsplitwords(he->node.nam, &idx->words, &idx->nwords, &nwordpos, 0);
+    ent->nwords = nwordpos / 2;
+    ent->data = idx->datalen;
+    ent->hash = histhasher(he->node.nam);
+
+    alen = histarenalen(he->node.nam, ent->nwords);
+    idx->datalen += alen;
+    fwrite(idx->words, sizeof(short), nwordpos, idx->out);
+    fwrite(he->node.nam, 1, tlen, idx->out);
+    for (alen -= nwordpos * sizeof(short) + tlen; alen; alen--)
+	putc('\0', idx->out);
+
+    idx->fsize += len;
+}
+
+/*
+ * Finish the index of the history file fn and put it in place if ok,
+ * which must be done with the history file locked and in its final
+ * state, else throw it away.  It is also thrown away if there is more
+ * in the file than the lines it covers.
+ */
+
+static void
+endhistidx(struct histidxout *idx, char *fn, int ok)
+{
+    struct histidxhdr hdr;
+    struct stat sb;
+
+    if (ok && idx->nents && stat(unmeta(fn), &sb) == 0 &&
+	sb.st_size == idx->fsize) {
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = HISTIDX_MAGIC;
+	hdr.hdrsize = sizeof hdr;
+	hdr.entsize = sizeof(struct histidxent);
+	hdr.dev = sb.st_dev;
+	hdr.ino = sb.st_ino;
+	hdr.size = sb.st_size;
+	hdr.mtim = sb.st_mtime;
+#ifdef GET_ST_MTIME_NSEC
+	hdr.mtimnsec = GET_ST_MTIME_NSEC(sb);
+#endif
+	for (hdr.ents = idx->datalen; hdr.ents % HISTIDX_ALIGN; hdr.ents++)
+	    putc('\0', idx->out);
+	hdr.nents = idx->nents;
+	fwrite(idx->ents, sizeof(struct histidxent), idx->nents, idx->out);
+	ok = fseek(idx->out, 0, SEEK_SET) == 0 &&
+	    fwrite(&hdr, sizeof hdr, 1, idx->out) == 1 && !ferror(idx->out);
+    } else
+	ok = 0;
+    if (fclose(idx->out) < 0 || !ok ||
+	rename(idx->tmpfile, dyncat(unmeta(fn), ".idx")) < 0)
+	unlink(idx->tmpfile);
+
+    if (idx->ents)
+	zfree(idx->ents, idx->entsalloc * sizeof(struct histidxent));
+    zfree(idx->words, idx->nwords * sizeof(short));
+    zfree(idx, sizeof *idx);
+}
+
+#endif /* USE_MMAP */
+
 /**/
 void
 savehistfile(char *fn, int err, int writeflags)
 {
-    char *t, *tmpfile, *start = NULL;
+    char *tmpfile, *start = NULL, *buf = NULL;
     FILE *out;
     Histent he;
+#ifdef USE_MMAP
+    struct histidxout *idx = NULL;
+#endif
     zlong xcurhist = curhist - !!(histactive & HA_ACTIVE);
     int extended_history = isset(EXTENDEDHISTORY);
-    int ret;
+    int ret, len = 0, bufsiz = 0, atomic = 0;
 
     if (!interact || savehistsiz <= 0 || !hist_ring
      || (!fn && !(fn = getsparam("HISTFILE"))))
@@ -2937,10 +3974,21 @@ savehistfile(char *fn, int err, int writeflags)
 	    lasthist.next_write_ev = he->histnum + 1;
 	    he = down_histent(he);
 	}
-	if (!he || lockhistfile(fn, 0))
+	if (!he)
+	    return;
+	if (histfile_linect > savehistsiz + savehistsiz / 5 &&
+	    !bgtrimhistfile(fn)) {
+	    /* The trimmed file has no more than SAVEHIST lines */
+	    histfile_linect = savehistsiz;
+	}
+	if (histfile_linect > savehistsiz + savehistsiz / 5) {
+	    /* Time to trim the file, which needs it to ourselves */
+	    if (!lockhistfile(fn, 0))
+		writeflags &= ~HFILE_FAST;
+	    else if (!(atomic = histatomicappend()))
+		return;
+	} else if (!(atomic = histatomicappend()) && lockhistfile(fn, 0))
 	    return;
-	if (histfile_linect > savehistsiz + savehistsiz / 5)
-	    writeflags &= ~HFILE_FAST;
     }
     else {
 	if (lockhistfile(fn, 1)) {
@@ -2961,7 +4009,10 @@ savehistfile(char *fn, int err, int writeflags)
 	    extended_history = 1;
     }
     errno = 0;
-    if (writeflags & HFILE_APPEND) {
+    if (atomic) {
+	tmpfile = NULL;
+	out = NULL;
+    } else if (writeflags & HFILE_APPEND) {
 	int fd = open(unmeta(fn), O_CREAT | O_WRONLY | O_APPEND | O_NOCTTY, 0600);
 	tmpfile = NULL;
 	out = fd >= 0 ? fdopen(fd, "a") : NULL;
@@ -3014,7 +4065,7 @@ savehistfile(char *fn, int err, int writeflags)
 #endif
 	}
     }
-    if (out) {
+    if (out || atomic) {
 	char *history_ignore;
 	Patprog histpat = NULL;
 
@@ -3025,11 +4076,13 @@ savehistfile(char *fn, int err, int writeflags)
 	    remnulargs(history_ignore);
 	    histpat = patcompile(history_ignore, 0, NULL);
 	}
+#ifdef USE_MMAP
+	if (out && !(writeflags & HFILE_APPEND))
+	    idx = starthistidx(fn);
+#endif
 
 	ret = 0;
 	for (; he && he->histnum <= xcurhist; he = down_histent(he)) {
-	    int end_backslashes = 0;
-
 	    if ((writeflags & HFILE_SKIPDUPS && he->node.flags & HIST_DUP)
 	     || (writeflags & HFILE_SKIPFOREIGN && he->node.flags & HIST_FOREIGN)
 	     || he->node.flags & HIST_TMPSTORE)
@@ -3046,32 +4099,35 @@ savehistfile(char *fn, int err, int writeflags)
 		    lasthist.next_write_ev = he->histnum + 1;
 	    }
 	    if (writeflags & HFILE_USE_OPTIONS) {
-		lasthist.fpos = ftell(out);
-		lasthist.stim = he->stim;
+		/* When appending atomically these stay where we last read */
+		if (!atomic) {
+		    lasthist.fpos = ftell(out);
+		    lasthist.stim = he->stim;
+		}
 		histfile_linect++;
 	    }
-	    t = start = he->node.nam;
-	    if (extended_history) {
-		ret = fprintf(out, ": %ld:%ld;", (long)he->stim,
-			      he->ftim? (long)(he->ftim - he->stim) : 0L);
-	    } else if (*t == ':')
-		ret = fputc('\\', out);
-
-	    for (; ret >= 0 && *t; t++) {
-		if (*t == '\n')
-		    if ((ret = fputc('\\', out)) < 0)
-			break;
-		end_backslashes = (*t == '\\' || (end_backslashes && *t == ' '));
-		if ((ret = fputc(*t, out)) < 0)
+	    start = he->node.nam;
+	    if (atomic) {
+		/* Collect the lines to write them all at once */
+		len = histfileline(he, extended_history, &buf, &bufsiz, len);
+	    } else {
+		len = histfileline(he, extended_history, &buf, &bufsiz, 0);
+		if (fwrite(buf, 1, len, out) < (size_t)len) {
+		    ret = -1;
 		    break;
+		}
+#ifdef USE_MMAP
+		if (idx)
+		    histidxline(idx, he, extended_history, len);
+#endif
 	    }
-	    if (ret < 0)
-	    	break;
-	    if (end_backslashes)
-		ret = fputc(' ', out);
-	    if (ret < 0 || (ret = fputc('\n', out)) < 0)
-		break;
 	}
+#ifdef HAVE_FCNTL_H
+	if (atomic) {
+	    if (len)
+		ret = appendhistfile(fn, buf, len);
+	} else
+#endif
 	if (ret >= 0 && start && writeflags & HFILE_USE_OPTIONS) {
 	    struct stat sb;
 	    if ((ret = fflush(out)) >= 0) {
@@ -3083,7 +4139,9 @@ savehistfile(char *fn, int err, int writeflags)
 		lasthist.text = ztrdup(start);
 	    }
 	}
-	if (fclose(out) < 0 && ret >= 0)
+	if (buf)
+	    zfree(buf, bufsiz);
+	if (out && fclose(out) < 0 && ret >= 0)
 	    ret = -1;
 	if (ret >= 0) {
 	    if (tmpfile) {
@@ -3102,6 +4160,12 @@ savehistfile(char *fn, int err, int writeflags)
 #endif
 		}
 	    }
+#ifdef USE_MMAP
+	    if (idx) {
+		endhistidx(idx, fn, ret >= 0);
+		idx = NULL;
+	    }
+#endif
 
 	    if (ret >= 0 && writeflags & HFILE_SKIPOLD
 		&& !(writeflags & (HFILE_FAST | HFILE_NO_REWRITE))) {
@@ -3124,6 +4188,10 @@ savehistfile(char *fn, int err, int writeflags)
 		histactive = remember_histactive;
 	    }
 	}
+#ifdef USE_MMAP
+	if (idx)
+	    endhistidx(idx, fn, 0);
+#endif
 
 	popheap();
     } else
@@ -3138,7 +4206,8 @@ savehistfile(char *fn, int err, int writeflags)
     if (tmpfile)
 	free(tmpfile);
 
-    unlockhistfile(fn);
+    if (!atomic)
+	unlockhistfile(fn);
 }
 
 static int lockhistct;
@@ -3146,7 +4215,8 @@ static int lockhistct;
 static int
 checklocktime(char *lockfile, long *sleep_usp, time_t then)
 {
-    time_t now = zmonotime(NULL);
+    /* then is the lock file's modification time, so not monotonic */
+    time_t now = time(NULL);
 
     if (now + 10 < then) {
 	/* File is more than 10 seconds in the future? */
@@ -3164,7 +4234,7 @@ checklocktime(char *lockfile, long *sleep_usp, time_t then)
 	 * Randomise to minimise clashes with shells exiting at the same
 	 * time.
 	 */
-	(void)zsleep_random(*sleep_usp, then + 10);
+	(void)zsleep_random(*sleep_usp, zmonotime(NULL) + (then + 10 - now));
 	*sleep_usp <<= 1;
     } else
 	unlink(lockfile);
@@ -3201,7 +4271,12 @@ lockhistfile(char *fn, int keep_trying)
 #endif
 
 #ifdef HAVE_FCNTL_H
-	if (isset(HISTFCNTLLOCK))
+	/*
+	 * Atomic appenders only look for an fcntl() lock, so with
+	 * HIST_ATOMIC_APPEND that's the one that keeps them out while
+	 * the file is rewritten.
+	 */
+	if (isset(HISTFCNTLLOCK) || histatomicappend())
 	    return flockhistfile(fn, keep_trying);
 #endif
 
@@ -3352,6 +4427,146 @@ histfileIsLocked(void)
     return lockhistct > 0;
 }
 
+/*
+ * Trim the history file to SAVEHIST lines in a child process, so that
+ * the shell can carry on without waiting for it.  The file is read and
+ * the trimmed copy written without the lock while shells go on
+ * appending; the lock is only taken to copy across the lines appended
+ * meanwhile before the copy is renamed into place.  With
+ * HIST_ATOMIC_APPEND that's the fcntl() lock, which is the one atomic
+ * appenders wait for (see lockhistfile()).  Return 0 if the
+ * child was started, else the caller should trim the file itself.
+ */
+
+/**/
+static int
+bgtrimhistfile(char *fn)
+{
+    struct stat sb, nsb;
+    char *tmpfile, *history_ignore, *buf = NULL, copybuf[8192];
+    FILE *out, *in;
+    Patprog histpat = NULL;
+    Histent he;
+#ifdef USE_MMAP
+    struct histidxout *idx;
+#endif
+    off_t done;
+    int fd, len, bufsiz = 0, ok = 0;
+    pid_t pid;
+
+    /*
+     * Leave it to the shell if the file can't simply be replaced,
+     * and to report why.
+     */
+    if (!isset(HISTSAVEBYCOPY) || stat(unmeta(fn), &sb) < 0 ||
+	sb.st_uid != geteuid())
+	return 1;
+
+    queue_signals();		/* see zfork() */
+    pid = fork();
+    unqueue_signals();
+    if (pid)
+	return pid < 0;
+
+    /*
+     * Let go of the terminal and of everything the shell had open, so
+     * that nothing waiting for the shell's output or for the terminal
+     * to be closed waits for us, and keep out of the way of keyboard
+     * signals.
+     */
+    for (fd = 0; fd < 10; fd++)
+	close(fd);
+    closem(FDT_UNUSED, 1);
+    if (open("/dev/null", O_RDWR | O_NOCTTY) == 0) {
+	(void)dup(0);
+	(void)dup(0);
+    }
+#ifdef HAVE_SETSID
+    setsid();
+#elif defined(HAVE_SETPGID)
+    setpgrp(0L, getpid());
+#endif
+    noerrs = 1;
+    /* The shell's lock, if any, stays with the shell */
+#ifdef HAVE_FCNTL_H
+    if (flock_fd >= 0) {
+	close(flock_fd);
+	flock_fd = -1;
+    }
+#endif
+    lockhistct = 0;
+
+    pushhiststack(NULL, savehistsiz, savehistsiz, -1);
+    hist_ignore_all_dups |= isset(HISTSAVENODUPS);
+    done = readhistfile(fn, 0, HFILE_UNLOCKED);
+    if (done <= 0 || errflag || !histlinect ||
+	(fd = gettempfile(fn, 0, &tmpfile)) < 0)
+	_exit(1);
+#ifdef HAVE_FCHMOD
+    if (fchmod(fd, sb.st_mode) < 0) {} /* IGNORE FAILURE */
+#endif
+    if (!(out = fdopen(fd, "w"))) {
+	unlink(tmpfile);
+	_exit(1);
+    }
+
+    if ((history_ignore = getsparam("HISTORY_IGNORE")) != NULL) {
+	tokenize(history_ignore = dupstring(history_ignore));
+	remnulargs(history_ignore);
+	histpat = patcompile(history_ignore, 0, NULL);
+    }
+#ifdef USE_MMAP
+    idx = starthistidx(fn);
+#endif
+    for (he = hist_ring->down; he; he = down_histent(he)) {
+	if (histpat &&
+	    pattry(histpat, metafy(he->node.nam, -1, META_HEAPDUP)))
+	    continue;
+	len = histfileline(he, isset(EXTENDEDHISTORY), &buf, &bufsiz, 0);
+	if (fwrite(buf, 1, len, out) < (size_t)len)
+	    break;
+#ifdef USE_MMAP
+	if (idx)
+	    histidxline(idx, he, isset(EXTENDEDHISTORY), len);
+#endif
+    }
+
+    if (!he && !lockhistfile(fn, 1)) {
+	/*
+	 * Unless the file was replaced meanwhile, add what was
+	 * appended since we read it and put the copy in its place.
+	 */
+	if (stat(unmeta(fn), &nsb) == 0 && nsb.st_dev == sb.st_dev &&
+	    nsb.st_ino == sb.st_ino && nsb.st_size >= done &&
+	    (in = fopen(unmeta(fn), "r"))) {
+	    if (fseek(in, done, SEEK_SET) == 0) {
+		while ((len = fread(copybuf, 1, sizeof copybuf, in)) > 0 &&
+		       fwrite(copybuf, 1, len, out) == (size_t)len)
+		    ;
+		ok = !ferror(in) && !ferror(out);
+	    }
+	    fclose(in);
+	}
+	if (fclose(out) < 0 || !ok || rename(tmpfile, unmeta(fn)) < 0)
+	    ok = 0;
+#ifdef USE_MMAP
+	/* No index if lines were copied, as it wouldn't cover them */
+	if (idx) {
+	    endhistidx(idx, fn, ok);
+	    idx = NULL;
+	}
+#endif
+	unlockhistfile(fn);
+    }
+#ifdef USE_MMAP
+    if (idx)
+	endhistidx(idx, fn, 0);
+#endif
+    if (!ok)
+	unlink(tmpfile);
+    _exit(!ok);
+}
+
 /*
  * Get the words in the current buffer. Using the lexer. 
  *
@@ -3859,6 +5074,9 @@ pushhiststack(char *hf, zlong hs, zlong shs, int level)
     h = &histsave_stack[histsave_stack_pos++];
 
     h->lasthist = lasthist;
+    h->histarena = histarena;
+    memset(&histarena, 0, sizeof histarena);
+    freehistindex();
     if (hf) {
 	if ((h->histfile = getsparam("HISTFILE")) != NULL && *h->histfile)
 	    h->histfile = ztrdup(h->histfile);
@@ -3910,11 +5128,14 @@ pophiststack(void)
 	unlinkcurline();
 
     deletehashtable(histtab);
+    freehistarena();
+    freehistindex();
     zsfree(lasthist.text);
 
     h = &histsave_stack[--histsave_stack_pos];
 
     lasthist = h->lasthist;
+    histarena = h->histarena;
     if (h->histfile) {
 	if (*h->histfile)
 	    setsparam("HISTFILE", h->histfile);
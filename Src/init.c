@@ -723,11 +723,18 @@ init_io(char *cmd)
     }
 }
 
+/*
+ * Size of the buffer for output to the terminal.  ZLE flushes this
+ * once per refresh, so make it big enough for a full screen with
+ * colours to go out in a single write.
+ */
+#define SHOUTBUFSIZ 65536
+
 /**/
 mod_export void
 init_shout(void)
 {
-    static char shoutbuf[BUFSIZ];
+    static char shoutbuf[SHOUTBUFSIZ];
 #if defined(TIOCSETD) && defined(NTTYDISC)
     int ldisc;
 #endif
@@ -748,7 +755,7 @@ init_shout(void)
     shout = fdopen(SHTTY, "w");
 #ifdef _IOFBF
     if (shout)
-	setvbuf(shout, shoutbuf, _IOFBF, BUFSIZ);
+	setvbuf(shout, shoutbuf, _IOFBF, SHOUTBUFSIZ);
 #endif
   
     gettyinfo(&shttyinfo);	/* get tty state */
@@ -764,7 +771,8 @@ static char *tccapnams[TC_COUNT] = {
     "cl", "le", "LE", "nd", "RI", "up", "UP", "do",
     "DO", "dc", "DC", "ic", "IC", "cd", "ce", "al", "dl", "ta",
     "md", "mh", "so", "us", "ZH", "me", "se", "ue", "ZR", "ch",
-    "ku", "kd", "kl", "kr", "sc", "rc", "bc", "AF", "AB", "vi", "ve"
+    "ku", "kd", "kl", "kr", "sc", "rc", "bc", "AF", "AB", "vi", "ve",
+    "AL", "DL"
 };
 
 /**/
@@ -1896,10 +1896,11 @@ gotword(void)
     }
 }
 
-/* Check if current lex text matches an alias: 1 if so, else 0 */
+/* Check if current lex text matches an alias: 1 if so, else 0. *
+ * hashval is the value of hasher() for the text.               */
 
 static int
-checkalias(void)
+checkalias(unsigned hashval)
 {
     Alias an;
 
@@ -1908,10 +1909,11 @@ checkalias(void)
 
     if (!noaliases && isset(ALIASESOPT) &&
 	(!isset(POSIXALIASES) ||
-	 (tok == STRING && !reswdtab->getnode(reswdtab, zshlextext)))) {
+	 (tok == STRING &&
+	  !gethashnodehashed(reswdtab, zshlextext, hashval)))) {
 	char *suf;
 
-	an = (Alias) aliastab->getnode(aliastab, zshlextext);
+	an = (Alias) gethashnodehashed(aliastab, zshlextext, hashval);
 	if (an && !an->inuse &&
 	    ((an->node.flags & ALIAS_GLOBAL) ||
 	     (incmdpos && tok == STRING) || inalmore)) {
@@ -1966,9 +1968,11 @@ exalias(void)
 
 	if (tok == NEWLIN)
 	    return 0;
-	return checkalias();
+	return checkalias(zshlextext ? hasher(zshlextext) : 0);
     } else {
-	VARARR(char, copy, (strlen(tokstr) + 1));
+	size_t len = strlen(tokstr);
+	unsigned hashval;
+	VARARR(char, copy, (len + 1));
 
 	if (has_token(tokstr)) {
 	    char *p, *t;
@@ -1991,8 +1995,15 @@ exalias(void)
 	}
 
 	if (tok == STRING) {
+	    /*
+	     * Untokenizing doesn't change the length, so the text only
+	     * needs hashing once for all the tables it's looked up in.
+	     */
+	    hashval = hasherlen(zshlextext, len);
+
 	    /* Check for an alias */
-	    if ((zshlextext != copy || !isset(POSIXALIASES)) && checkalias()) {
+	    if ((zshlextext != copy || !isset(POSIXALIASES)) &&
+		checkalias(hashval)) {
 		if (zshlextext == copy)
 		    zshlextext = tokstr;
 		return 1;
@@ -2002,7 +2013,8 @@ exalias(void)
 	    if ((incmdpos ||
 		 (unset(IGNOREBRACES) && unset(IGNORECLOSEBRACES) &&
 		  zshlextext[0] == '}' && !zshlextext[1])) &&
-		(rw = (Reswd) reswdtab->getnode(reswdtab, zshlextext))) {
+		(rw = (Reswd) gethashnodehashed(reswdtab, zshlextext,
+						hashval))) {
 		tok = rw->token;
 		inrepeat_ = (tok == REPEAT);
 		if (tok == DINBRACK)
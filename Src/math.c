@@ -321,6 +321,79 @@ struct mathvalue {
 
 static struct mathvalue *stack;
 
+/*
+ * Compiled arithmetic expressions.
+ *
+ * mathparse() evaluates as it parses, so normally every evaluation of
+ * an expression lexes and parses the text again.  To avoid that for
+ * expressions that are evaluated repeatedly, such as those in an
+ * arithmetic for loop, the second time a piece of text is evaluated
+ * the actions taken by mathparse() are recorded as a postfix program,
+ * which is kept in a small cache keyed on the text and the options
+ * that affect parsing.  Later evaluations of the same text run the
+ * program with runmathprog() instead of parsing.
+ *
+ * The whole expression is always parsed, including the parts that
+ * aren't evaluated because of short-circuiting (noeval), so a single
+ * recording covers every path through the expression; the program
+ * adjusts noeval in the same places mathparse() does.
+ *
+ * Anything that depends on the state of the shell rather than on the
+ * text is still looked up when the program runs: parameters are kept
+ * by name (a Param can be replaced by a local or unset at any time),
+ * as are math functions, and $$, $? and $# are fetched afresh.
+ * Expressions whose lexing has other side effects aren't cached.
+ */
+
+enum {
+    MI_NUM,			/* push a constant */
+    MI_PID,			/* push $$ */
+    MI_LASTVAL,			/* push $? */
+    MI_POUND,			/* push $# */
+    MI_ID,			/* push a parameter reference */
+    MI_CID,			/* push the character code of a parameter */
+    MI_FUNC,			/* push the result of a math function */
+    MI_BASE,			/* set lastbase */
+    MI_RADIX,			/* set outputradix and/or outputunderscore */
+    MI_OP,			/* apply an operator */
+    MI_BOP,			/* left operand of a short-circuit operator */
+    MI_BOOLOP,			/* apply a short-circuit operator */
+    MI_QTEST,			/* test the condition of ?: */
+    MI_QCOLON,			/* between the branches of ?: */
+    MI_QEND			/* apply ?: */
+};
+
+struct mathinstr {
+    int code;
+    int arg;			/* token, lastbase, or MI_RADIX flags */
+    char *str;			/* for MI_ID, MI_CID, MI_FUNC */
+    mnumber val;		/* for MI_NUM, MI_RADIX */
+};
+
+struct mathprog {
+    struct mathinstr *code;
+    int len, alloc;
+    int endoff;			/* offset of end of parsed text */
+    int endtok;			/* the final value of mtok */
+    int refs;			/* the cache plus runs in progress */
+};
+
+/* Program being recorded by mathparse(), if any */
+
+static Mathprog mrec;
+
+/* Set when the expression being recorded can't be cached */
+
+static int mrecbad;
+
+/* Set by zzlex() when the token is a value looked up in the shell */
+
+static int yyspecial;
+
+/* Set by zzlex() when an output format was specified: 1 radix, 2 _ */
+
+static int yyradix;
+
 enum prec_type {
     /* Evaluating a top-level expression */
     MPREC_TOP,
@@ -370,8 +443,9 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
     char *xptr;
     mnumber xyyval;
     char *xyylval;
-    int xsp;
+    int xsp, xmrecbad, record;
     struct mathvalue *xstack = 0, nstack[STACKSZ];
+    Mathprog xmrec, prog;
     mnumber ret;
 
     if (mlevel >= MAX_MLEVEL) {
@@ -402,6 +476,8 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
 	xptr = NULL;
 	xprec = NULL;
     }
+    xmrec = mrec;
+    xmrecbad = mrecbad;
     prec = isset(CPRECEDENCES) ? c_prec : z_prec;
     stack = nstack;
     lastbase = -1;
@@ -410,7 +486,23 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
     unary = 1;
     stack[0].val.type = MN_INTEGER;
     stack[0].val.u.l = 0;
-    mathparse(prec_tp == MPREC_TOP ? TOPPREC : ARGPREC);
+    mrec = NULL;
+    mrecbad = 0;
+    if ((prog = getmathcache(s, prec_tp, &record))) {
+	/*
+	 * A nested evaluation may replace the program in the cache
+	 * while it's running, so hold a reference to it.
+	 */
+	prog->refs++;
+	runmathprog(prog);
+	ptr = s + prog->endoff;
+	mtok = prog->endtok;
+	unrefmathprog(prog);
+    } else {
+	if (record)
+	    mrec = (Mathprog) zshcalloc(sizeof(struct mathprog));
+	mathparse(prec_tp == MPREC_TOP ? TOPPREC : ARGPREC);
+    }
     /*
      * Internally, we parse the contents of parentheses at top
      * precedence... so we can return a parenthesis here if
@@ -418,6 +510,13 @@ mathevall(char *s, enum prec_type prec_tp, char **ep)
      */
     if (mtok == M_OUTPAR && !errflag)
 	zerr("bad math expression: unexpected ')'");
+    if (mrec) {
+	mrec->endoff = ptr - s;
+	mrec->endtok = mtok;
+	putmathcache(s, prec_tp, mrec, !errflag && !mrecbad);
+    }
+    mrec = xmrec;
+    mrecbad = xmrecbad;
     *ep = ptr;
     DPUTS(!errflag && sp > 0,
 	  "BUG: math: wallabies roaming too freely in outback");
@@ -539,6 +638,8 @@ lexconstant(void)
 	for (ptr2 = ptr; ptr2 < nptr; ptr2++) {
 	    if (*ptr2 == '_') {
 		int len = nptr - ptr;
+		/* we no longer know where we are in the original text */
+		mrecbad = 1;
 		ptr = dupstring(ptr);
 		for (ptr2 = ptr; len; len--) {
 		    if (*ptr2 == '_')
@@ -619,6 +720,7 @@ zzlex(void)
     int cct = 0;
     char *ie;
     yyval.type = MN_INTEGER;
+    yyspecial = yyradix = 0;
 
     for (;; cct = 0)
 	switch (*ptr++) {
@@ -768,10 +870,12 @@ zzlex(void)
 	    return EQ;
 	case '$':
 	    yyval.u.l = mypid;
+	    yyspecial = MI_PID;
 	    return NUM;
 	case '?':
 	    if (unary) {
 		yyval.u.l = lastval;
+		yyspecial = MI_LASTVAL;
 		return NUM;
 	    }
 	    return QUEST;
@@ -806,6 +910,7 @@ zzlex(void)
 		    if (idigit(*ptr)) {
 			outputradix = n * zstrtol(ptr, &ptr, 10);
 			checkradix = 1;
+			yyradix |= 1;
 		    }
 		    if (*ptr == '_') {
 			ptr++;
@@ -813,6 +918,7 @@ zzlex(void)
 			    outputunderscore = zstrtol(ptr, &ptr, 10);
 			else
 			    outputunderscore = 3;
+			yyradix |= 2;
 		    }
 		} else {
 		    bofs:
@@ -858,6 +964,8 @@ zzlex(void)
 			ptr = optr;
 			return EOI;
 		    }
+		    /* depends on the locale */
+		    mrecbad = 1;
 		    yyval.u.l = v;
 		    return NUM;
 		}
@@ -905,6 +1013,7 @@ zzlex(void)
 	    }
 	    else if (cct) {
 		yyval.u.l = poundgetfn(NULL);
+		yyspecial = MI_POUND;
 		return NUM;
 	    }
 	    return EOI;
@@ -1608,7 +1717,7 @@ mathparse(int pc)
     if (errflag)
 	return;
     queue_signals();
-    mtok = zzlex();
+    mtok = mathlex();
     /* Handle empty input */
     if (pc == TOPPREC && mtok == EOI) {
 	unqueue_signals();
@@ -1622,15 +1731,23 @@ mathparse(int pc)
 	}
 	switch (mtok) {
 	case NUM:
+	    if (mrec)
+		mathemit(yyspecial ? yyspecial : MI_NUM, 0, NULL, &yyval);
 	    push(yyval, NULL, 0);
 	    break;
 	case ID:
+	    if (mrec)
+		mathemit(MI_ID, 0, yylval, NULL);
 	    push(zero_mnumber, yylval, !noeval);
 	    break;
 	case CID:
+	    if (mrec)
+		mathemit(MI_CID, 0, yylval, NULL);
 	    push((noeval ? zero_mnumber : getcvar(yylval)), yylval, 0);
 	    break;
 	case FUNC:
+	    if (mrec)
+		mathemit(MI_FUNC, 0, yylval, NULL);
 	    push((noeval ? zero_mnumber : callmathfunc(yylval)), yylval, 0);
 	    break;
 	case M_INPAR:
@@ -1643,6 +1760,8 @@ mathparse(int pc)
 	    }
 	    break;
 	case QUEST:
+	    if (mrec)
+		mathemit(MI_QTEST, 0, NULL, NULL);
 	    if (stack[sp].val.type == MN_UNSET)
 		stack[sp].val = getmathparam(stack + sp);
 	    q = (stack[sp].val.type == MN_FLOAT) ?
@@ -1660,26 +1779,297 @@ mathparse(int pc)
 		unqueue_signals();
 		return;
 	    }
+	    if (mrec)
+		mathemit(MI_QCOLON, 0, NULL, NULL);
 	    if (q)
 		noeval++;
 	    mathparse(prec[QUEST]);
 	    if (q)
 		noeval--;
+	    if (mrec)
+		mathemit(MI_QEND, 0, NULL, NULL);
 	    op(QUEST);
 	    continue;
 	default:
 	    otok = mtok;
 	    onoeval = noeval;
-	    if (MTYPE(type[otok]) == BOOL)
+	    if (MTYPE(type[otok]) == BOOL) {
+		if (mrec)
+		    mathemit(MI_BOP, otok, NULL, NULL);
 		bop(otok);
+	    }
 	    mathparse(prec[otok] - (MTYPE(type[otok]) != RL));
 	    noeval = onoeval;
+	    if (mrec)
+		mathemit(MTYPE(type[otok]) == BOOL ? MI_BOOLOP : MI_OP,
+			 otok, NULL, NULL);
 	    op(otok);
 	    continue;
 	}
 	optr = ptr;
-	mtok = zzlex();
+	mtok = mathlex();
 	checkunary(mtok, optr);
     }
     unqueue_signals();
 }
+
+/*
+ * Get the next token, recording any side effects of lexing it
+ * that need to be reproduced when a compiled expression is run.
+ */
+
+/**/
+static int
+mathlex(void)
+{
+    int obase = lastbase, tok = zzlex();
+
+    if (mrec) {
+	if (yyradix) {
+	    mnumber radix;
+	    radix.type = MN_INTEGER;
+	    radix.u.l = outputradix;
+	    mathemit(MI_RADIX, yyradix | (outputunderscore << 2), NULL,
+		     &radix);
+	}
+	if (lastbase != obase)
+	    mathemit(MI_BASE, lastbase, NULL, NULL);
+    }
+    return tok;
+}
+
+/* Add an instruction to the expression being recorded */
+
+/**/
+static void
+mathemit(int code, int arg, char *str, mnumber *val)
+{
+    struct mathinstr *mi;
+
+    if (mrec->len == mrec->alloc) {
+	int nalloc = mrec->alloc ? 2 * mrec->alloc : 16;
+	mrec->code = (struct mathinstr *)
+	    zrealloc(mrec->code, nalloc * sizeof(struct mathinstr));
+	mrec->alloc = nalloc;
+    }
+    mi = mrec->code + mrec->len++;
+    mi->code = code;
+    mi->arg = arg;
+    mi->str = str ? ztrdup(str) : NULL;
+    if (val)
+	mi->val = *val;
+    else
+	mi->val = zero_mnumber;
+}
+
+/**/
+static void
+freemathprog(Mathprog prog)
+{
+    int i;
+
+    for (i = 0; i < prog->len; i++)
+	zsfree(prog->code[i].str);
+    if (prog->code)
+	zfree(prog->code, prog->alloc * sizeof(struct mathinstr));
+    zfree(prog, sizeof(struct mathprog));
+}
+
+/* Release a reference to a program, freeing it if it was the last */
+
+/**/
+static void
+unrefmathprog(Mathprog prog)
+{
+    if (!--prog->refs)
+	freemathprog(prog);
+}
+
+/*
+ * Run a compiled expression.  This does exactly what mathparse() did
+ * when the program was recorded, apart from the lexing.
+ */
+
+/**/
+static void
+runmathprog(Mathprog prog)
+{
+    struct mathinstr *mi = prog->code, *end = mi + prog->len;
+    int aux[STACKSZ], asp = -1, onoeval = noeval;
+    mnumber val;
+
+    queue_signals();
+    for (; mi < end && !errflag; mi++) {
+	switch (mi->code) {
+	case MI_NUM:
+	    push(mi->val, NULL, 0);
+	    break;
+	case MI_PID:
+	case MI_LASTVAL:
+	case MI_POUND:
+	    val.type = MN_INTEGER;
+	    val.u.l = (mi->code == MI_PID ? (zlong)mypid :
+		       mi->code == MI_LASTVAL ? (zlong)lastval :
+		       poundgetfn(NULL));
+	    push(val, NULL, 0);
+	    break;
+	case MI_ID:
+	    /* the name may be modified when it's used */
+	    push(zero_mnumber, dupstring(mi->str), !noeval);
+	    break;
+	case MI_CID:
+	    push((noeval ? zero_mnumber : getcvar(mi->str)),
+		 dupstring(mi->str), 0);
+	    break;
+	case MI_FUNC:
+	    push((noeval ? zero_mnumber : callmathfunc(mi->str)),
+		 dupstring(mi->str), 0);
+	    break;
+	case MI_BASE:
+	    lastbase = mi->arg;
+	    break;
+	case MI_RADIX:
+	    if (mi->arg & 1)
+		outputradix = mi->val.u.l;
+	    if (mi->arg & 2)
+		outputunderscore = mi->arg >> 2;
+	    break;
+	case MI_OP:
+	    op(mi->arg);
+	    break;
+	case MI_BOP:
+	    if (asp == STACKSZ - 1) {
+		zerr("stack overflow");
+		break;
+	    }
+	    aux[++asp] = noeval;
+	    bop(mi->arg);
+	    break;
+	case MI_BOOLOP:
+	    noeval = aux[asp--];
+	    op(mi->arg);
+	    break;
+	case MI_QTEST:
+	    if (asp == STACKSZ - 1) {
+		zerr("stack overflow");
+		break;
+	    }
+	    if (stack[sp].val.type == MN_UNSET)
+		stack[sp].val = getmathparam(stack + sp);
+	    aux[++asp] = (stack[sp].val.type == MN_FLOAT) ?
+		(stack[sp].val.u.d != 0) : (stack[sp].val.u.l != 0);
+	    if (!aux[asp])
+		noeval++;
+	    break;
+	case MI_QCOLON:
+	    if (aux[asp])
+		noeval++;
+	    else
+		noeval--;
+	    break;
+	case MI_QEND:
+	    if (aux[asp--])
+		noeval--;
+	    op(QUEST);
+	    break;
+	}
+    }
+    noeval = onoeval;
+    unqueue_signals();
+}
+
+/*
+ * The cache of compiled expressions.  This is direct mapped on the
+ * hash of the text.  A slot remembers the hash of the last text that
+ * wasn't found, so that an expression is only compiled the second
+ * time it's seen; text that is generated afresh each time, such as
+ * the result of substituting parameters, then doesn't evict anything.
+ */
+
+#define MATHCACHE_SIZE 256
+
+struct mathcache {
+    char *text;			/* the text of the expression */
+    int key;			/* prec_type and options, from mathcachekey() */
+    unsigned hashval;		/* hash of text */
+    unsigned seen;		/* hash of the last text not found */
+    Mathprog prog;
+};
+
+static struct mathcache *mathcache;
+
+/* Return the options etc. affecting how an expression is parsed */
+
+/**/
+static int
+mathcachekey(int prec_tp)
+{
+    return prec_tp | (isset(CPRECEDENCES) << 1) |
+	(isset(OCTALZEROES) << 2) | (isset(FORCEFLOAT) << 3) |
+	(isset(POSIXIDENTIFIERS) << 4) | (isset(MULTIBYTE) << 5) |
+	(EMULATION(EMULATE_SH) ? 1 << 6 : 0);
+}
+
+/*
+ * Look up the compiled form of an expression.  If it's not found,
+ * *record is set if the expression should be recorded this time.
+ */
+
+/**/
+static Mathprog
+getmathcache(char *s, int prec_tp, int *record)
+{
+    unsigned hashval;
+    struct mathcache *mc;
+
+    *record = 0;
+    /* see the note in putmathcache() */
+    if (noerrs)
+	return NULL;
+    if (!mathcache)
+	mathcache = (struct mathcache *)
+	    zshcalloc(MATHCACHE_SIZE * sizeof(struct mathcache));
+    hashval = hasher(s);
+    mc = mathcache + hashval % MATHCACHE_SIZE;
+    if (mc->prog && mc->hashval == hashval &&
+	mc->key == mathcachekey(prec_tp) && !strcmp(mc->text, s))
+	return mc->prog;
+    if (mc->seen == hashval)
+	*record = 1;
+    else
+	mc->seen = hashval;
+    return NULL;
+}
+
+/*
+ * Store a recorded expression in the cache if ok is set, else discard
+ * it.  It's not stored if there was an error, since mathparse() stops
+ * at the first error and the program is incomplete.  That's also why
+ * nothing is recorded when errors are suppressed entirely by noerrs,
+ * as they might then not be noticed.
+ */
+
+/**/
+static void
+putmathcache(char *s, int prec_tp, Mathprog prog, int ok)
+{
+    struct mathcache *mc;
+    unsigned hashval;
+
+    if (!ok) {
+	freemathprog(prog);
+	return;
+    }
+    hashval = hasher(s);
+    mc = mathcache + hashval % MATHCACHE_SIZE;
+    if (mc->prog) {
+	unrefmathprog(mc->prog);
+	zsfree(mc->text);
+    }
+    mc->text = ztrdup(s);
+    mc->key = mathcachekey(prec_tp);
+    mc->hashval = hashval;
+    mc->seen = 0;
+    mc->prog = prog;
+    prog->refs = 1;
+}
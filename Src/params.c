@@ -537,11 +537,17 @@ mod_export HashTable paramtab, realparamtab;
 mod_export HashTable
 newparamtable(int size, char const *name)
 {
-    HashTable ht;
     if (!size)
 	size = 17;
-    ht = newhashtable(size, name, NULL);
+    return initparamtable(newhashtable(size, name, NULL));
+}
+
+/* Set up the methods for a parameter table */
 
+/**/
+static HashTable
+initparamtable(HashTable ht)
+{
     ht->hash        = hasher;
     ht->emptytable  = emptyhashtable;
     ht->filltable   = NULL;
@@ -851,7 +857,8 @@ createparamtable(void)
     char *machinebuf;
 #endif
 
-    paramtab = realparamtab = newparamtable(151, "paramtab");
+    paramtab = realparamtab =
+	initparamtable(newopenhashtable(151, "paramtab", NULL));
 
     /* Add the special parameters to the hash table */
     for (ip = special_params; ip->node.nam; ip++)
@@ -2711,10 +2718,21 @@ assignstrvalue(Value v, char *val, int flags)
 		!v->pm->width)
 		v->pm->width = strlen(val);
 	} else {
-	    char *const old = v->pm->gsu.s->getfn(v->pm);
-	    char *new;
-	    const int oldlen = strlen(old), vallen = strlen(val);
-	    int newlen;
+	    /* As in setarrvalue(), so that appending is cheap */
+	    Param pm = v->pm;
+	    char *old, *new;
+	    const int vallen = strlen(val);
+	    int oldlen, newlen, size;
+
+	    if (pm->valsize && pm->gsu.s->getfn == strgetfn) {
+		old = pm->u.str;
+		oldlen = pm->vallen;
+		size = pm->valsize;
+	    } else {
+		old = pm->gsu.s->getfn(pm);
+		oldlen = strlen(old);
+		size = oldlen + 1;
+	    }
 
 	    if ((v->valflags & VALFLAG_INV) && unset(KSHARRAYS))
 		v->start--, v->end--;
@@ -2751,27 +2769,37 @@ assignstrvalue(Value v, char *val, int flags)
 	    /* Chars before slice + chars from val + chars after slice */
 	    newlen = v->start + vallen + (oldlen - v->end);
 
-	    if (v->pm->gsu.s->setfn == strsetfn && old == v->pm->u.str) {
-		v->pm->u.str = NULL; /* Steal the old string */
+	    if (pm->gsu.s->setfn == strsetfn && old == pm->u.str) {
+		pm->u.str = NULL; /* Steal the old string */
 		/* If the string shrinks, move left chars after the slice */
 		if (newlen < oldlen && v->end < oldlen)
 		    memmove(old + v->start + vallen, old + v->end,
 			    oldlen - v->end);
-		/* If the string shrinks or expands, reallocate it */
-		new = oldlen == newlen ? old : (char *) zrealloc(old, newlen + 1);
+		/* Reallocate the string if it doesn't fit or has shrunk */
+		if (newlen >= size || newlen < size / 2) {
+		    size = newlen + 1 + (newlen >= size ? newlen / 2 : 0);
+		    new = (char *) zrealloc(old, size);
+		} else
+		    new = old;
 		/* If the string expands, move right chars after the slice */
 		if (newlen > oldlen && v->end < oldlen)
 		    memmove(new + v->start + vallen, new + v->end,
 			    oldlen - v->end);
 	    } else {
-		new = (char *) zalloc(newlen + 1);
+		size = newlen + 1;
+		new = (char *) zalloc(size);
 		strncpy(new, old, v->start);
 		strncpy(new + v->start + vallen, old + v->end, oldlen - v->end);
 	    }
 	    strncpy(new + v->start, val, vallen);
 	    zsfree(val);
 	    new[newlen] = '\0';
-	    v->pm->gsu.s->setfn(v->pm, new);
+	    pm->gsu.s->setfn(pm, new);
+	    if (pm->gsu.s->getfn == strgetfn && pm->gsu.s->setfn == strsetfn &&
+		pm->u.str == new) {
+		pm->vallen = newlen;
+		pm->valsize = size;
+	    }
 	}
 	break;
     case PM_INTEGER:
@@ -2917,10 +2945,29 @@ setarrvalue(Value v, char **val)
 	     v->pm->node.nam);
 	return;
     } else {
-	char **const old = v->pm->gsu.a->getfn(v->pm);
-	char **new, **p, **q;
-	const int oldlen = arrlen(old), vallen = arrlen(val);
-	int newlen, i;
+	/*
+	 * For a plain array the length and allocated size of the
+	 * value are remembered when it's set here, so that appending
+	 * to it repeatedly doesn't need to count the elements each
+	 * time, and the array can grow geometrically.  Anything else
+	 * that gets at the array can change it, so arrgetfn() and
+	 * arrsetfn() forget them; tied arrays are also changed through
+	 * the scalar, so aren't handled.
+	 */
+	Param pm = v->pm;
+	char **old, **new, **p, **q;
+	const int vallen = arrlen(val);
+	int oldlen, newlen, size, i;
+
+	if (pm->valsize && pm->gsu.a->getfn == arrgetfn) {
+	    old = pm->u.arr;
+	    oldlen = pm->vallen;
+	    size = pm->valsize;
+	} else {
+	    old = pm->gsu.a->getfn(pm);
+	    oldlen = arrlen(old);
+	    size = oldlen + 1;
+	}
 
 	if ((v->valflags & VALFLAG_INV) && unset(KSHARRAYS)) {
 	    if (v->start > 0)
@@ -2945,8 +2992,8 @@ setarrvalue(Value v, char **val)
 	/* Strings before slice + strings from val + strings after slice */
 	newlen = v->start + vallen + MAX(0, oldlen - v->end);
 
-	if (v->pm->gsu.a->setfn == arrsetfn && old == v->pm->u.arr) {
-	    v->pm->u.arr = NULL; /* Steal the old array */
+	if (pm->gsu.a->setfn == arrsetfn && old == pm->u.arr) {
+	    pm->u.arr = NULL; /* Steal the old array */
 	    /* Free strings that are part of the slice */
 	    for (q = old + v->start, i = v->end - v->start; i > 0; i--)
 		zsfree(*q++);
@@ -2954,15 +3001,22 @@ setarrvalue(Value v, char **val)
 	    if (newlen < oldlen && v->end < oldlen)
 		memmove(old + v->start + vallen, old + v->end,
 			sizeof(char *) * (oldlen - v->end));
-	    /* If the array shrinks or expands, reallocate it */
-	    new = oldlen == newlen ? old :
-		(char **) zrealloc(old, sizeof(char *) * (newlen + 1));
+	    /*
+	     * Reallocate the array if it no longer fits, leaving room
+	     * to grow, or if it has shrunk to less than half the size.
+	     */
+	    if (newlen >= size || newlen < size / 2) {
+		size = newlen + 1 + (newlen >= size ? newlen / 2 : 0);
+		new = (char **) zrealloc(old, sizeof(char *) * size);
+	    } else
+		new = old;
 	    /* If the array expands, move right strings after the slice */
 	    if (newlen > oldlen && v->end < oldlen)
 		memmove(new + v->start + vallen, new + v->end,
 			sizeof(char *) * (oldlen - v->end));
 	} else {
-	    new = (char **) zalloc(sizeof(char *) * (newlen + 1));
+	    size = newlen + 1;
+	    new = (char **) zalloc(sizeof(char *) * size);
 	    for (p = new, q = old, i = MIN(v->start, oldlen); i > 0; i--)
 		*p++ = ztrdup(*q++);
 	    if (v->end < oldlen)
@@ -2976,7 +3030,12 @@ setarrvalue(Value v, char **val)
 	for (p = new + oldlen, i = v->start - oldlen; i > 0; i--)
 	    *p++ = ztrdup("");
 	new[newlen] = NULL;
-	v->pm->gsu.a->setfn(v->pm, new);
+	pm->gsu.a->setfn(pm, new);
+	if (pm->gsu.a->getfn == arrgetfn && pm->gsu.a->setfn == arrsetfn &&
+	    pm->u.arr == new && !(pm->node.flags & (PM_UNIQUE|PM_TIED))) {
+	    pm->vallen = newlen;
+	    pm->valsize = size;
+	}
     }
 }
 
@@ -3511,7 +3570,10 @@ assignaparam(char *s, char **val, int flags)
     if (flags & ASSPM_AUGMENT) {
     	if (v->start == 0 && v->end == -1) {
 	    if (PM_TYPE(v->pm->node.flags) & PM_ARRAY) {
-	    	v->start = arrlen(v->pm->gsu.a->getfn(v->pm));
+		if (v->pm->valsize && v->pm->gsu.a->getfn == arrgetfn)
+		    v->start = v->pm->vallen;
+		else
+		    v->start = arrlen(v->pm->gsu.a->getfn(v->pm));
 	    	v->end = v->start + 1;
 	    } else if (PM_TYPE(v->pm->node.flags) & PM_HASHED)
 	    	v->start = -1, v->end = 0;
@@ -3981,6 +4043,8 @@ floatsetfn(Param pm, double x)
 mod_export char *
 strgetfn(Param pm)
 {
+    /* the caller may change the string: see assignstrvalue() */
+    pm->valsize = 0;
     return pm->u.str ? pm->u.str : (char *) hcalloc(1);
 }
 
@@ -3990,6 +4054,7 @@ strgetfn(Param pm)
 mod_export void
 strsetfn(Param pm, char *x)
 {
+    pm->valsize = 0;
     if (pm->u.str != x) {
 	if (pm->u.str) zsfree(pm->u.str);
 	pm->u.str = x;
@@ -4010,6 +4075,8 @@ static char *nullarray = NULL;
 mod_export char **
 arrgetfn(Param pm)
 {
+    /* the caller may change the array: see setarrvalue() */
+    pm->valsize = 0;
     return pm->u.arr ? pm->u.arr : &nullarray;
 }
 
@@ -4019,6 +4086,7 @@ arrgetfn(Param pm)
 mod_export void
 arrsetfn(Param pm, char **x)
 {
+    pm->valsize = 0;
     if (pm->u.arr != x) {
 	if (pm->u.arr) freearray(pm->u.arr);
 	pm->u.arr = x;
@@ -4786,6 +4854,8 @@ clear_mbstate(void) {
     mb_charinit();	/* utils.c */
     clear_shiftstate();	/* pattern.c */
 #endif
+    clearpatcache();	/* pattern.c */
+    clearparsecache();	/* exec.c */
 }
 
 /**/
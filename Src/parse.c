@@ -425,11 +425,11 @@ ecdel(int p)
 static wordcode
 ecstrcode(char *s)
 {
-    int l, t;
+    int l = strlen(s) + 1, t;
 
-    unsigned val = hasher(s);
+    unsigned val = hasherlen(s, l - 1);
 
-    if ((l = strlen(s) + 1) && l <= 4) {
+    if (l <= 4) {
 	/* Short string. */
 	t = has_token(s);
 	wordcode c = (t ? 3 : 2);
@@ -3669,10 +3669,11 @@ zwcstat(char *filename, struct stat *buf)
     } else return 0;
 }
 
-/* Load a dump file (i.e. map it). */
+/* Load a dump file (i.e. map it).  The descriptor is kept open for
+ * zwcstat() unless `keepfd' is zero. */
 
 static void
-load_dump_file(char *dump, struct stat *sbuf, int other, int len)
+load_dump_file(char *dump, struct stat *sbuf, int other, int len, int keepfd)
 {
     FuncDump d;
     Wordcode addr;
@@ -3713,6 +3714,10 @@ load_dump_file(char *dump, struct stat *sbuf, int other, int len)
 	close(fd);
 	return;
     }
+    if (!keepfd) {
+	zclose(fd);
+	fd = -1;
+    }
     d = (FuncDump) zalloc(sizeof(*d));
     d->next = dumps;
     dumps = d;
@@ -3720,7 +3725,8 @@ load_dump_file(char *dump, struct stat *sbuf, int other, int len)
     d->ino = sbuf->st_ino;
     d->fd = fd;
 #ifdef FD_CLOEXEC
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (fd != -1)
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
 #endif
     d->map = addr + (other ? (len - off) / sizeof(wordcode) : 0);
     d->addr = addr;
@@ -3736,6 +3742,24 @@ load_dump_file(char *dump, struct stat *sbuf, int other, int len)
 /**/
 #endif
 
+/* Call func for the name of every function in a dump file.  Return 1
+ * if the file isn't a valid dump file. */
+
+/**/
+int
+scandumpfuncs(char *file, ScanNameFunc func, int arg)
+{
+    Wordcode d;
+    FDHead h, e;
+
+    if (!(d = load_dump_header(NULL, file, 0)))
+	return 1;
+    e = (FDHead) (d + fdheaderlen(d));
+    for (h = firstfdhead(d); h < e; h = nextfdhead(h))
+	func(fdname(h) + fdhtail(h), arg);
+    return 0;
+}
+
 /* Try to load a function from one of the possible wordcode files for it.
  * The first argument is a element of $fpath, the second one is the name
  * of the function searched and the last one is the possible name for the
@@ -3752,7 +3776,7 @@ try_dump_file(char *path, char *name, char *file, int *ksh, int test_only)
 
     if (strsfx(FD_EXT, path)) {
 	queue_signals();
-	prog = check_dump_file(path, NULL, name, ksh, test_only);
+	prog = check_dump_file(path, NULL, name, NULL, ksh, test_only);
 	unqueue_signals();
 	return prog;
     }
@@ -3771,14 +3795,14 @@ try_dump_file(char *path, char *name, char *file, int *ksh, int test_only)
     if (!rd &&
 	(rc || std.st_mtime >= stc.st_mtime) &&
 	(rn || std.st_mtime >= stn.st_mtime) &&
-	(prog = check_dump_file(dig, &std, name, ksh, test_only))) {
+	(prog = check_dump_file(dig, &std, name, NULL, ksh, test_only))) {
 	unqueue_signals();
 	return prog;
     }
     /* No digest file. Now look for the per-function compiled file. */
     if (!rc &&
 	(rn || stc.st_mtime >= stn.st_mtime) &&
-	(prog = check_dump_file(wc, &stc, name, ksh, test_only))) {
+	(prog = check_dump_file(wc, &stc, name, NULL, ksh, test_only))) {
 	unqueue_signals();
 	return prog;
     }
@@ -3806,7 +3830,7 @@ try_source_file(char *file)
 
     if (strsfx(FD_EXT, file)) {
 	queue_signals();
-	prog = check_dump_file(file, NULL, tail, NULL, 0);
+	prog = check_dump_file(file, NULL, tail, NULL, NULL, 0);
 	unqueue_signals();
 	return prog;
     }
@@ -3817,7 +3841,7 @@ try_source_file(char *file)
 
     queue_signals();
     if (!rc && (rn || stc.st_mtime >= stn.st_mtime) &&
-	(prog = check_dump_file(wc, &stc, tail, NULL, 0))) {
+	(prog = check_dump_file(wc, &stc, tail, NULL, NULL, 0))) {
 	unqueue_signals();
 	return prog;
     }
@@ -3825,13 +3849,143 @@ try_source_file(char *file)
     return NULL;
 }
 
+/*
+ * Wordcode cache for autoloaded functions.  If $ZSH_AUTOLOAD_CACHE names
+ * a directory, every function file parsed by getfpfunc() is also
+ * written there as a zwc file of its own, named after a hash of the
+ * file's path.  The name stored for the function in the dump is a key
+ * made of the options and history characters affecting the parser, the
+ * file's device, inode, size and modification time (to the nanosecond
+ * where available) and its full path; the version of the shell is
+ * checked by load_dump_header() anyway.  When the function is next
+ * loaded, by this or another shell, the dump is used if the key still
+ * matches, else the file is parsed and the dump replaced.  Files
+ * modified within the last second aren't written to the cache, since
+ * they could change again without the time changing.
+ *
+ * Functions can only be cached if aliases can't have changed the
+ * result of parsing them and if no reserved words are disabled.
+ */
+
+static int autoload_cache_opts[] = {
+    CSHJUNKIELOOPS, CSHJUNKIEQUOTES, IGNOREBRACES, IGNORECLOSEBRACES,
+    KSHGLOB, MULTIFUNCDEF, POSIXBUILTINS, POSIXIDENTIFIERS, RCQUOTES,
+    SHGLOB, SHORTLOOPS, SHORTREPEAT, 0
+};
+
+/* Return the name of the cache file for `file', and the key in *keyp. */
+
+static char *
+autoload_cache_name(char *file, struct stat *st, char **keyp)
+{
+    char *dir, *key;
+    int i, o = 0;
+    HashNode hn;
+
+    if (!(dir = getsparam("ZSH_AUTOLOAD_CACHE")) || !*dir || *file != '/')
+	return NULL;
+    if (!noaliases && isset(ALIASESOPT) &&
+	(aliastab->ct || sufaliastab->ct))
+	return NULL;
+    for (i = 0; i < reswdtab->hsize; i++)
+	for (hn = reswdtab->nodes[i]; hn; hn = hn->next)
+	    if (hn->flags & DISABLED)
+		return NULL;
+
+    for (i = 0; autoload_cache_opts[i]; i++)
+	if (isset(autoload_cache_opts[i]))
+	    o |= 1 << i;
+    key = zhalloc(strlen(file) + 8 * DIGBUFSIZE);
+    sprintf(key, "%x:%02x%02x%02x:%lx:%lx:%lx:%lx.%lx:", o,
+	    (unsigned) bangchar, (unsigned) hatchar, (unsigned) hashchar,
+	    (unsigned long) st->st_dev,
+	    (unsigned long) st->st_ino, (unsigned long) st->st_size,
+	    (unsigned long) st->st_mtime,
+#ifdef GET_ST_MTIME_NSEC
+	    (unsigned long) GET_ST_MTIME_NSEC(*st)
+#else
+	    0UL
+#endif
+	    );
+    strcat(key, file);
+    *keyp = metafy(key, -1, META_HEAPDUP);
+
+    dir = unmeta(dir);
+    key = zhalloc(strlen(dir) + 14);
+    sprintf(key, "%s/%08x%s", dir, hasher(file), FD_EXT);
+    return key;
+}
+
+/* Try to load the function `name' from `file' via the cache. */
+
+/**/
+Eprog
+try_autoload_cache(char *file, struct stat *st, char *name, int *ksh)
+{
+    Eprog prog;
+    struct stat stc;
+    char *dump, *key;
+
+    if (!(dump = autoload_cache_name(file, st, &key)) ||
+	zwcstat(dump, &stc) || stc.st_uid != geteuid())
+	return NULL;
+    queue_signals();
+    prog = check_dump_file(dump, &stc, name, key, ksh, 0);
+    unqueue_signals();
+    return prog;
+}
+
+/* Write the function just parsed from `file' to the cache. */
+
+/**/
+void
+write_autoload_cache(char *file, struct stat *st, Eprog prog)
+{
+    LinkList progs;
+    WCFunc wcf;
+    char *dump, *key, *tmp;
+    int dfd, hlen, tlen;
+
+    if ((long) st->st_mtime >= (long) time(NULL) - 1 ||
+	!(dump = autoload_cache_name(file, st, &key)))
+	return;
+    tmp = zhalloc(strlen(dump) + DIGBUFSIZE + 1);
+    sprintf(tmp, "%s.%ld", dump, (long) getpid());
+    if ((dfd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY, 0444)) < 0) {
+	char *dir = unmeta(getsparam("ZSH_AUTOLOAD_CACHE"));
+
+	if (errno != ENOENT || mkdir(dir, 0700) ||
+	    (dfd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY, 0444)) < 0)
+	    return;
+    }
+
+    /* write_dump() byte-swaps the wordcode, so give it a copy */
+    wcf = (WCFunc) zhalloc(sizeof(*wcf));
+    wcf->name = key;
+    wcf->prog = prog = dupeprog(prog, 1);
+    wcf->flags = 0;
+    progs = newlinklist();
+    addlinknode(progs, wcf);
+    hlen = FD_PRELEN + (sizeof(struct fdhead) / sizeof(wordcode)) +
+	(strlen(key) + sizeof(wordcode)) / sizeof(wordcode);
+    tlen = (prog->len - (prog->npats * sizeof(Patprog)) +
+	    sizeof(wordcode) - 1) / sizeof(wordcode);
+    tlen = (tlen + hlen) * sizeof(wordcode);
+
+    write_dump(dfd, progs, 1, hlen, tlen);
+    if (close(dfd) || rename(tmp, dump))
+	unlink(tmp);
+}
+
 /* See if `file' names a wordcode dump file and that contains the
- * definition for the function `name'. If so, return an eprog for it. */
+ * definition for the function `name'. If so, return an eprog for it.
+ * If `fullname' is given, the name stored in the file must match it
+ * completely, not just in its last path component. */
 
 /**/
 static Eprog
-check_dump_file(char *file, struct stat *sbuf, char *name, int *ksh,
-		int test_only)
+check_dump_file(char *file, struct stat *sbuf, char *name, char *fullname,
+		int *ksh, int test_only)
 {
     int isrec = 0;
     Wordcode d;
@@ -3870,7 +4024,8 @@ check_dump_file(char *file, struct stat *sbuf, char *name, int *ksh,
     if (!f && (isrec || !(d = load_dump_header(NULL, file, 0))))
 	return NULL;
 
-    if ((h = dump_find_func(d, name))) {
+    if ((h = dump_find_func(d, name)) &&
+	(!fullname || !strcmp(fdname(h), fullname))) {
 	/* Found the name. If the file is already mapped, return the eprog,
 	 * otherwise map it and just go up. */
 	if (test_only)
@@ -3913,7 +4068,9 @@ check_dump_file(char *file, struct stat *sbuf, char *name, int *ksh,
 
 	    return prog;
 	} else if (fdflags(d) & FDF_MAP) {
-	    load_dump_file(file, sbuf, (fdflags(d) & FDF_OTHER), fdother(d));
+	    /* Cache files are never looked up by name once mapped. */
+	    load_dump_file(file, sbuf, (fdflags(d) & FDF_OTHER), fdother(d),
+			   !fullname);
 	    isrec = 1;
 	    goto rec;
 	} else
@@ -525,6 +525,283 @@ patcompstart(void)
 	patglobflags |= GF_MULTIBYTE;
 }
 
+/*
+ * Cache of compiled patterns.
+ *
+ * Patterns that appear literally in the code are compiled once and kept
+ * with the code, but one produced by an expansion, for example
+ * [[ $x = $~pat ]] or ${var#$prefix*}, used to be compiled again every
+ * time it was used.  patcompile() now keeps the last PATCACHE_SIZE such
+ * patterns in a hash table, discarding the least recently used.  An
+ * entry is keyed on the text of the pattern together with everything
+ * else that affects the result: the flags passed in, the initial
+ * globbing flags and the set of active pattern characters, which
+ * covers the options and disable -p.  Patterns for file names are
+ * compiled a segment at a time with separate state, so are not cached.
+ *
+ * The programme is self-contained, so a hit is a copy to wherever the
+ * caller wants the result.  Changing the locale empties the cache, as it
+ * affects how characters are read.
+ */
+
+#define PATCACHE_SIZE		256
+#define PATCACHE_BUCKETS	512
+
+/* Flags affecting only where the result is put, not the programme */
+#define PATCACHE_ALLOCFLAGS	(PAT_STATIC|PAT_ZDUP)
+
+typedef struct patcacheent *Patcacheent;
+
+struct patcacheent {
+    Patcacheent hnext;		/* next in hash chain */
+    Patcacheent lprev, lnext;	/* most recently used first */
+    unsigned hash;
+    int flags;			/* flags passed to patcompile() */
+    int globflags;		/* patglobflags at start */
+    char special[ZPC_COUNT];	/* zpc_special at start */
+    char *exp;			/* the pattern text */
+    long explen;		/* length of the text compiled */
+    long size;			/* size of prog */
+    Patprog prog;
+};
+
+static Patcacheent *patcachetab;
+static Patcacheent patcachefirst, patcachelast;
+
+/* Statistics for the zsh/parameter module */
+
+/**/
+mod_export int patcachecount;
+
+/**/
+mod_export zlong patcachehits, patcachemisses, patcacheevictions;
+
+static unsigned
+patcachehash(char *exp, int flags, int globflags)
+{
+    return (hasher(exp) + flags + (globflags << 16)) % PATCACHE_BUCKETS;
+}
+
+static void
+unlinkpatcache(Patcacheent ent)
+{
+    if (ent->lprev)
+	ent->lprev->lnext = ent->lnext;
+    else
+	patcachefirst = ent->lnext;
+    if (ent->lnext)
+	ent->lnext->lprev = ent->lprev;
+    else
+	patcachelast = ent->lprev;
+}
+
+static void
+freepatcache(Patcacheent ent)
+{
+    Patcacheent *entp;
+
+    for (entp = patcachetab + ent->hash; *entp != ent;
+	 entp = &(*entp)->hnext)
+	;
+    *entp = ent->hnext;
+    unlinkpatcache(ent);
+    zsfree(ent->exp);
+    zfree(ent->prog, ent->size);
+    zfree(ent, sizeof(*ent));
+    patcachecount--;
+}
+
+/* Empty the cache, when something has changed how patterns compile. */
+
+/**/
+mod_export void
+clearpatcache(void)
+{
+    while (patcachefirst)
+	freepatcache(patcachefirst);
+}
+
+/*
+ * Look for exp compiled with flags, given the current state, returning
+ * a copy allocated as the flags require, or NULL.
+ */
+
+static Patprog
+getpatcache(char *exp, int flags, char **endexp)
+{
+    Patcacheent ent;
+    Patprog p;
+    unsigned hash;
+    int keyflags = flags & ~PATCACHE_ALLOCFLAGS;
+
+    if (!patcachetab)
+	return NULL;
+    hash = patcachehash(exp, keyflags, patglobflags);
+    for (ent = patcachetab[hash]; ent; ent = ent->hnext) {
+	if (ent->flags == keyflags && ent->globflags == patglobflags &&
+	    !strcmp(ent->exp, exp) &&
+	    !memcmp(ent->special, zpc_special, ZPC_COUNT))
+	    break;
+    }
+    if (!ent) {
+	patcachemisses++;
+	return NULL;
+    }
+    patcachehits++;
+    if (ent != patcachefirst) {
+	unlinkpatcache(ent);
+	ent->lprev = NULL;
+	if ((ent->lnext = patcachefirst))
+	    patcachefirst->lprev = ent;
+	patcachefirst = ent;
+    }
+
+    if (flags & PAT_ZDUP)
+	p = (Patprog)zalloc(ent->size);
+    else if (flags & PAT_STATIC) {
+	if (patalloc < ent->size)
+	    patout = (char *)zrealloc(patout, patalloc = ent->size);
+	p = (Patprog)patout;
+    } else
+	p = (Patprog)zhalloc(ent->size);
+    memcpy((char *)p, (char *)ent->prog, ent->size);
+    if (endexp)
+	*endexp = exp + ent->explen;
+    return p;
+}
+
+/*
+ * Remember the programme p, of the given size, just compiled from the
+ * first explen characters of exp with the flags and the state saved in
+ * globflags and zpc_special.
+ */
+
+static void
+putpatcache(char *exp, int flags, int globflags, Patprog p, long size,
+	    long explen)
+{
+    Patcacheent ent;
+
+    if (!patcachetab)
+	patcachetab = (Patcacheent *)
+	    zshcalloc(PATCACHE_BUCKETS * sizeof(Patcacheent));
+    if (patcachecount == PATCACHE_SIZE) {
+	freepatcache(patcachelast);
+	patcacheevictions++;
+    }
+    ent = (Patcacheent)zalloc(sizeof(*ent));
+    ent->flags = flags & ~PATCACHE_ALLOCFLAGS;
+    ent->globflags = globflags;
+    memcpy(ent->special, zpc_special, ZPC_COUNT);
+    ent->exp = ztrdup(exp);
+    ent->explen = explen;
+    ent->size = size;
+    ent->prog = (Patprog)zalloc(size);
+    memcpy((char *)ent->prog, (char *)p, size);
+    ent->hash = patcachehash(exp, ent->flags, globflags);
+    ent->hnext = patcachetab[ent->hash];
+    patcachetab[ent->hash] = ent;
+    ent->lprev = NULL;
+    if ((ent->lnext = patcachefirst))
+	patcachefirst->lprev = ent;
+    else
+	patcachelast = ent;
+    patcachefirst = ent;
+    patcachecount++;
+}
+
+/*
+ * Largest programme we run without backtracking:  patnfamatch() allocates
+ * a few ints per byte of it.
+ */
+#define PATNFA_MAXSIZE	8192
+
+/*
+ * Nodes patmatch() may try for such a pattern before we switch to
+ * patnfamatch(), per 16 characters of the test string.
+ */
+#define PATNFA_STEPS	256
+
+/*
+ * Check if the part of a compiled pattern starting at p can be run by
+ * patnfamatch(), counting closures as we go.  visited has a byte for
+ * each node of the programme starting at progstr.
+ */
+
+static int
+patnfacheck(Upat p, char *progstr, char *visited, int *nclosures)
+{
+    for (; p; p = PATNEXT(p)) {
+	long node = ((char *)p - progstr) / sizeof(union upat);
+
+	if (visited[node])
+	    return 1;
+	visited[node] = 1;
+	switch (P_OP(p)) {
+	case P_END:
+	    return 1;
+	case P_NOTHING:
+	case P_BACK:
+	case P_EXACTLY:
+	case P_ANY:
+	case P_ANYOF:
+	case P_ANYBUT:
+	case P_ISSTART:
+	case P_ISEND:
+	    break;
+	case P_STAR:
+	case P_ONEHASH:
+	case P_TWOHASH:
+	    (*nclosures)++;
+	    break;
+	case P_WBRANCH:
+	    (*nclosures)++;
+	    /*FALLTHROUGH*/
+	case P_BRANCH:
+	    if (!patnfacheck(P_OPERAND(p) + (P_OP(p) == P_WBRANCH),
+			     progstr, visited, nclosures))
+		return 0;
+	    break;
+	default:
+	    /*
+	     * Exclusions, numeric ranges, counts, backreferences and
+	     * changes of globbing flags all need the backtracking matcher.
+	     */
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Decide whether a compiled pattern can be matched with patnfamatch()
+ * if backtracking takes too long.  That needs the match to be anchored
+ * at the end, since callers of unanchored matches rely on the end
+ * point patmatch() finds first.  It's only worth it when there are two
+ * or more closures:  with fewer, backtracking can't take more than time
+ * proportional to the length of the string times the size of the
+ * pattern anyway.
+ */
+
+static int
+patnfaok(Patprog p)
+{
+    long size = p->size - p->startoff;
+    int nclosures = 0;
+
+    if ((p->flags & (PAT_PURES|PAT_ANY|PAT_NOANCH)) || p->patnpar ||
+	(p->globflags & 0xff) || size > PATNFA_MAXSIZE)
+	return 0;
+    {
+	VARARR(char, visited, size / sizeof(union upat) + 1);
+	memset(visited, 0, size / sizeof(union upat) + 1);
+	if (!patnfacheck((Upat)((char *)p + p->startoff), (char *)p +
+			 p->startoff, visited, &nclosures))
+	    return 0;
+    }
+    return nclosures >= 2;
+}
+
 /*
  * Top level pattern compilation subroutine
  * exp is a null-terminated, metafied string.
@@ -539,11 +816,11 @@ patcompstart(void)
 mod_export Patprog
 patcompile(char *exp, int inflags, char **endexp)
 {
-    int flags = 0;
+    int flags = 0, cacheglobflags = 0;
     long len = 0;
     long startoff;
     Upat pscan;
-    char *lng, *strp = NULL;
+    char *lng, *strp = NULL, *cacheexp = NULL;
     Patprog p;
 
     queue_signals();
@@ -576,6 +853,14 @@ patcompile(char *exp, int inflags, char **endexp)
     }
     if (patflags & PAT_LCMATCHUC)
 	patglobflags |= GF_LCMATCHUC;
+    if (!(patflags & PAT_FILE)) {
+	if ((p = getpatcache(exp, inflags, endexp))) {
+	    unqueue_signals();
+	    return p;
+	}
+	cacheexp = exp;
+	cacheglobflags = patglobflags;
+    }
     /*
      * Have to be set now, since they get updated during compilation.
      */
@@ -636,6 +921,7 @@ patcompile(char *exp, int inflags, char **endexp)
     p->globend = patglobflags;
     p->flags = patflags;
     p->mustoff = 0;
+    p->preoff = p->prelen = p->sufoff = p->suflen = 0;
     p->size = patsize;
     p->patmlen = len;
     p->patnpar = patnpar-1;
@@ -710,19 +996,50 @@ patcompile(char *exp, int inflags, char **endexp)
 		    P_LS_LEN(pscan))
 		    p->patstartch = *P_LS_STR(pscan);
 		/*
-		 * Find the longest literal string in something expensive.
-		 * This is itself not all that cheap if we have
+		 * Find literal strings at the start and end of the
+		 * pattern, and the longest literal string elsewhere,
+		 * so that pattryrefs() can reject most strings that
+		 * can't match without calling patmatch().  Only nodes
+		 * on the top level chain must match; we stop at a
+		 * change of globbing flags.  This isn't possible for
 		 * case-insensitive matching or approximation, so don't.
 		 */
-		if ((flags & P_HSTART) && !p->globflags) {
+		if (!(p->globflags &
+		      ~(GF_MULTIBYTE|GF_BACKREF|GF_MATCHREF))) {
+		    Upat first = pscan, last = NULL;
+		    int gfchange = 0;
+
 		    lng = NULL;
 		    len = 0;
-		    for (; pscan; pscan = PATNEXT(pscan))
-			if (P_OP(pscan) == P_EXACTLY &&
-			    P_LS_LEN(pscan) >= len) {
-			    lng = P_LS_STR(pscan);
-			    len = P_LS_LEN(pscan);
+		    for (; pscan && P_OP(pscan) != P_END;
+			 pscan = PATNEXT(pscan)) {
+			if (P_OP(pscan) == P_GFLAGS) {
+			    gfchange = 1;
+			    break;
+			}
+			/* last isn't the end after all */
+			if (last && last != first &&
+			    P_OP(last) == P_EXACTLY &&
+			    P_LS_LEN(last) > len) {
+			    lng = P_LS_STR(last);
+			    len = P_LS_LEN(last);
+			}
+			last = pscan;
+		    }
+		    if (P_OP(first) == P_EXACTLY && P_LS_LEN(first)) {
+			p->preoff = P_LS_STR(first) - patout;
+			p->prelen = P_LS_LEN(first);
+		    }
+		    if (last && last != first && P_OP(last) == P_EXACTLY &&
+			P_LS_LEN(last)) {
+			if (!gfchange) {
+			    p->sufoff = P_LS_STR(last) - patout;
+			    p->suflen = P_LS_LEN(last);
+			} else if (P_LS_LEN(last) > len) {
+			    lng = P_LS_STR(last);
+			    len = P_LS_LEN(last);
 			}
+		    }
 		    if (lng) {
 			p->mustoff = lng - patout;
 			p->patmlen = len;
@@ -732,6 +1049,13 @@ patcompile(char *exp, int inflags, char **endexp)
 	}
     }
 
+    if (patnfaok(p))
+	p->flags |= PAT_NFA;
+
+    if (cacheexp)
+	putpatcache(cacheexp, inflags, cacheglobflags, p, patsize,
+		    patparse - cacheexp);
+
     /*
      * The pattern was compiled in a fixed buffer:  unless told otherwise,
      * we stick the compiled pattern on the heap.  This is necessary
@@ -1888,6 +2212,7 @@ struct rpat {
     int parsfound;		/* parentheses (with backrefs) found */
 
     int globdots;		/* Glob initial dots? */
+    long patsteps;		/* Nodes patmatch() may try, if not 0 */
 };
 
 static struct rpat pattrystate;
@@ -1901,6 +2226,7 @@ static struct rpat pattrystate;
 #define patendp		(pattrystate.patendp)
 #define parsfound	(pattrystate.parsfound)
 #define globdots	(pattrystate.globdots)
+#define patsteps	(pattrystate.patsteps)
 
 
 /*
@@ -2219,6 +2545,27 @@ char *patallocstr(Patprog prog, char *string, int stringlen, int unmetalen,
 }
 
 
+/*
+ * Find a literal string in the test string.  The libc memmem()
+ * is usually much faster than the naive loop.
+ */
+
+/**/
+mod_export char *
+patmemmem(char *str, long len, char *lit, long litlen)
+{
+#ifdef HAVE_MEMMEM
+    return (char *)memmem(str, len, lit, litlen);
+#else
+    char *stop = str + len - litlen;
+
+    for (; str <= stop; str++)
+	if (*str == *lit && !memcmp(str, lit, litlen))
+	    return str;
+    return NULL;
+#endif
+}
+
 /*
  * Test prog against null-terminated, metafied string.
  */
@@ -2453,37 +2800,30 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalenin,
 	}
     } else {
 	/*
-	 * Test for a `must match' string, unless we're scanning for a match
-	 * in which case we don't need to do this each time.
+	 * Test for literal strings the test string must start or
+	 * end with, then for a `must match' string in between,
+	 * unless we're scanning for a match in which case we don't
+	 * need to do that each time.
 	 */
-	ret = 1;
-	if (!(prog->flags & PAT_SCAN) && prog->mustoff)
-	{
-	    char *testptr;	/* start pointer into test string */
-	    char *teststop;	/* last point from which we can match */
-	    char *patptr = (char *)prog + prog->mustoff;
-	    int patlen = prog->patmlen;
-	    int found = 0;
-
-	    if (patlen > stringlen) {
-		/* Too long, can't match. */
-		ret = 0;
-	    } else {
-		teststop = patinend - patlen;
-
-		for (testptr = patinstart; testptr <= teststop; testptr++)
-		{
-		    if (!memcmp(testptr, patptr, patlen)) {
-			found = 1;
-			break;
-		    }
-		}
+	char *teststart = patinstart;	/* start of unchecked test string */
+	char *teststop = patinend;	/* end of unchecked test string */
 
-		if (!found)
-		    ret = 0;
-	    }
+	if (prog->prelen) {
+	    if (prog->prelen > stringlen ||
+		memcmp(patinstart, (char *)prog + prog->preoff, prog->prelen))
+		return 0;
+	    teststart += prog->prelen;
 	}
-	if (!ret)
+	if (prog->suflen && !(prog->flags & PAT_NOANCH)) {
+	    if (prog->suflen > teststop - teststart ||
+		memcmp(teststop - prog->suflen, (char *)prog + prog->sufoff,
+		       prog->suflen))
+		return 0;
+	    teststop -= prog->suflen;
+	}
+	if (!(prog->flags & PAT_SCAN) && prog->mustoff &&
+	    !patmemmem(teststart, teststop - teststart,
+		       (char *)prog + prog->mustoff, prog->patmlen))
 	    return 0;
 
 	patglobflags = prog->globflags;
@@ -2497,8 +2837,16 @@ pattryrefs(Patprog prog, char *string, int stringlen, int unmetalenin,
 	patinput = patinstart;
 
 	exactpos = exactend = NULL;
+	/*
+	 * Backtracking is usually quickest, but for patterns that can
+	 * be matched without it we limit the steps it can take and
+	 * start again with patnfamatch() if it runs out.
+	 */
+	patsteps = (patflags & PAT_NFA) ?
+	    PATNFA_STEPS + PATNFA_STEPS * (long)stringlen / 16 : 0;
 	/* The only external call to patmatch --- all others are recursive */
-	if (patmatch((Upat)progstr)) {
+	if (patmatch((Upat)progstr) ||
+	    (patsteps < 0 && patnfamatch(prog))) {
 	    /*
 	     * we were lazy and didn't save the globflags if an exclusion
 	     * failed, so set it now
@@ -2726,6 +3074,11 @@ patmatch(Upat prog)
     check_for_signals();
 
     while  (scan && !errflag) {
+	/* Give up when out of steps:  see pattryrefs(). */
+	if (patsteps && (patsteps < 0 || !--patsteps)) {
+	    patsteps = -1;
+	    return 0;
+	}
 	next = PATNEXT(scan);
 
 	if (!globdots && P_NOTDOT(scan) && patinput == patinstart &&
@@ -3297,34 +3650,43 @@ patmatch(Upat prog)
 	    op = P_OP(scan);
 	    /* Note that no counts possibly metafied characters */
 	    start = patinput;
+	    if (op == P_STAR) {
+		for (no = 0; patinput < patinend; CHARINC(patinput, patinend))
+		    no++;
+		/* simple optimization for reasonably common case */
+		if (P_OP(next) == P_END)
+		    return 1;
+	    } else {
+		DPUTS(patglobflags & 0xff,
+		      "BUG: wrong backtracking with approximation.");
+		if (!globdots && P_NOTDOT(P_OPERAND(scan)) &&
+		    patinput == patinstart && patinput < patinend &&
+		    CHARREF(patinput, patinend) == ZWC('.'))
+		    return 0;
+		no = patrepeat(P_OPERAND(scan));
+	    }
 	    {
 		char *lastcharstart;
 		/*
 		 * Array to record the start of characters for
-		 * backtracking.
+		 * backtracking.  This is only as long as the part
+		 * we matched, not the rest of the string, since
+		 * this is tried at every position when looking
+		 * for substrings.
 		 */
-		VARARR(char, charstart, patinend-patinput);
-		memset(charstart, 0, patinend-patinput);
-
-		if (op == P_STAR) {
-		    for (no = 0; patinput < patinend;
-			 CHARINC(patinput, patinend))
-		    {
-			charstart[patinput-start] = 1;
-			no++;
-		    }
-		    /* simple optimization for reasonably common case */
-		    if (P_OP(next) == P_END)
-			return 1;
-		} else {
-		    DPUTS(patglobflags & 0xff,
-			  "BUG: wrong backtracking with approximation.");
-		    if (!globdots && P_NOTDOT(P_OPERAND(scan)) &&
-			patinput == patinstart && patinput < patinend &&
-			CHARREF(patinput, patinend) == ZWC('.'))
-			return 0;
-		    no = patrepeat(P_OPERAND(scan), charstart);
-		}
+		VARARR(char, charstart, patinput - start + 1);
+#ifdef MULTIBYTE_SUPPORT
+		if (patglobflags & GF_MULTIBYTE) {
+		    char *ptr;
+
+		    memset(charstart, 0, patinput - start);
+		    for (ptr = start; ptr < patinput; CHARINC(ptr, patinend))
+			charstart[ptr - start] = 1;
+		} else
+#endif
+		    memset(charstart, 1, patinput - start);
+		charstart[patinput - start] = 0;
+
 		min = (op == P_TWOHASH) ? 1 : 0;
 		/*
 		 * Lookahead to avoid useless matches. This is not possible
@@ -3588,6 +3950,264 @@ patmatch(Upat prog)
     return 0;
 }
 
+/*
+ * Non-backtracking matcher for patterns flagged PAT_NFA by
+ * patnfaok().  All the ways the pattern could match the string so far
+ * are advanced together one character at a time, so the time taken is
+ * proportional to the length of the string times the size of the
+ * pattern however the closures are nested.
+ *
+ * A state is a node that consumes a character, identified by its
+ * offset in the programme.  A position part way through the string of
+ * a P_EXACTLY is identified by the offset of the next character of the
+ * string, and a P_ONEHASH or P_TWOHASH that has already matched
+ * a character by the offset of the node plus one.  Neither of those
+ * can be the offset of another node.
+ */
+
+struct nfathread {
+    int id;			/* offset identifying the state */
+    Upat node;			/* node that consumes the next character */
+};
+
+struct patnfa {
+    char *prog;			/* start of the programme */
+    int *mark;			/* step at which each offset was last added */
+    int step;			/* current step */
+    int accept;			/* reached P_END at the end of the string */
+    struct nfathread *threads;	/* states for the next character */
+    int nthreads;		/* number of those */
+};
+
+/*
+ * Test a character against a P_ANYOF or P_ANYBUT node.
+ * zmb_ind is as returned by charref().
+ */
+
+static int
+patnfarange(Upat p, patint_t ch, int zmb_ind)
+{
+    char *range = (char *)P_OPERAND(p);
+
+#ifdef MULTIBYTE_SUPPORT
+    if (patglobflags & GF_MULTIBYTE)
+	return mb_patmatchrange(range, ch, zmb_ind, NULL, NULL) ^
+	    (P_OP(p) == P_ANYBUT);
+    return patmatchrange(range, (int)ch, NULL, NULL) ^ (P_OP(p) == P_ANYBUT);
+#else
+    return patmatchrange(range, ch, NULL, NULL) ^ (P_OP(p) == P_ANYBUT);
+#endif
+}
+
+/*
+ * Add to the list the states reachable from node p without consuming
+ * a character, with pos the current position in the string.  idp
+ * is the address identifying the state:  p itself, unless we are
+ * part way through a P_EXACTLY or repeating a closure.
+ */
+
+static void
+patnfaadd(struct patnfa *nfa, Upat p, char *idp, char *pos)
+{
+    int id = idp - nfa->prog;
+
+    if (nfa->mark[id] == nfa->step)
+	return;
+    nfa->mark[id] = nfa->step;
+
+    if (idp != (char *)p) {
+	nfa->threads[nfa->nthreads].id = id;
+	nfa->threads[nfa->nthreads++].node = p;
+	/* A closure may also stop here. */
+	if (P_OP(p) != P_EXACTLY) {
+	    p = PATNEXT(p);
+	    patnfaadd(nfa, p, (char *)p, pos);
+	}
+	return;
+    }
+
+    /* As at the top of the loop in patmatch() */
+    if (!globdots && P_NOTDOT(p) && pos == patinstart &&
+	pos < patinend && *pos == '.')
+	return;
+
+    switch (P_OP(p)) {
+    case P_END:
+	if (pos == patinend)
+	    nfa->accept = 1;
+	return;
+    case P_ISSTART:
+	if (pos != patinstart || (patflags & PAT_NOTSTART))
+	    return;
+	break;
+    case P_ISEND:
+	if (pos < patinend || (patflags & PAT_NOTEND))
+	    return;
+	break;
+    case P_NOTHING:
+    case P_BACK:
+	break;
+    case P_BRANCH:
+    case P_WBRANCH:
+	/*
+	 * Try all alternatives.  We don't need the P_WBRANCH test for
+	 * empty matches, since adding the same state twice does nothing.
+	 */
+	for (; p && P_ISBRANCH(p); p = PATNEXT(p)) {
+	    Upat opnd = P_OPERAND(p) + (P_OP(p) == P_WBRANCH);
+	    patnfaadd(nfa, opnd, (char *)opnd, pos);
+	}
+	return;
+    case P_EXACTLY:
+	if (!P_LS_LEN(p))
+	    break;
+	/*FALLTHROUGH*/
+    case P_ANY:
+    case P_ANYOF:
+    case P_ANYBUT:
+	nfa->threads[nfa->nthreads].id = id;
+	nfa->threads[nfa->nthreads++].node = p;
+	return;
+    case P_ONEHASH:
+    case P_TWOHASH:
+	/* As in patmatch() */
+	if (!globdots && P_NOTDOT(P_OPERAND(p)) && pos == patinstart &&
+	    pos < patinend && CHARREF(pos, patinend) == ZWC('.'))
+	    return;
+	/*FALLTHROUGH*/
+    case P_STAR:
+	nfa->threads[nfa->nthreads].id = id;
+	nfa->threads[nfa->nthreads++].node = p;
+	if (P_OP(p) == P_TWOHASH)
+	    return;
+	break;
+    }
+    p = PATNEXT(p);
+    patnfaadd(nfa, p, (char *)p, pos);
+}
+
+/*
+ * Advance a state over the character ch, which ends at npos.
+ * bad and zmb_ind say if it wasn't a valid character.
+ */
+
+static void
+patnfastep(struct patnfa *nfa, struct nfathread *t, patint_t ch,
+	   int bad, int zmb_ind, char *npos)
+{
+    Upat p = t->node, opnd;
+    patint_t chpa;
+
+    switch (P_OP(p)) {
+    case P_EXACTLY:
+	{
+	    char *chrop = nfa->prog + t->id;
+	    char *chrend = P_LS_STR(p) + P_LS_LEN(p);
+	    int badpa = 0;
+
+	    if (chrop == (char *)p)
+		chrop = P_LS_STR(p);
+	    chpa = CHARREFINC(chrop, chrend, &badpa);
+	    if (!CHARMATCH(ch, chpa) || bad != badpa)
+		return;
+	    if (chrop < chrend) {
+		patnfaadd(nfa, p, chrop, npos);
+		return;
+	    }
+	}
+	break;
+    case P_ANY:
+	break;
+    case P_ANYOF:
+    case P_ANYBUT:
+	if (!patnfarange(p, ch, zmb_ind))
+	    return;
+	break;
+    case P_STAR:
+	patnfaadd(nfa, p, (char *)p, npos);
+	return;
+    case P_ONEHASH:
+    case P_TWOHASH:
+	/* As in patrepeat() */
+	opnd = P_OPERAND(p);
+	if (P_OP(opnd) == P_EXACTLY) {
+	    chpa = CHARREF(P_LS_STR(opnd), P_LS_STR(opnd) + P_LS_LEN(opnd));
+	    if (!CHARMATCH(ch, chpa))
+		return;
+	} else if (P_OP(opnd) != P_ANY && !patnfarange(opnd, ch, zmb_ind))
+	    return;
+	patnfaadd(nfa, p, (char *)p + 1, npos);
+	return;
+    }
+    p = PATNEXT(p);
+    patnfaadd(nfa, p, (char *)p, npos);
+}
+
+/*
+ * Match the string from patinstart to patinend against prog, which
+ * must be anchored at both ends.  Returns 1 and sets patinput to
+ * patinend if it matched, else 0.
+ */
+
+/**/
+static int
+patnfamatch(Patprog prog)
+{
+    char *progstr = (char *)prog + prog->startoff, *pos = patinstart;
+    long size = prog->size - prog->startoff;
+    struct nfathread *cur, *threads1, *threads2;
+    struct patnfa nfa;
+    int i, n, *mark;
+    /*
+     * A state is identified by its offset in the programme, not by
+     * node, since it may be part way through a string.  That's too
+     * much for the stack when matches nest, so allocate it.
+     */
+    size_t alloc = size * (sizeof(int) + 2 * sizeof(struct nfathread));
+    char *mem = (char *)zshcalloc(alloc);
+
+    threads1 = (struct nfathread *)mem;
+    threads2 = threads1 + size;
+    mark = (int *)(threads2 + size);
+    nfa.prog = progstr;
+    nfa.mark = mark;
+    nfa.step = 1;
+    nfa.accept = 0;
+    nfa.threads = threads1;
+    nfa.nthreads = 0;
+    patnfaadd(&nfa, (Upat)progstr, progstr, pos);
+
+    while (pos < patinend && nfa.nthreads) {
+	char *npos = pos;
+	patint_t ch;
+	int bad = 0, zmb_ind = 0;
+
+#ifdef MULTIBYTE_SUPPORT
+	zmb_ind = ZMB_VALID;
+	ch = charref(pos, patinend, &zmb_ind);
+	bad = (zmb_ind != ZMB_VALID);
+#else
+	ch = CHARREF(pos, patinend);
+#endif
+	CHARINC(npos, patinend);
+
+	cur = nfa.threads;
+	n = nfa.nthreads;
+	nfa.threads = (cur == threads1) ? threads2 : threads1;
+	nfa.nthreads = 0;
+	nfa.step++;
+	for (i = 0; i < n; i++)
+	    patnfastep(&nfa, cur + i, ch, bad, zmb_ind, npos);
+	pos = npos;
+    }
+
+    zfree(mem, alloc);
+    if (!nfa.accept)
+	return 0;
+    patinput = patinend;
+    return 1;
+}
+
 
 /**/
 #ifdef MULTIBYTE_SUPPORT
@@ -4095,14 +4715,12 @@ patmatchindex(char *range, int ind, int *chr, int *mtp)
 #endif /* MULTIBYTE_SUPPORT */
 
 /*
- * Repeatedly match something simple and say how many times.
- * charstart is an array parallel to that starting at patinput
- * and records the start of (possibly multibyte) characters
- * to aid in later backtracking.
+ * Repeatedly match something simple and say how many times,
+ * leaving patinput after the last match.
  */
 
 /**/
-static int patrepeat(Upat p, char *charstart)
+static int patrepeat(Upat p)
 {
     int count = 0;
     patint_t tch, charmatch_cache;
@@ -4123,7 +4741,6 @@ static int patrepeat(Upat p, char *charstart)
 	tch = CHARREF(P_LS_STR(p), P_LS_STR(p) + P_LS_LEN(p));
 	while (scan < patinend &&
 	       CHARMATCH_EXPR(CHARREF(scan, patinend), tch)) {
-	    charstart[scan-patinput] = 1;
 	    count++;
 	    CHARINC(scan, patinend);
 	}
@@ -4146,7 +4763,6 @@ static int patrepeat(Upat p, char *charstart)
 		(P_OP(p) == P_ANYOF))
 		break;
 #endif
-	    charstart[scan-patinput] = 1;
 	    count++;
 	    CHARINC(scan, patinend);
 	}
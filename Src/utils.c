@@ -5203,43 +5203,31 @@ ztrsub(char const *t, char const *s)
 }
 
 /*
- * Wrapper for readdir().
- *
- * If ignoredots is true, skip the "." and ".." entries.
+ * Convert a name returned by readdir() to the form used by the shell.
  *
- * When __APPLE__ is defined, recode dirent names from UTF-8-MAC to UTF-8.
+ * When __APPLE__ is defined, recode the name from UTF-8-MAC to UTF-8.
  *
- * Return the dirent's name, metafied.
+ * Return the name, metafied, in static storage.
  */
 
 /**/
 mod_export char *
-zreaddir(DIR *dir, int ignoredots)
+zdirentname(char *name)
 {
-    struct dirent *de;
 #if defined(HAVE_ICONV) && defined(__APPLE__)
     static iconv_t conv_ds = (iconv_t)0;
     static char *conv_name = 0;
     char *conv_name_ptr, *orig_name_ptr;
     size_t conv_name_len, orig_name_len;
-#endif
-
-    do {
-	de = readdir(dir);
-	if(!de)
-	    return NULL;
-    } while(ignoredots && de->d_name[0] == '.' &&
-	(!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])));
 
-#if defined(HAVE_ICONV) && defined(__APPLE__)
     if (!conv_ds)
 	conv_ds = iconv_open("UTF-8", "UTF-8-MAC");
     if (conv_ds != (iconv_t)(-1)) {
 	/* Force initial state in case re-using conv_ds */
 	(void) iconv(conv_ds, 0, &orig_name_len, 0, &conv_name_len);
 
-	orig_name_ptr = de->d_name;
-	orig_name_len = strlen(de->d_name);
+	orig_name_ptr = name;
+	orig_name_len = strlen(name);
 	conv_name = zrealloc(conv_name, orig_name_len+1);
 	conv_name_ptr = conv_name;
 	conv_name_len = orig_name_len;
@@ -5255,7 +5243,31 @@ zreaddir(DIR *dir, int ignoredots)
     }
 #endif
 
-    return metafy(de->d_name, -1, META_STATIC);
+    return metafy(name, -1, META_STATIC);
+}
+
+/*
+ * Wrapper for readdir().
+ *
+ * If ignoredots is true, skip the "." and ".." entries.
+ *
+ * Return the dirent's name as converted by zdirentname().
+ */
+
+/**/
+mod_export char *
+zreaddir(DIR *dir, int ignoredots)
+{
+    struct dirent *de;
+
+    do {
+	de = readdir(dir);
+	if(!de)
+	    return NULL;
+    } while(ignoredots && de->d_name[0] == '.' &&
+	(!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])));
+
+    return zdirentname(de->d_name);
 }
 
 /* Unmetafy and output a string.  Tokens are skipped. */
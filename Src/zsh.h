@@ -513,6 +513,7 @@ typedef struct builtin   *Builtin;
 typedef struct cmdnam    *Cmdnam;
 typedef struct complist  *Complist;
 typedef struct conddef   *Conddef;
+typedef struct dirlisting *Dirlisting;
 typedef struct dirsav    *Dirsav;
 typedef struct emulation_options *Emulation_options;
 typedef struct execcmd_params *Execcmd_params;
@@ -531,6 +532,7 @@ typedef struct jobfile   *Jobfile;
 typedef struct job       *Job;
 typedef struct linkedmod *Linkedmod;
 typedef struct linknode  *LinkNode;
+typedef struct mathprog  *Mathprog;
 typedef union  linkroot  *LinkList;
 typedef struct module    *Module;
 typedef struct nameddir  *Nameddir;
@@ -1189,12 +1191,17 @@ typedef int      (*CompareFunc)    (const char *, const char *);
 typedef void     (*ScanFunc)       (HashNode, int);
 typedef void     (*ScanTabFunc)    (HashTable, ScanFunc, int);
 
+/* type of function passed names by scandirlisting() and scandumpfuncs() */
+typedef void     (*ScanNameFunc)   (char *, int);
+
 typedef void (*PrintTableStats) (HashTable);
 
 /* Hash table for standard open hashing. Instances of struct hashtable can be *
  * created only by newhashtable(). In fact, this function creates an instance *
  * of struct hashtableimpl, which is made of struct hashtable (public part)   *
- * and additional data members that are only accessible from hashtable.c.     */
+ * and additional data members that are only accessible from hashtable.c.     *
+ * Tables created by newopenhashtable() use open addressing instead; nodes[]  *
+ * then holds at most one node per hash value, and next is always NULL.       */
 
 struct hashtable {
     /* HASHTABLE DATA */
@@ -1602,6 +1609,10 @@ struct patprog {
     long		size;	   /* total size from start of struct */
     long		mustoff;   /* offset to string that must be present */
     long		patmlen;   /* length of pure string or longest match */
+    long		preoff;	   /* offset to literal the string starts with */
+    long		prelen;	   /* length of that, or 0 */
+    long		sufoff;	   /* offset to literal the string ends with */
+    long		suflen;	   /* length of that, or 0 */
     int			globflags; /* globbing flags to set at start */
     int			globend;   /* globbing flags set after finish */
     int			flags;	   /* PAT_* flags */
@@ -1634,6 +1645,7 @@ struct patstralloc {
 #define PAT_NOTEND	0x0400	/* End of string is not real end */
 #define PAT_HAS_EXCLUDP	0x0800	/* (internal): top-level path1~path2. */
 #define PAT_LCMATCHUC   0x1000  /* equivalent to setting (#l) */
+#define PAT_NFA		0x2000	/* (internal): match without backtracking */
 
 /**
  * Indexes into the array of active pattern characters.
@@ -1756,6 +1768,13 @@ struct imatchdata {
      * is anchored.  It goes on the heap.
      */
     LinkList repllist;
+    /*
+     * Offset into ustr up to which we have counted characters
+     * needing metafication, and the count, so that each of a series of
+     * global matches doesn't start counting from the beginning.
+     */
+    int umetaoff;
+    int umetaadd;
 };
 
 /* Globbing flags: lower 8 bits gives approx count */
@@ -1863,6 +1882,10 @@ struct param {
     char *ename;		/* name of corresponding environment var */
     Param old;			/* old struct for use with local         */
     int level;			/* if (old != NULL), level of localness  */
+    int vallen;			/* for a plain scalar or array, length   */
+    int valsize;		/* and allocated size of u.str or u.arr  */
+				/* if valsize is non-zero: see           */
+				/* setarrvalue(), assignstrvalue()       */
 };
 
 /* structure stored in struct param's u.data by tied arrays */
@@ -2255,6 +2278,7 @@ struct histent {
 #define HIST_FOREIGN	0x00000010	/* Command came from another shell */
 #define HIST_TMPSTORE	0x00000020	/* Kill when user enters another cmd */
 #define HIST_NOWRITE	0x00000040	/* Keep internally but don't write */
+#define HIST_MAPPED	0x00000080	/* Text and words are in a mapped index */
 
 #define GETHIST_UPWARD  (-1)
 #define GETHIST_DOWNWARD  1
@@ -2277,6 +2301,7 @@ struct histent {
 #define HFILE_SKIPFOREIGN	0x0008
 #define HFILE_FAST		0x0010
 #define HFILE_NO_REWRITE	0x0020
+#define HFILE_UNLOCKED		0x0040
 #define HFILE_USE_OPTIONS	0x8000
 
 /*
@@ -2398,6 +2423,7 @@ enum {
     CLOBBER,
     CLOBBEREMPTY,
     APPENDCREATE,
+    CMDSUBSTINSHELL,
     COMBININGCHARS,
     COMPLETEALIASES,
     COMPLETEINWORD,
@@ -2428,6 +2454,7 @@ enum {
     GLOBASSIGN,
     GLOBCOMPLETE,
     GLOBDOTS,
+    GLOBPARALLEL,
     GLOBSTARSHORT,
     GLOBSUBST,
     HASHCMDS,
@@ -2435,6 +2462,7 @@ enum {
     HASHEXECUTABLESONLY,
     HASHLISTALL,
     HISTALLOWCLOBBER,
+    HISTATOMICAPPEND,
     HISTBEEP,
     HISTEXPIREDUPSFIRST,
     HISTFCNTLLOCK,
@@ -2442,6 +2470,7 @@ enum {
     HISTIGNOREALLDUPS,
     HISTIGNOREDUPS,
     HISTIGNORESPACE,
+    HISTINDEX,
     HISTLEXWORDS,
     HISTNOFUNCTIONS,
     HISTNOSTORE,
@@ -2675,7 +2704,9 @@ struct ttyinfo {
 #define TCBGCOLOUR     36
 #define TCCURINV       37
 #define TCCURVIS       38
-#define TC_COUNT       39
+#define TCMULTINSLINE  39
+#define TCMULTDELLINE  40
+#define TC_COUNT       41
 
 #define tccan(X) (tclen[X])
 
@@ -384,6 +384,14 @@ struct timespec {
 # include <sys/filio.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#ifdef HAVE_SPAWN_H
+# include <spawn.h>
+#endif
+
 #ifdef HAVE_TERMIOS_H
 # ifdef __sco
    /* termios.h includes sys/termio.h instead of sys/termios.h; *